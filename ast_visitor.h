@@ -14,48 +14,140 @@ struct VISITOR
   {
     return false;
   }
+  // Called for every node, before any of the above
+  virtual bool visitEXPR(std::shared_ptr<EXPR> e)
+  {
+    return false;
+  }
 };
 
+// Visits e and everything below it, returning whether a visitor rewrote
+// anything. The walk carries on past a rewrite, into the rewritten node, so a
+// single pass does most of the work of a fixed-point loop.
 inline bool expr_visit(std::shared_ptr<EXPR> e, std::shared_ptr<VISITOR> v)
 {
-  bool changed = false;
+  bool changed = v->visitEXPR(e);
   if(auto ee = std::dynamic_pointer_cast<SEXPR>(e))
   {
-    changed = changed || v->visitSEXPR(ee);
+    changed = v->visitSEXPR(ee) || changed;
     for(auto const se : ee->exprs)
-      changed = changed || expr_visit(se, v);
+      changed = expr_visit(se, v) || changed;
   }
   else if (auto dv = std::dynamic_pointer_cast<BIDEFVAR>(e))
   {
-    changed = changed || expr_visit(dv->v, v);
+    changed = expr_visit(dv->v, v) || changed;
   }
   else if (auto f = std::dynamic_pointer_cast<USERFUNC>(e))
   {
     for (auto b : f->body)
-      changed = changed || v->visitSEXPR(b);
+      changed = expr_visit(b, v) || changed;
   }
   else if(auto ee = std::dynamic_pointer_cast<ID>(e))
   {
-    changed = changed || v->visitID(ee);
+    changed = v->visitID(ee) || changed;
   }
   else if(auto ee = std::dynamic_pointer_cast<STR>(e))
   {
-    changed = changed || v->visitSTR(ee);
+    changed = v->visitSTR(ee) || changed;
+  }
+  else if(auto ar = std::dynamic_pointer_cast<BIARITH>(e))
+  {
+    for(auto a : ar->args)
+      changed = expr_visit(a, v) || changed;
+  }
+  else if(auto pf = std::dynamic_pointer_cast<BIPARFOR>(e))
+  {
+    changed = expr_visit(pf->start, v) || changed;
+    changed = expr_visit(pf->end, v) || changed;
+    for(auto b : pf->body)
+      changed = expr_visit(b, v) || changed;
+  }
+  else if(auto sp = std::dynamic_pointer_cast<BISPAWN>(e))
+  {
+    changed = expr_visit(sp->e, v) || changed;
+  }
+  else if(auto aw = std::dynamic_pointer_cast<BIAWAIT>(e))
+  {
+    changed = expr_visit(aw->h, v) || changed;
+  }
+  else if(auto r = std::dynamic_pointer_cast<BIREGION>(e))
+  {
+    for(auto b : r->body)
+      changed = expr_visit(b, v) || changed;
+  }
+  else if(auto l = std::dynamic_pointer_cast<BILET>(e))
+  {
+    for(auto i : l->inits)
+      changed = expr_visit(i, v) || changed;
+    for(auto b : l->body)
+      changed = expr_visit(b, v) || changed;
+  }
+  else if(auto sq = std::dynamic_pointer_cast<BISETQ>(e))
+  {
+    changed = expr_visit(sq->v, v) || changed;
+  }
+  else if(auto lp = std::dynamic_pointer_cast<BILOOP>(e))
+  {
+    changed = expr_visit(lp->count, v) || changed;
+    for(auto b : lp->body)
+      changed = expr_visit(b, v) || changed;
+  }
+  else if(auto c = std::dynamic_pointer_cast<BICMP>(e))
+  {
+    changed = expr_visit(c->lhs, v) || changed;
+    changed = expr_visit(c->rhs, v) || changed;
+  }
+  else if(auto i = std::dynamic_pointer_cast<BIIF>(e))
+  {
+    changed = expr_visit(i->test, v) || changed;
+    for(auto t : i->then)
+      changed = expr_visit(t, v) || changed;
+    for(auto el : i->els)
+      changed = expr_visit(el, v) || changed;
+  }
+  else if(auto c = std::dynamic_pointer_cast<BICASE>(e))
+  {
+    changed = expr_visit(c->key, v) || changed;
+    for(auto& body : c->bodies)
+      for(auto b : body)
+        changed = expr_visit(b, v) || changed;
+    for(auto o : c->otherwise)
+      changed = expr_visit(o, v) || changed;
+  }
+  else if(auto ct = std::dynamic_pointer_cast<BICOMPTIME>(e))
+  {
+    changed = expr_visit(ct->e, v) || changed;
+  }
+  else if(auto lk = std::dynamic_pointer_cast<BILIKELY>(e))
+  {
+    changed = expr_visit(lk->e, v) || changed;
+  }
+  else if(auto lo = std::dynamic_pointer_cast<BILISTOP>(e))
+  {
+    for(auto a : lo->args)
+      changed = expr_visit(a, v) || changed;
+  }
+  else if(auto lm = std::dynamic_pointer_cast<BILAMBDA>(e))
+  {
+    for(auto b : lm->body)
+      changed = expr_visit(b, v) || changed;
   }
-  else if(auto ee = std::dynamic_pointer_cast<BISUM>(e))
+  else if(auto fc = std::dynamic_pointer_cast<BIFUNCALL>(e))
   {
-    changed = changed || expr_visit(ee->lhs, v);
-    changed = changed || expr_visit(ee->rhs, v);
+    changed = expr_visit(fc->fn, v) || changed;
+    for(auto a : fc->args)
+      changed = expr_visit(a, v) || changed;
   }
-  else if(auto ee = std::dynamic_pointer_cast<BIMUL>(e))
+  else if(auto h = std::dynamic_pointer_cast<BIHOF>(e))
   {
-    changed = changed || expr_visit(ee->lhs, v);
-    changed = changed || expr_visit(ee->rhs, v);
+    changed = expr_visit(h->fn, v) || changed;
+    for(auto a : h->args)
+      changed = expr_visit(a, v) || changed;
   }
   else if (auto ce = std::dynamic_pointer_cast<CALLEXPR>(e))
   {
     for (auto arg : ce->args)
-      changed = changed || expr_visit(arg, v);
+      changed = expr_visit(arg, v) || changed;
   }
   return changed;
 }
@@ -0,0 +1,590 @@
+#include "astcache.h"
+#include "parse.h"
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+
+// Bump whenever the node encoding changes, so stale caches are rebuilt
+static constexpr uint32_t ast_version = 9;
+static constexpr char ast_magic[4] = {'L', 'C', 'A', 'S'};
+
+/**
+ * File layout, all in host byte order:
+ *
+ *  ASTHDR
+ *  uint32_t stroff[nstrs + 1]   start of each string in the blob
+ *  char     blob[strbytes]      string bytes, padded to 4
+ *  uint32_t words[nwords]       preorder node stream
+ */
+struct ASTHDR {
+  char magic[4];
+  uint32_t version;
+  uint64_t hash;
+  uint32_t nstrs;
+  uint32_t strbytes;
+  uint32_t nwords;
+  uint32_t nroots;
+};
+
+// Every node starts with its kind and source offset
+enum ASTKIND : uint32_t {
+  AK_SEXPR,
+  AK_ID,
+  AK_NUM,
+  AK_STR,
+  AK_DEFVAR,
+  AK_ARITH,
+  AK_PARFOR,
+  AK_SPAWN,
+  AK_AWAIT,
+  AK_REGION,
+  AK_LISTOP,
+  AK_USERFUNC,
+  AK_CALL,
+  AK_IMPORT,
+  AK_EXPORT,
+  AK_LET,
+  AK_SETQ,
+  AK_LOOP,
+  AK_CMP,
+  AK_IF,
+  AK_LIKELY,
+  AK_CASE,
+  AK_COMPTIME,
+  AK_LAMBDA,
+  AK_FUNCALL,
+  AK_FUNCTION,
+  AK_HOF,
+};
+
+uint64_t ast_hash(std::string_view src) {
+  // FNV-1a
+  uint64_t h = 0xcbf29ce484222325ull;
+  for (unsigned char c : src) {
+    h ^= c;
+    h *= 0x100000001b3ull;
+  }
+  return h;
+}
+
+namespace {
+struct writer {
+  std::vector<uint32_t> words;
+  std::vector<std::string_view> strs;
+  std::unordered_map<std::string_view, uint32_t> index;
+  bool ok = true;
+  bool offsets = true;
+  size_t nodes = 0;
+
+  void word(uint32_t w) { words.push_back(w); }
+  void str(const std::string &s) {
+    auto [it, fresh] = index.try_emplace(s, strs.size());
+    if (fresh)
+      strs.push_back(s);
+    word(it->second);
+  }
+  void num(double v) {
+    uint32_t w[2];
+    memcpy(w, &v, sizeof(w));
+    word(w[0]);
+    word(w[1]);
+  }
+  void node(ASTKIND k, const EXPR &e) {
+    nodes++;
+    word(k);
+    word(offsets ? (uint32_t)e.offset : 0);
+  }
+  void proto(const PROTOTYPE &p) {
+    str(p.n);
+    word(p.args.size());
+    for (auto &a : p.args)
+      str(a);
+  }
+  template <typename T> void exprs(const std::vector<std::shared_ptr<T>> &es) {
+    word(es.size());
+    for (auto &e : es)
+      expr(e);
+  }
+
+  void expr(std::shared_ptr<EXPR> e) {
+    if (auto se = std::dynamic_pointer_cast<SEXPR>(e)) {
+      node(AK_SEXPR, *se);
+      exprs(se->exprs);
+    } else if (auto id = std::dynamic_pointer_cast<ID>(e)) {
+      node(AK_ID, *id);
+      str(id->n);
+    } else if (auto n = std::dynamic_pointer_cast<NUM>(e)) {
+      node(AK_NUM, *n);
+      num(n->v);
+    } else if (auto s = std::dynamic_pointer_cast<STR>(e)) {
+      node(AK_STR, *s);
+      str(s->s);
+    } else if (auto dv = std::dynamic_pointer_cast<BIDEFVAR>(e)) {
+      node(AK_DEFVAR, *dv);
+      str(dv->id);
+      expr(dv->v);
+    } else if (auto ar = std::dynamic_pointer_cast<BIARITH>(e)) {
+      node(AK_ARITH, *ar);
+      word(ar->op);
+      exprs(ar->args);
+    } else if (auto pf = std::dynamic_pointer_cast<BIPARFOR>(e)) {
+      node(AK_PARFOR, *pf);
+      str(pf->var);
+      expr(pf->start);
+      expr(pf->end);
+      exprs(pf->body);
+    } else if (auto sp = std::dynamic_pointer_cast<BISPAWN>(e)) {
+      node(AK_SPAWN, *sp);
+      expr(sp->e);
+    } else if (auto aw = std::dynamic_pointer_cast<BIAWAIT>(e)) {
+      node(AK_AWAIT, *aw);
+      expr(aw->h);
+    } else if (auto rg = std::dynamic_pointer_cast<BIREGION>(e)) {
+      node(AK_REGION, *rg);
+      exprs(rg->body);
+    } else if (auto lo = std::dynamic_pointer_cast<BILISTOP>(e)) {
+      node(AK_LISTOP, *lo);
+      word(lo->op);
+      exprs(lo->args);
+    } else if (auto uf = std::dynamic_pointer_cast<USERFUNC>(e)) {
+      node(AK_USERFUNC, *uf);
+      proto(*uf->proto);
+      word(uf->inl);
+      word(uf->memo);
+      word(uf->versions.size());
+      for (auto &v : uf->versions)
+        str(v);
+      exprs(uf->body);
+    } else if (auto call = std::dynamic_pointer_cast<CALLEXPR>(e)) {
+      node(AK_CALL, *call);
+      str(call->n);
+      exprs(call->args);
+    } else if (auto im = std::dynamic_pointer_cast<BIIMPORT>(e)) {
+      node(AK_IMPORT, *im);
+      word(im->modules.size());
+      for (auto &m : im->modules)
+        str(m);
+      word(im->protos.size());
+      for (auto &p : im->protos)
+        proto(*p);
+    } else if (auto ex = std::dynamic_pointer_cast<BIEXPORT>(e)) {
+      node(AK_EXPORT, *ex);
+      word(ex->names.size());
+      for (auto &n : ex->names)
+        str(n);
+    } else if (auto l = std::dynamic_pointer_cast<BILET>(e)) {
+      node(AK_LET, *l);
+      word(l->names.size());
+      for (size_t i = 0; i < l->names.size(); i++) {
+        str(l->names[i]);
+        expr(l->inits[i]);
+      }
+      exprs(l->body);
+    } else if (auto sq = std::dynamic_pointer_cast<BISETQ>(e)) {
+      node(AK_SETQ, *sq);
+      str(sq->id);
+      expr(sq->v);
+    } else if (auto lp = std::dynamic_pointer_cast<BILOOP>(e)) {
+      node(AK_LOOP, *lp);
+      str(lp->var);
+      expr(lp->count);
+      exprs(lp->body);
+    } else if (auto c = std::dynamic_pointer_cast<BICMP>(e)) {
+      node(AK_CMP, *c);
+      word(c->op);
+      expr(c->lhs);
+      expr(c->rhs);
+    } else if (auto i = std::dynamic_pointer_cast<BIIF>(e)) {
+      node(AK_IF, *i);
+      expr(i->test);
+      exprs(i->then);
+      exprs(i->els);
+    } else if (auto lk = std::dynamic_pointer_cast<BILIKELY>(e)) {
+      node(AK_LIKELY, *lk);
+      word(lk->likely);
+      expr(lk->e);
+    } else if (auto c = std::dynamic_pointer_cast<BICASE>(e)) {
+      node(AK_CASE, *c);
+      expr(c->key);
+      word(c->keys.size());
+      for (size_t i = 0; i < c->keys.size(); i++) {
+        word(c->keys[i].size());
+        for (auto k : c->keys[i])
+          num(k);
+        exprs(c->bodies[i]);
+      }
+      exprs(c->otherwise);
+    } else if (auto ct = std::dynamic_pointer_cast<BICOMPTIME>(e)) {
+      node(AK_COMPTIME, *ct);
+      expr(ct->e);
+    } else if (auto lm = std::dynamic_pointer_cast<BILAMBDA>(e)) {
+      node(AK_LAMBDA, *lm);
+      word(lm->params.size());
+      for (auto &p : lm->params)
+        str(p);
+      exprs(lm->body);
+    } else if (auto fc = std::dynamic_pointer_cast<BIFUNCALL>(e)) {
+      node(AK_FUNCALL, *fc);
+      expr(fc->fn);
+      exprs(fc->args);
+    } else if (auto fn = std::dynamic_pointer_cast<BIFUNCTION>(e)) {
+      node(AK_FUNCTION, *fn);
+      str(fn->n);
+    } else if (auto h = std::dynamic_pointer_cast<BIHOF>(e)) {
+      node(AK_HOF, *h);
+      word(h->op);
+      expr(h->fn);
+      exprs(h->args);
+    } else
+      ok = false;
+  }
+};
+
+struct reader {
+  const uint32_t *p, *end;
+  const uint32_t *stroff;
+  const char *blob;
+  uint32_t nstrs;
+  bool ok = true;
+
+  uint32_t word() {
+    if (p == end) {
+      ok = false;
+      return 0;
+    }
+    return *p++;
+  }
+  std::string str() {
+    uint32_t i = word();
+    if (i >= nstrs) {
+      ok = false;
+      return {};
+    }
+    return std::string(blob + stroff[i], stroff[i + 1] - stroff[i]);
+  }
+  double num() {
+    uint32_t w[2] = {word(), word()};
+    double v;
+    memcpy(&v, w, sizeof(v));
+    return v;
+  }
+  std::shared_ptr<PROTOTYPE> proto() {
+    auto n = str();
+    uint32_t nargs = word();
+    if (nargs > end - p)
+      ok = false;
+    std::vector<std::string> args;
+    for (uint32_t i = 0; ok and i < nargs; i++)
+      args.push_back(str());
+    return std::make_shared<PROTOTYPE>(n, args);
+  }
+  template <typename T = EXPR> std::vector<std::shared_ptr<T>> exprs() {
+    uint32_t n = word();
+    std::vector<std::shared_ptr<T>> es;
+    // each node takes at least two words
+    if (n > (end - p) / 2)
+      ok = false;
+    for (uint32_t i = 0; ok and i < n; i++) {
+      es.push_back(std::dynamic_pointer_cast<T>(expr()));
+      ok = ok and es.back();
+    }
+    return es;
+  }
+
+  std::shared_ptr<EXPR> expr() {
+    auto k = word();
+    int off = (int)word();
+    if (!ok)
+      return nullptr;
+    switch (k) {
+    case AK_SEXPR:
+      return std::make_shared<SEXPR>(exprs(), off);
+    case AK_ID:
+      return std::make_shared<ID>(str(), off);
+    case AK_NUM:
+      return std::make_shared<NUM>(num(), off);
+    case AK_STR:
+      return std::make_shared<STR>(str(), off);
+    case AK_DEFVAR: {
+      auto id = str();
+      return std::make_shared<BIDEFVAR>(id, expr(), off);
+    }
+    case AK_ARITH: {
+      auto op = (ARITHOP)word();
+      return std::make_shared<BIARITH>(op, exprs(), off);
+    }
+    case AK_PARFOR: {
+      auto var = str();
+      auto start = expr();
+      auto end = expr();
+      return std::make_shared<BIPARFOR>(var, start, end, exprs(), off);
+    }
+    case AK_SPAWN:
+      return std::make_shared<BISPAWN>(expr(), off);
+    case AK_AWAIT:
+      return std::make_shared<BIAWAIT>(expr(), off);
+    case AK_REGION:
+      return std::make_shared<BIREGION>(exprs(), off);
+    case AK_LISTOP: {
+      auto op = (LISTOP)word();
+      return std::make_shared<BILISTOP>(op, exprs(), off);
+    }
+    case AK_USERFUNC: {
+      auto proto = this->proto();
+      auto inl = (INLINEKIND)word();
+      bool memo = word();
+      uint32_t n = word();
+      if (n > end - p)
+        ok = false;
+      std::vector<std::string> versions;
+      for (uint32_t i = 0; ok and i < n; i++)
+        versions.push_back(str());
+      auto f = std::make_shared<USERFUNC>(proto, exprs<SEXPR>(), off);
+      f->inl = inl;
+      f->memo = memo;
+      f->versions = versions;
+      return f;
+    }
+    case AK_CALL: {
+      auto n = str();
+      return std::make_shared<CALLEXPR>(n, exprs(), off);
+    }
+    case AK_IMPORT: {
+      uint32_t n = word();
+      if (n > end - p)
+        ok = false;
+      std::vector<std::string> modules;
+      for (uint32_t i = 0; ok and i < n; i++)
+        modules.push_back(str());
+      n = word();
+      if (n > end - p)
+        ok = false;
+      std::vector<std::shared_ptr<PROTOTYPE>> protos;
+      for (uint32_t i = 0; ok and i < n; i++)
+        protos.push_back(proto());
+      return std::make_shared<BIIMPORT>(modules, protos, off);
+    }
+    case AK_EXPORT: {
+      uint32_t n = word();
+      if (n > end - p)
+        ok = false;
+      std::vector<std::string> names;
+      for (uint32_t i = 0; ok and i < n; i++)
+        names.push_back(str());
+      return std::make_shared<BIEXPORT>(names, off);
+    }
+    case AK_LET: {
+      uint32_t n = word();
+      if (n > (end - p) / 3)
+        ok = false;
+      std::vector<std::string> names;
+      std::vector<std::shared_ptr<EXPR>> inits;
+      for (uint32_t i = 0; ok and i < n; i++) {
+        names.push_back(str());
+        inits.push_back(expr());
+        ok = ok and inits.back();
+      }
+      return std::make_shared<BILET>(names, inits, exprs(), off);
+    }
+    case AK_SETQ: {
+      auto id = str();
+      return std::make_shared<BISETQ>(id, expr(), off);
+    }
+    case AK_LOOP: {
+      auto var = str();
+      auto count = expr();
+      return std::make_shared<BILOOP>(var, count, exprs(), off);
+    }
+    case AK_CMP: {
+      auto op = (CMPOP)word();
+      auto l = expr();
+      return std::make_shared<BICMP>(op, l, expr(), off);
+    }
+    case AK_IF: {
+      auto test = expr();
+      auto then = exprs();
+      return std::make_shared<BIIF>(test, then, exprs(), off);
+    }
+    case AK_LIKELY: {
+      bool likely = word();
+      return std::make_shared<BILIKELY>(likely, expr(), off);
+    }
+    case AK_COMPTIME:
+      return std::make_shared<BICOMPTIME>(expr(), off);
+    case AK_CASE: {
+      auto key = expr();
+      uint32_t n = word();
+      // each clause takes at least its key count and body count
+      if (n > (end - p) / 2)
+        ok = false;
+      std::vector<std::vector<int64_t>> keys;
+      std::vector<std::vector<std::shared_ptr<EXPR>>> bodies;
+      for (uint32_t i = 0; ok and i < n; i++) {
+        uint32_t nk = word();
+        if (nk > (end - p) / 2)
+          ok = false;
+        keys.emplace_back();
+        for (uint32_t j = 0; ok and j < nk; j++)
+          keys.back().push_back((int64_t)num());
+        bodies.push_back(exprs());
+      }
+      return std::make_shared<BICASE>(key, keys, bodies, exprs(), off);
+    }
+    case AK_LAMBDA: {
+      uint32_t n = word();
+      if (n > end - p)
+        ok = false;
+      std::vector<std::string> params;
+      for (uint32_t i = 0; ok and i < n; i++)
+        params.push_back(str());
+      return std::make_shared<BILAMBDA>(params, exprs(), off);
+    }
+    case AK_FUNCALL: {
+      auto fn = expr();
+      return std::make_shared<BIFUNCALL>(fn, exprs(), off);
+    }
+    case AK_FUNCTION:
+      return std::make_shared<BIFUNCTION>(str(), off);
+    case AK_HOF: {
+      auto op = (HOFOP)word();
+      auto fn = expr();
+      return std::make_shared<BIHOF>(op, fn, exprs(), off);
+    }
+    }
+    ok = false;
+    return nullptr;
+  }
+};
+} // namespace
+
+std::shared_ptr<MODULE> ast_cache_load(const std::string &path,
+                                       uint64_t hash) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return nullptr;
+  struct stat st;
+  if (fstat(fd, &st) < 0 or st.st_size < (off_t)sizeof(ASTHDR)) {
+    close(fd);
+    return nullptr;
+  }
+  size_t size = st.st_size;
+  void *map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return nullptr;
+
+  std::shared_ptr<MODULE> m;
+  auto *hdr = (const ASTHDR *)map;
+  if (memcmp(hdr->magic, ast_magic, sizeof(ast_magic)) == 0 and
+      hdr->version == ast_version and hdr->hash == hash and
+      size == sizeof(ASTHDR) + 4ull * (hdr->nstrs + 1) + hdr->strbytes +
+                  4ull * hdr->nwords) {
+    reader r;
+    r.stroff = (const uint32_t *)(hdr + 1);
+    r.blob = (const char *)(r.stroff + hdr->nstrs + 1);
+    r.nstrs = hdr->nstrs;
+    r.p = (const uint32_t *)(r.blob + hdr->strbytes);
+    r.end = r.p + hdr->nwords;
+    // Offsets must not run backwards or past the blob
+    r.ok = r.stroff[hdr->nstrs] <= hdr->strbytes;
+    for (uint32_t i = 0; r.ok and i < hdr->nstrs; i++)
+      r.ok = r.stroff[i] <= r.stroff[i + 1];
+
+    m = std::make_shared<MODULE>();
+    for (uint32_t i = 0; r.ok and i < hdr->nroots; i++) {
+      m->sexprs.push_back(std::dynamic_pointer_cast<SEXPR>(r.expr()));
+      r.ok = r.ok and m->sexprs.back();
+    }
+    if (!r.ok or r.p != r.end)
+      m = nullptr;
+  }
+  munmap(map, size);
+  return m;
+}
+
+bool ast_cache_store(const std::string &path, uint64_t hash,
+                     std::shared_ptr<MODULE> m) {
+  writer w;
+  for (auto &se : m->sexprs)
+    w.expr(se);
+  if (!w.ok)
+    return false;
+
+  std::vector<uint32_t> stroff;
+  std::string blob;
+  for (auto s : w.strs) {
+    stroff.push_back(blob.size());
+    blob += s;
+  }
+  stroff.push_back(blob.size());
+  blob.resize((blob.size() + 3) & ~3ull);
+
+  ASTHDR hdr;
+  memcpy(hdr.magic, ast_magic, sizeof(ast_magic));
+  hdr.version = ast_version;
+  hdr.hash = hash;
+  hdr.nstrs = w.strs.size();
+  hdr.strbytes = blob.size();
+  hdr.nwords = w.words.size();
+  hdr.nroots = m->sexprs.size();
+
+  // Write a temporary and rename it over the cache, so a concurrent compile
+  // never maps a half-written file
+  auto tmp = path + "." + std::to_string(getpid());
+  FILE *fp = fopen(tmp.c_str(), "wb");
+  if (!fp)
+    return false;
+  bool ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1 and
+            fwrite(stroff.data(), 4, stroff.size(), fp) == stroff.size() and
+            fwrite(blob.data(), 1, blob.size(), fp) == blob.size() and
+            fwrite(w.words.data(), 4, w.words.size(), fp) == w.words.size();
+  ok = fclose(fp) == 0 and ok;
+  if (ok)
+    ok = rename(tmp.c_str(), path.c_str()) == 0;
+  if (!ok)
+    unlink(tmp.c_str());
+  return ok;
+}
+
+std::shared_ptr<EXPR> ast_clone(std::shared_ptr<EXPR> e) {
+  writer w;
+  w.expr(e);
+  if (!w.ok)
+    return nullptr;
+  std::vector<uint32_t> stroff{0};
+  std::string blob;
+  for (auto s : w.strs) {
+    blob += s;
+    stroff.push_back(blob.size());
+  }
+
+  reader r;
+  r.stroff = stroff.data();
+  r.blob = blob.data();
+  r.nstrs = w.strs.size();
+  r.p = w.words.data();
+  r.end = r.p + w.words.size();
+  auto c = r.expr();
+  return r.ok and r.p == r.end ? c : nullptr;
+}
+
+bool ast_key(std::shared_ptr<EXPR> e, std::string &key) {
+  writer w;
+  w.offsets = false;
+  w.expr(e);
+  key.append((const char *)w.words.data(), w.words.size() * sizeof(uint32_t));
+  for (auto s : w.strs) {
+    key += s;
+    key += '\0';
+  }
+  return w.ok;
+}
+
+size_t ast_size(std::shared_ptr<EXPR> e) {
+  writer w;
+  w.expr(e);
+  return w.nodes;
+}
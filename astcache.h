@@ -0,0 +1,36 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+
+struct EXPR;
+struct MODULE;
+
+/**
+ * On-disk cache of the post-sema AST, so unchanged inputs skip the front end.
+ *
+ * The file holds a header keyed by a hash of the source, an interned string
+ * table and the nodes as a preorder stream of 32-bit words. Loading maps the
+ * file and rebuilds the nodes straight from the words; strings are referenced
+ * by index and only copied out once, into the node that names them.
+ */
+uint64_t ast_hash(std::string_view src);
+
+// Returns nullptr if path is missing, unreadable or was made from other source
+std::shared_ptr<MODULE> ast_cache_load(const std::string &path, uint64_t hash);
+
+// Returns false if the module could not be written
+bool ast_cache_store(const std::string &path, uint64_t hash,
+                     std::shared_ptr<MODULE> m);
+
+// Deep copy of a node, through the same encoding. Returns nullptr if e holds a
+// node the cache cannot store.
+std::shared_ptr<EXPR> ast_clone(std::shared_ptr<EXPR> e);
+
+// Appends an encoding of the structure of e to key. Source offsets are left
+// out, so identical code at different places gives the same key.
+bool ast_key(std::shared_ptr<EXPR> e, std::string &key);
+
+// Number of nodes in e and everything below it
+size_t ast_size(std::shared_ptr<EXPR> e);
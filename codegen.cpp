@@ -4,8 +4,16 @@
 #include "lower.h"
 #include "opc.h"
 #include "parse.h"
+#include "ast_visitor.h"
+#include "iface.h"
+#include "comptime.h"
+#include "cost.h"
+#include "target.h"
+#include "astcache.h"
+#include "rt/lcrt.h"
 #include <cstdlib>
 #include <cstring>
+#include <set>
 
 Value *SEXPR::codegen() {
   if (dump("lower"))
@@ -21,13 +29,13 @@ Value *SEXPR::codegen() {
 Value *NUM::codegen() {
   if (dump("lower"))
     puts("lowering NUM");
-  return ConstantFP::get(context(), APFloat((double)this->v));
+  return ConstantFP::get(context(), APFloat(this->v));
 }
 
 Value *ID::codegen() {
   if (dump("lower"))
     puts("lowering ID");
-  Value *v = get_value(this->n);
+  Value *v = get_value(this->n, offset);
   return v;
 }
 
@@ -56,10 +64,85 @@ Function *PROTOTYPE::codegen() {
   return f;
 }
 
+// The body of a defun-memo function is emitted into an internal
+// '<name>.memo' function. The public function only consults the runtime cache
+// and calls the body on a miss; recursive calls go through the public
+// function, so subresults are cached too.
+static Function *memo_body(Function *f) {
+  auto *impl = Function::Create(f->getFunctionType(), Function::InternalLinkage,
+                                f->getName() + ".memo", get_module());
+  unsigned i = 0;
+  for (auto &arg : impl->args())
+    arg.setName(f->getArg(i++)->getName());
+  return impl;
+}
+
+static void memo_wrap(Function *f, Function *impl) {
+  auto &b = get_builder();
+  auto *i8p = Type::getInt8PtrTy(context());
+  auto *dbl = Type::getDoubleTy(context());
+  auto *dblp = dbl->getPointerTo();
+  auto *i32 = Type::getInt32Ty(context());
+  auto *i64 = Type::getInt64Ty(context());
+  auto memo_init = runtime_func(
+      "lcrt_memo_init",
+      FunctionType::get(i8p, {i8p->getPointerTo(), i8p, i32, i64, i32}, false));
+  auto memo_get = runtime_func(
+      "lcrt_memo_get", FunctionType::get(i32, {i8p, dblp, dblp}, false));
+  auto memo_put = runtime_func(
+      "lcrt_memo_put",
+      FunctionType::get(Type::getVoidTy(context()), {i8p, dblp, dbl}, false));
+  auto *tbl = new GlobalVariable(get_module(), i8p, false,
+                                 GlobalValue::InternalLinkage,
+                                 ConstantPointerNull::get(i8p),
+                                 f->getName() + ".memotbl");
+
+  auto *entry = BasicBlock::Create(context(), "entrypoint", f);
+  auto *init = BasicBlock::Create(context(), "memo.init", f);
+  auto *lookup = BasicBlock::Create(context(), "memo.lookup", f);
+  auto *hit = BasicBlock::Create(context(), "memo.hit", f);
+  auto *miss = BasicBlock::Create(context(), "memo.miss", f);
+
+  b.SetInsertPoint(entry);
+  unsigned nargs = f->arg_size();
+  auto *key = b.CreateAlloca(dbl, b.getInt32(std::max(nargs, 1u)), "key");
+  auto *cached = b.CreateAlloca(dbl, nullptr, "cached");
+  std::vector<Value *> args;
+  for (auto &a : f->args()) {
+    b.CreateStore(&a, b.CreateConstGEP1_32(dbl, key, args.size()));
+    args.push_back(&a);
+  }
+  auto *t0 = b.CreateLoad(i8p, tbl, "tbl");
+  b.CreateCondBr(b.CreateIsNull(t0), init, lookup);
+
+  b.SetInsertPoint(init);
+  auto *t1 = b.CreateCall(memo_init, {tbl, b.CreateGlobalStringPtr(f->getName()),
+                                      b.getInt32(nargs),
+                                      b.getInt64(memo_capacity()),
+                                      b.getInt32(memo_stats())});
+  b.CreateBr(lookup);
+
+  b.SetInsertPoint(lookup);
+  auto *t = b.CreatePHI(i8p, 2, "tbl");
+  t->addIncoming(t0, entry);
+  t->addIncoming(t1, init);
+  auto *found = b.CreateCall(memo_get, {t, key, cached});
+  b.CreateCondBr(b.CreateICmpNE(found, b.getInt32(0)), hit, miss);
+
+  b.SetInsertPoint(hit);
+  b.CreateRet(b.CreateLoad(dbl, cached));
+
+  b.SetInsertPoint(miss);
+  auto *r = b.CreateCall(impl, args, "r");
+  b.CreateCall(memo_put, {t, key, r});
+  b.CreateRet(r);
+}
+
 std::map<std::string, Value *> USERFUNC::local_values;
 Value *USERFUNC::codegen() {
   if (dump("lower"))
     puts("lowering USERFUNC");
+  double started = cost_clock();
   Function *f = get_module().getFunction(proto->n);
 
   if (!f)
@@ -68,36 +151,351 @@ Value *USERFUNC::codegen() {
   if (!f)
     return nullptr; // uh oh!
 
-  auto *bb = BasicBlock::Create(context(), "entrypoint", f);
+  if (inl == INLINE_ALWAYS)
+    f->addFnAttr(Attribute::AlwaysInline);
+  else if (inl == INLINE_NEVER)
+    f->addFnAttr(Attribute::NoInline);
+
+  Function *bodyf = memo ? memo_body(f) : f;
+  auto *bb = BasicBlock::Create(context(), "entrypoint", bodyf);
   get_builder().SetInsertPoint(bb);
 
+  // Arguments live in stack slots like let variables, so setq may assign
+  // them anywhere in the body
   local_values.clear();
-  for (auto &a : f->args())
-    local_values[std::string(a.getName())] = &a;
+  for (auto &a : bodyf->args()) {
+    auto *slot = entry_alloca(a.getType(), std::string(a.getName()));
+    get_builder().CreateStore(&a, slot);
+    local_values[std::string(a.getName())] = slot;
+  }
 
   Value *r = nullptr;
   for (auto b : this->body)
     r = b->codegen();
   get_builder().CreateRet(r);
+
+  if (memo)
+    memo_wrap(f, bodyf);
+  instrument_function(f);
+  // The lookup of a memoized function is not worth versioning, only its body
+  if (!versions.empty())
+    add_multiversion(bodyf, versions);
+
+  if (function_cost()) {
+    size_t nodes = 1;
+    for (auto b : body)
+      nodes += ast_size(b);
+    cost_lowered(f, bodyf, cost_clock() - started, nodes);
+  }
   return f;
 }
 
+// A piece of a printf format: literal text, or one conversion
+struct FMTPART {
+  std::string text;
+  char conv = 0;
+  int prec = -1;
+};
+
+// Splits a format made only of %[.prec]{f,F,e,E,g,G,s} and %%; anything else
+// (flags, widths, other conversions) is left to the runtime printf
+static bool parse_format(const std::string &fmt, std::vector<FMTPART> &parts) {
+  parts.push_back({});
+  for (size_t i = 0; i < fmt.size(); i++) {
+    if (fmt[i] != '%') {
+      parts.back().text += fmt[i];
+      continue;
+    }
+    if (++i == fmt.size())
+      return false;
+    if (fmt[i] == '%') {
+      parts.back().text += '%';
+      continue;
+    }
+    FMTPART c;
+    if (fmt[i] == '.') {
+      c.prec = 0;
+      while (++i < fmt.size() && isdigit(fmt[i]))
+        c.prec = c.prec * 10 + (fmt[i] - '0');
+      if (i == fmt.size() || c.prec > 100)
+        return false;
+    }
+    if (!strchr("fFeEgGs", fmt[i]))
+      return false;
+    c.conv = fmt[i];
+    parts.push_back(c);
+    parts.push_back({});
+  }
+  return true;
+}
+
+static void emit_text(const std::string &text) {
+  auto &b = get_builder();
+  if (text.empty())
+    return;
+  if (text == "\n") {
+    b.CreateCall(runtime_func("lcrt_newline",
+                              FunctionType::get(b.getVoidTy(), false)));
+    return;
+  }
+  auto write = runtime_func(
+      "lcrt_write", FunctionType::get(b.getVoidTy(),
+                                      {b.getInt8PtrTy(), b.getInt64Ty()},
+                                      false));
+  b.CreateCall(write, {b.CreateGlobalStringPtr(text, "str" + lower_id()),
+                       b.getInt64(text.size())});
+}
+
+static void emit_print_str(Value *s) {
+  auto &b = get_builder();
+  b.CreateCall(runtime_func("lcrt_print_str",
+                            FunctionType::get(b.getVoidTy(),
+                                              {b.getInt8PtrTy()}, false)),
+               {s});
+}
+
+static void emit_print_num(Value *v) {
+  auto &b = get_builder();
+  b.CreateCall(runtime_func("lcrt_print_num",
+                            FunctionType::get(b.getVoidTy(),
+                                              {b.getDoubleTy()}, false)),
+               {v});
+}
+
+/**
+ * printf and puts write into the runtime's output buffer. A constant format
+ * is split at compile time: literal runs become one lcrt_write each, string
+ * constants passed to %s are folded into them, and every numeric conversion
+ * is a direct call that does not parse a format at run time.
+ */
+static bool is_output(const std::string &n) {
+  return n == "printf" || n == "puts" || n == "newline" || n == "print-num" ||
+         n == "print-str";
+}
+
+static Value *lower_output(CALLEXPR &c) {
+  auto &b = get_builder();
+  auto *zero = ConstantFP::get(context(), APFloat(0.0));
+  auto &args = c.args;
+
+  if (c.n == "newline" || c.n == "print-num" || c.n == "print-str" ||
+      c.n == "puts") {
+    size_t want = c.n == "newline" ? 0 : 1;
+    if (args.size() != want) {
+      reg_msg(LC_MSG{"lower",
+                     "'" + c.n + "' takes " + std::to_string(want) +
+                         " argument" + (want == 1 ? "" : "s"),
+                     MSG_ERROR, c.offset});
+      return UndefValue::get(b.getDoubleTy());
+    }
+    if (c.n == "newline") {
+      emit_text("\n");
+      return zero;
+    }
+    if (auto str = dynamic_pointer_cast<STR>(args[0])) {
+      if (c.n == "print-num") {
+        reg_msg(LC_MSG{"lower", "'print-num' takes a number", MSG_ERROR,
+                       c.offset});
+        return UndefValue::get(b.getDoubleTy());
+      }
+      emit_text(c.n == "puts" ? str->s + "\n" : str->s);
+      return zero;
+    }
+    auto *v = args[0]->codegen();
+    if (c.n == "print-num") {
+      if (!v->getType()->isDoubleTy()) {
+        reg_msg(LC_MSG{"lower", "'print-num' takes a number", MSG_ERROR,
+                       c.offset});
+        return UndefValue::get(b.getDoubleTy());
+      }
+      emit_print_num(v);
+      return zero;
+    }
+    if (!v->getType()->isPointerTy()) {
+      reg_msg(LC_MSG{"lower", "'" + c.n + "' takes a string", MSG_ERROR,
+                     c.offset});
+      return UndefValue::get(b.getDoubleTy());
+    }
+    emit_print_str(v);
+    if (c.n == "puts")
+      emit_text("\n");
+    return zero;
+  }
+
+  // printf
+  if (args.empty()) {
+    reg_msg(LC_MSG{"lower", "'printf' needs a format", MSG_ERROR, c.offset});
+    return UndefValue::get(b.getDoubleTy());
+  }
+  auto fmt = dynamic_pointer_cast<STR>(args[0]);
+  std::vector<FMTPART> parts;
+  if (fmt && parse_format(fmt->s, parts)) {
+    size_t nconv = parts.size() / 2;
+    if (nconv != args.size() - 1) {
+      char msg[1024];
+      snprintf(msg, sizeof(msg),
+               "format of 'printf' has %zu conversions but got %zu arguments",
+               nconv, args.size() - 1);
+      reg_msg(LC_MSG{"lower", msg, MSG_ERROR, c.offset});
+      return UndefValue::get(b.getDoubleTy());
+    }
+    std::vector<Value *> vals(args.size(), nullptr);
+    bool fits = true;
+    for (size_t i = 1; i < args.size(); i++) {
+      bool is_str = parts[2 * i - 1].conv == 's';
+      if (is_str && dynamic_pointer_cast<STR>(args[i]))
+        continue;
+      vals[i] = args[i]->codegen();
+      if (is_str != vals[i]->getType()->isPointerTy())
+        fits = false;
+    }
+    if (fits) {
+      std::string text;
+      for (size_t i = 0; i < parts.size(); i++) {
+        auto &p = parts[i];
+        if (!p.conv) {
+          text += p.text;
+          continue;
+        }
+        size_t arg = (i + 1) / 2;
+        if (!vals[arg]) {
+          text += dynamic_pointer_cast<STR>(args[arg])->s;
+          continue;
+        }
+        emit_text(text);
+        text.clear();
+        if (p.conv == 's') {
+          emit_print_str(vals[arg]);
+          continue;
+        }
+        auto fmtf = runtime_func(
+            "lcrt_print_fmt",
+            FunctionType::get(b.getVoidTy(),
+                              {b.getDoubleTy(), b.getInt32Ty(), b.getInt32Ty()},
+                              false));
+        b.CreateCall(fmtf, {vals[arg], b.getInt32(p.conv), b.getInt32(p.prec)});
+      }
+      emit_text(text);
+      return zero;
+    }
+    // Argument types do not match the conversions; the runtime printf gets
+    // what was already lowered
+    std::vector<Value *> vargs{fmt->codegen()};
+    for (size_t i = 1; i < args.size(); i++)
+      vargs.push_back(vals[i] ? vals[i] : args[i]->codegen());
+    b.CreateCall(runtime_func("lcrt_printf",
+                              FunctionType::get(b.getInt32Ty(),
+                                                {b.getInt8PtrTy()}, true)),
+                 vargs);
+    return zero;
+  }
+
+  std::vector<Value *> vargs;
+  for (auto &a : args)
+    vargs.push_back(a->codegen());
+  if (!vargs[0]->getType()->isPointerTy()) {
+    reg_msg(LC_MSG{"lower", "format of 'printf' must be a string", MSG_ERROR,
+                   c.offset});
+    return UndefValue::get(b.getDoubleTy());
+  }
+  b.CreateCall(runtime_func("lcrt_printf",
+                            FunctionType::get(b.getInt32Ty(),
+                                              {b.getInt8PtrTy()}, true)),
+               vargs);
+  return zero;
+}
+
+/**
+ * A closure is a pointer to { i8* code, i64 arity, env }, with env laid out as
+ * for an outlined body. Its code takes the closure itself followed by the
+ * arguments.
+ */
+static FunctionType *closure_code_type(size_t nargs) {
+  auto &b = get_builder();
+  std::vector<Type *> params{b.getInt8PtrTy()};
+  params.resize(nargs + 1, b.getDoubleTy());
+  return FunctionType::get(b.getDoubleTy(), params, false);
+}
+
+static StructType *closure_type(StructType *envty) {
+  auto &b = get_builder();
+  return StructType::get(context(), {b.getInt8PtrTy(), b.getInt64Ty(), envty});
+}
+
+/**
+ * Call the closure clo holds, which is only known at run time to be one. A
+ * value that cannot be a pointer, or a closure taking a different number of
+ * arguments, stops the program with an error naming what was called.
+ */
+static Value *call_closure(Value *clo, std::vector<Value *> args,
+                           const std::string &name) {
+  auto &b = get_builder();
+  auto *i64 = b.getInt64Ty();
+  auto *f = b.GetInsertBlock()->getParent();
+  auto *check = BasicBlock::Create(context(), "funcall.arity", f);
+  auto *call = BasicBlock::Create(context(), "funcall.call", f);
+  auto *bad = BasicBlock::Create(context(), "funcall.bad", f);
+
+  // Numbers other than tiny denormals have bits far above any user address
+  auto *bits = b.CreateBitCast(clo, i64);
+  auto *from = b.GetInsertBlock();
+  b.CreateCondBr(b.CreateICmpULT(b.CreateSub(bits, b.getInt64(1)),
+                                 b.getInt64((1ull << 47) - 1)),
+                 check, bad);
+
+  b.SetInsertPoint(check);
+  auto *cloty = closure_type(StructType::get(context(), {}));
+  auto *self = b.CreateBitCast(unbox_ptr(clo), cloty->getPointerTo());
+  auto *arity = b.CreateLoad(i64, b.CreateStructGEP(cloty, self, 1), "arity");
+  b.CreateCondBr(b.CreateICmpEQ(arity, b.getInt64(args.size())), call, bad);
+
+  b.SetInsertPoint(bad);
+  auto *expected = b.CreatePHI(i64, 2);
+  expected->addIncoming(b.getInt64(-1), from);
+  expected->addIncoming(arity, check);
+  auto bad_call = runtime_func(
+      "lcrt_bad_call",
+      FunctionType::get(b.getVoidTy(), {b.getInt8PtrTy(), i64, i64}, false));
+  b.CreateCall(bad_call, {b.CreateGlobalStringPtr(name),
+                          b.getInt64(args.size()), expected});
+  b.CreateUnreachable();
+
+  b.SetInsertPoint(call);
+  auto *ft = closure_code_type(args.size());
+  auto *code = b.CreateLoad(b.getInt8PtrTy(), b.CreateStructGEP(cloty, self, 0),
+                            "code");
+  args.insert(args.begin(), b.CreateBitCast(self, b.getInt8PtrTy()));
+  return b.CreateCall(ft, b.CreateBitCast(code, ft->getPointerTo()), args,
+                      "funcall" + lower_id());
+}
+
+static Value *call_value(const std::string &n,
+                         std::vector<std::shared_ptr<EXPR>> &args, int offset);
+
 Value *CALLEXPR::codegen() {
   if (dump("lower"))
     puts("lowering CALLEXPR");
+  if (is_output(n))
+    return lower_output(*this);
   Function *f = get_module().getFunction(n);
   if (!f) {
+    // A variable holding a closure can be called like a function
+    if (lookup_value(n))
+      return call_value(n, args, offset);
     std::string msg =
         "could not find function '" + n + "' at time of reference";
-    reg_msg(LC_MSG{"lower", msg, MSG_ERROR});
+    reg_msg(LC_MSG{"lower", msg, MSG_ERROR, offset});
+    return UndefValue::get(Type::getDoubleTy(context()));
   }
 
-  if (f->arg_size() != args.size() && !f->isVarArg()) {
+  if (f->isVarArg() ? args.size() < f->arg_size()
+                    : args.size() != f->arg_size()) {
     char msg[1024];
     memset(msg, 0, sizeof(msg));
     sprintf(msg, "argument mismatch for '%s'. got %zu arguments, expected %zu.",
             n.c_str(), args.size(), f->arg_size());
-    reg_msg(LC_MSG{"lower", msg, MSG_WARN});
+    reg_msg(LC_MSG{"lower", msg, MSG_ERROR, offset});
+    return UndefValue::get(Type::getDoubleTy(context()));
   }
 
   std::vector<Value *> vargs;
@@ -108,7 +506,7 @@ Value *CALLEXPR::codegen() {
       memset(msg, 0, sizeof(msg));
       sprintf(msg, "failed to codgen for argument %zu of call to function %s",
               vargs.size(), n.c_str());
-      reg_msg(LC_MSG{"lower", msg, MSG_ERROR});
+      reg_msg(LC_MSG{"lower", msg, MSG_ERROR, offset});
       return nullptr;
     }
   }
@@ -118,6 +516,11 @@ Value *CALLEXPR::codegen() {
 
 Value *MODULE::codegen_funcs() {
   Value *last = nullptr;
+  // Imports first, so defuns may call imported functions wherever the import
+  // appears
+  for (auto se : sexprs)
+    if (is_decl_form(se) && !std::dynamic_pointer_cast<USERFUNC>(se->exprs[0]))
+      se->codegen();
   for (auto se : sexprs) {
     if (auto defun = std::dynamic_pointer_cast<USERFUNC>(se->exprs[0]))
       last = defun->codegen();
@@ -126,36 +529,1105 @@ Value *MODULE::codegen_funcs() {
 }
 
 Value *MODULE::codegen() {
-  Value *last;
+  Value *last = nullptr;
   for (auto se : sexprs) {
-    // If we're at a defun, just skip it... we've already done codegen for
-    // defuns at this point.
-    if (std::dynamic_pointer_cast<USERFUNC>(se->exprs[0]))
+    // If we're at a defun or other declaration, just skip it... we've already
+    // done codegen for those at this point.
+    if (is_decl_form(se))
       continue;
     last = se->codegen();
   }
   return last;
 }
 
-Value *BISUM::codegen() {
-  auto *l = lhs->codegen();
-  auto *r = rhs->codegen();
-  return get_builder().CreateFAdd(l, r, "sum" + lower_id());
+Value *BIIMPORT::codegen() {
+  // Interfaces are read here rather than kept from sema, so a cached AST
+  // picks up changes to the modules it imports
+  auto all = protos;
+  for (auto &m : modules)
+    if (!read_interface(m, all))
+      reg_msg(LC_MSG{"lower", "could not read interface file " + m + ".lci",
+                     MSG_ERROR, offset});
+  for (auto &p : all) {
+    Function *f = get_module().getFunction(p->n);
+    if (!f)
+      p->codegen();
+    else if (f->arg_size() != p->args.size())
+      reg_msg(LC_MSG{"lower", "conflicting declarations of '" + p->n + "'",
+                     MSG_ERROR, offset});
+  }
+  return nullptr;
+}
+
+Value *BIEXPORT::codegen() {
+  for (auto &n : names)
+    add_export(n, offset);
+  return nullptr;
+}
+
+static Value *combine(ARITHOP op, Value *l, Value *r) {
+  auto &b = get_builder();
+  switch (op) {
+  case ARITH_MUL:
+    return b.CreateFMul(l, r, "mul" + lower_id());
+  case ARITH_MIN:
+    return b.CreateMinNum(l, r, "min" + lower_id());
+  case ARITH_MAX:
+    return b.CreateMaxNum(l, r, "max" + lower_id());
+  default:
+    return b.CreateFAdd(l, r, "sum" + lower_id());
+  }
+}
+
+// Combines vs[lo, hi) pairwise, halving the list each level: n operands take
+// a chain of log2(n) dependent operations rather than n - 1
+static Value *reduce(ARITHOP op, std::vector<Value *> &vs, size_t lo,
+                     size_t hi) {
+  if (hi - lo == 1)
+    return vs[lo];
+  size_t mid = lo + (hi - lo) / 2;
+  auto *l = reduce(op, vs, lo, mid);
+  return combine(op, l, reduce(op, vs, mid, hi));
+}
+
+Value *BIARITH::codegen() {
+  if (dump("lower"))
+    puts("lowering BIARITH");
+  auto &b = get_builder();
+  std::vector<Value *> vs;
+  for (auto a : args)
+    vs.push_back(a->codegen());
+  // Only + and * may have no operands
+  if (vs.empty())
+    return ConstantFP::get(b.getDoubleTy(), op == ARITH_MUL ? 1.0 : 0.0);
+
+  switch (op) {
+  case ARITH_SUB:
+    if (vs.size() == 1)
+      return b.CreateFNeg(vs[0], "neg" + lower_id());
+    return b.CreateFSub(vs[0], reduce(ARITH_ADD, vs, 1, vs.size()),
+                        "sub" + lower_id());
+  case ARITH_DIV:
+    if (vs.size() == 1)
+      return b.CreateFDiv(ConstantFP::get(b.getDoubleTy(), 1.0), vs[0],
+                          "div" + lower_id());
+    // Divided left to right: the product of the divisors could overflow or
+    // underflow where the quotients do not
+    for (size_t i = 1; i < vs.size(); i++)
+      vs[0] = b.CreateFDiv(vs[0], vs[i], "div" + lower_id());
+    return vs[0];
+  default:
+    return reduce(op, vs, 0, vs.size());
+  }
+}
+
+
+// Strip the sexprs sema leaves around builtins
+static std::shared_ptr<EXPR> unwrap(std::shared_ptr<EXPR> e) {
+  while (auto se = dynamic_pointer_cast<SEXPR>(e)) {
+    if (se->exprs.size() != 1)
+      break;
+    e = se->exprs[0];
+  }
+  return e;
+}
+
+// Counts the references to the variable n, and those that only call it
+struct escape_check : public VISITOR {
+  std::string n;
+  int refs = 0, calls = 0;
+  bool kept = false;
+  escape_check(std::string n) : n(n) {}
+  bool names(std::shared_ptr<EXPR> e) {
+    auto id = dynamic_pointer_cast<ID>(unwrap(e));
+    return id && id->n == n;
+  }
+  bool visitID(std::shared_ptr<ID> id) override {
+    refs += id->n == n;
+    return false;
+  }
+  bool visitEXPR(std::shared_ptr<EXPR> e) override {
+    if (auto fc = dynamic_pointer_cast<BIFUNCALL>(e))
+      calls += names(fc->fn);
+    else if (auto h = dynamic_pointer_cast<BIHOF>(e))
+      calls += names(h->fn);
+    else if (auto lm = dynamic_pointer_cast<BILAMBDA>(e))
+      // Captured by a closure, which may outlive the let, unless a
+      // parameter shadows it
+      kept |= std::find(lm->params.begin(), lm->params.end(), n) ==
+                  lm->params.end() &&
+              mentions(lm->body);
+    else if (auto sp = dynamic_pointer_cast<BISPAWN>(e))
+      // Captured by a future, which may outlive the let
+      kept |= mentions({sp->e});
+    return false;
+  }
+  bool mentions(const std::vector<std::shared_ptr<EXPR>> &body) {
+    auto inner = std::make_shared<escape_check>(n);
+    for (auto b : body)
+      expr_visit(b, inner);
+    return inner->refs > 0;
+  }
+};
+
+/**
+ * Escape analysis for a closure bound to n by a let: it cannot outlive the
+ * let when the body only ever calls it. Passing it anywhere else, storing
+ * it, returning it or capturing it may keep it.
+ */
+static bool escapes(const std::string &n,
+                    const std::vector<std::shared_ptr<EXPR>> &body) {
+  auto c = std::make_shared<escape_check>(n);
+  for (auto e : body)
+    expr_visit(e, c);
+  return c->kept || c->refs > c->calls;
+}
+
+// What each let variable in scope was bound to, while it is not assigned
+static std::map<Value *, std::shared_ptr<EXPR>> let_inits;
+
+// The expression a local variable is known to hold, if any
+static std::shared_ptr<EXPR> known_value(const std::string &n) {
+  auto it = USERFUNC::local_values.find(n);
+  if (it == USERFUNC::local_values.end())
+    return nullptr;
+  auto k = let_inits.find(it->second);
+  return k == let_inits.end() ? nullptr : unwrap(k->second);
+}
+
+Value *BILET::codegen() {
+  if (dump("lower"))
+    puts("lowering BILET");
+  auto &b = get_builder();
+
+  for (size_t i = 0; i < names.size(); i++)
+    if (auto lm = dynamic_pointer_cast<BILAMBDA>(unwrap(inits[i])))
+      lm->stack = !escapes(names[i], body);
+
+  std::vector<Value *> vals;
+  for (auto i : inits)
+    vals.push_back(i->codegen());
+
+  auto saved = USERFUNC::local_values;
+  for (size_t i = 0; i < names.size(); i++) {
+    auto *slot = entry_alloca(vals[i]->getType(), names[i]);
+    b.CreateStore(vals[i], slot);
+    USERFUNC::local_values[names[i]] = slot;
+    let_inits[slot] = inits[i];
+  }
+
+  Value *r = nullptr;
+  for (auto e : body)
+    r = e->codegen();
+  for (auto &n : names)
+    let_inits.erase(USERFUNC::local_values[n]);
+  USERFUNC::local_values = saved;
+  return r;
+}
+
+Value *BISETQ::codegen() {
+  if (dump("lower"))
+    printf("lowering setq '%s'\n", id.c_str());
+  auto &b = get_builder();
+  auto *val = v->codegen();
+  auto *f = b.GetInsertBlock()->getParent();
+
+  auto it = USERFUNC::local_values.find(id);
+  if (it == USERFUNC::local_values.end()) {
+    std::string msg = lookup_value(id)
+                          ? "cannot setq '" + id + "', which is not a local variable"
+                          : "could not find named value '" + id + "'";
+    reg_msg(LC_MSG{"lower", msg, MSG_ERROR, offset});
+    return val;
+  }
+
+  auto *slot = dyn_cast<AllocaInst>(it->second);
+  if (!slot || slot->getFunction() != f) {
+    reg_msg(LC_MSG{"lower", "cannot setq '" + id + "' here", MSG_ERROR, offset});
+    return val;
+  }
+  if (val->getType() != slot->getAllocatedType()) {
+    reg_msg(LC_MSG{"lower", "setq changes the type of '" + id + "'", MSG_ERROR,
+                   offset});
+    return val;
+  }
+  b.CreateStore(val, slot);
+  let_inits.erase(slot);
+  return val;
+}
+
+Value *BILOOP::codegen() {
+  if (dump("lower"))
+    puts("lowering BILOOP");
+  auto &b = get_builder();
+  auto *i64 = b.getInt64Ty();
+  auto *f = b.GetInsertBlock()->getParent();
+
+  auto *n = b.CreateFPToSI(count->codegen(), i64, "count");
+  auto *entry = b.GetInsertBlock();
+  auto *cond = BasicBlock::Create(context(), "loop.cond", f);
+  auto *loop = BasicBlock::Create(context(), "loop.body", f);
+  auto *exit = BasicBlock::Create(context(), "loop.exit", f);
+  b.CreateBr(cond);
+
+  b.SetInsertPoint(cond);
+  auto *i = b.CreatePHI(i64, 2, var);
+  i->addIncoming(b.getInt64(0), entry);
+  b.CreateCondBr(b.CreateICmpSLT(i, n), loop, exit);
+
+  b.SetInsertPoint(loop);
+  auto saved = USERFUNC::local_values;
+  USERFUNC::local_values[var] = b.CreateSIToFP(i, b.getDoubleTy(), var);
+  for (auto e : body)
+    e->codegen();
+  USERFUNC::local_values = saved;
+  auto *next = b.CreateAdd(i, b.getInt64(1), "next");
+  i->addIncoming(next, b.GetInsertBlock());
+  b.CreateBr(cond);
+
+  b.SetInsertPoint(exit);
+  return ConstantFP::get(context(), APFloat(0.0));
+}
+
+static Value *compare(BICMP &c) {
+  auto &b = get_builder();
+  auto *l = c.lhs->codegen();
+  auto *r = c.rhs->codegen();
+  switch (c.op) {
+#define CMPOP_PROC(X, NAME, PRED)                                              \
+  case X:                                                                      \
+    return b.CreateFCmp(CmpInst::PRED, l, r, "cmp" + lower_id());
+#include "cmpop.def"
+#undef CMPOP_PROC
+  }
+  return nullptr;
+}
+
+Value *BICMP::codegen() {
+  if (dump("lower"))
+    puts("lowering BICMP");
+  return get_builder().CreateUIToFP(compare(*this), get_builder().getDoubleTy(),
+                                    "bool" + lower_id());
+}
+
+Value *BILIKELY::codegen() {
+  if (dump("lower"))
+    puts("lowering BILIKELY");
+  return e->codegen();
+}
+
+// Lower the test of a conditional to an i1. Comparisons branch on the fcmp
+// itself; likely/unlikely set hint to 1/-1.
+static Value *lower_test(std::shared_ptr<EXPR> test, int &hint) {
+  auto &b = get_builder();
+  test = unwrap(test);
+  if (auto lk = dynamic_pointer_cast<BILIKELY>(test)) {
+    hint = lk->likely ? 1 : -1;
+    test = unwrap(lk->e);
+  }
+  if (auto c = dynamic_pointer_cast<BICMP>(test))
+    return compare(*c);
+  auto *v = test->codegen();
+  if (v->getType()->isPointerTy())
+    return b.CreateIsNotNull(v, "test" + lower_id());
+  return b.CreateFCmpUNE(v, ConstantFP::get(v->getType(), 0.0),
+                         "test" + lower_id());
+}
+
+using ARM = std::pair<Value *, BasicBlock *>;
+
+// Lower one arm of a conditional into bb, leaving it open so its value can
+// still be boxed
+static ARM lower_arm(BasicBlock *bb,
+                     const std::vector<std::shared_ptr<EXPR>> &es) {
+  auto &b = get_builder();
+  b.SetInsertPoint(bb);
+  Value *v = ConstantFP::get(context(), APFloat(0.0));
+  for (auto e : es)
+    v = e->codegen();
+  if (!v)
+    v = UndefValue::get(b.getDoubleTy());
+  return {v, b.GetInsertBlock()};
+}
+
+// Branch from every arm to merge and return the phi of their values. Arms of
+// different types meet as doubles.
+static Value *join_arms(std::vector<ARM> &arms, BasicBlock *merge,
+                        std::string name) {
+  auto &b = get_builder();
+  bool mixed = false;
+  for (auto &[v, bb] : arms)
+    mixed |= v->getType() != arms[0].first->getType();
+  for (auto &[v, bb] : arms) {
+    b.SetInsertPoint(bb);
+    if (mixed && v->getType()->isPointerTy())
+      v = box_ptr(v);
+    b.CreateBr(merge);
+  }
+
+  b.SetInsertPoint(merge);
+  auto *phi = b.CreatePHI(arms[0].first->getType(), arms.size(),
+                          name + lower_id());
+  for (auto &[v, bb] : arms)
+    phi->addIncoming(v, bb);
+  return phi;
+}
+
+Value *BIIF::codegen() {
+  if (dump("lower"))
+    puts("lowering BIIF");
+  auto &b = get_builder();
+  auto *f = b.GetInsertBlock()->getParent();
+
+  int hint = 0;
+  auto *c = lower_test(test, hint);
+  auto *thenbb = BasicBlock::Create(context(), "if.then", f);
+  auto *elsebb = BasicBlock::Create(context(), "if.else", f);
+  auto *merge = BasicBlock::Create(context(), "if.end", f);
+  MDNode *weights = nullptr;
+  // The same odds __builtin_expect gives
+  if (hint)
+    weights = MDBuilder(context()).createBranchWeights(hint > 0 ? 2000 : 1,
+                                                       hint > 0 ? 1 : 2000);
+  b.CreateCondBr(c, thenbb, elsebb, weights);
+
+  std::vector<ARM> arms{lower_arm(thenbb, then), lower_arm(elsebb, els)};
+  return join_arms(arms, merge, "if");
+}
+
+/**
+ * case is a single switch, which instruction selection turns into a jump
+ * table, bit tests or a binary search depending on how dense the keys are.
+ * The key is converted to an integer first, and anything that does not
+ * convert exactly (fractions, NaN, values out of range) takes the otherwise
+ * arm.
+ */
+Value *BICASE::codegen() {
+  if (dump("lower"))
+    puts("lowering BICASE");
+  auto &b = get_builder();
+  auto *i64 = b.getInt64Ty();
+  auto *f = b.GetInsertBlock()->getParent();
+
+  auto *v = key->codegen();
+  // Saturating, so the round trip below is defined for every double
+  auto *k = b.CreateIntrinsic(Intrinsic::fptosi_sat, {i64, b.getDoubleTy()},
+                              {v}, nullptr, "key");
+  auto *exact =
+      b.CreateFCmpOEQ(b.CreateSIToFP(k, b.getDoubleTy()), v, "exact");
+  auto *dispatch = BasicBlock::Create(context(), "case.dispatch", f);
+  auto *other = BasicBlock::Create(context(), "case.otherwise", f);
+  auto *merge = BasicBlock::Create(context(), "case.end", f);
+  b.CreateCondBr(exact, dispatch, other);
+
+  b.SetInsertPoint(dispatch);
+  size_t ncases = 0;
+  for (auto &ks : keys)
+    ncases += ks.size();
+  auto *sw = b.CreateSwitch(k, other, ncases);
+
+  std::vector<ARM> arms;
+  for (size_t i = 0; i < bodies.size(); i++) {
+    auto *bb = BasicBlock::Create(context(), "case.arm", f, other);
+    for (auto kv : keys[i])
+      sw->addCase(ConstantInt::get(i64, kv, true), bb);
+    arms.push_back(lower_arm(bb, bodies[i]));
+  }
+  arms.push_back(lower_arm(other, otherwise));
+  return join_arms(arms, merge, "case");
+}
+
+Value *STR::codegen() {
+  return get_builder().CreateGlobalStringPtr(this->s, "str" + lower_id());
 }
 
-Value *BIMUL::codegen() {
-  auto *l = lhs->codegen();
-  auto *r = rhs->codegen();
-  return get_builder().CreateFMul(l, r, "mul" + lower_id());
+// Collects the names referenced anywhere below an expression.
+struct collect_ids : public VISITOR {
+  std::set<std::string> ids;
+  bool visitID(std::shared_ptr<ID> id) override {
+    ids.insert(id->n);
+    return false;
+  }
+};
+
+// Names an expression refers to, whether it defines any itself, and whether
+// it uses anything that is never pure: output, strings, the runtime's lists,
+// closures and threads
+struct comptime_ids : public collect_ids {
+  bool defines = false, effects = false;
+  bool visitSEXPR(std::shared_ptr<SEXPR> se) override {
+    defines |= !se->exprs.empty() && dynamic_pointer_cast<BIDEFVAR>(se->exprs[0]);
+    return false;
+  }
+  bool visitEXPR(std::shared_ptr<EXPR> e) override {
+    if (auto c = dynamic_pointer_cast<CALLEXPR>(e))
+      effects |= is_output(c->n);
+    else
+      effects |= dynamic_pointer_cast<STR>(e) || dynamic_pointer_cast<BILISTOP>(e) ||
+                 dynamic_pointer_cast<BILAMBDA>(e) ||
+                 dynamic_pointer_cast<BIFUNCTION>(e) ||
+                 dynamic_pointer_cast<BIHOF>(e) || dynamic_pointer_cast<BISPAWN>(e) ||
+                 dynamic_pointer_cast<BIAWAIT>(e) || dynamic_pointer_cast<BIPARFOR>(e) ||
+                 dynamic_pointer_cast<BIREGION>(e);
+    return false;
+  }
+};
+
+/**
+ * Lower e into a function of its own and run it in the JIT. Returns nullptr,
+ * leaving nothing behind, when e cannot be computed at compile time.
+ */
+static Constant *try_comptime(std::shared_ptr<EXPR> e) {
+  if (any_errors())
+    return nullptr;
+  // Values computed at run time cannot be used from another function, and a
+  // defvar would outlive the function it is lowered in
+  auto ids = std::make_shared<comptime_ids>();
+  expr_visit(e, ids);
+  if (ids->defines || ids->effects)
+    return nullptr;
+  for (auto &n : ids->ids)
+    if (auto *v = lookup_value(n); v && !isa<Constant>(v))
+      return nullptr;
+
+  // Whatever lowering adds to the module besides f is only used by f
+  auto &m = get_module();
+  std::set<GlobalValue *> before;
+  for (auto &g : m.global_values())
+    before.insert(&g);
+
+  auto &b = get_builder();
+  auto *ft = FunctionType::get(b.getDoubleTy(), false);
+  auto *f = Function::Create(ft, Function::InternalLinkage, "lc.comptime",
+                             get_module());
+  auto ip = b.saveIP();
+  auto saved = USERFUNC::local_values;
+  USERFUNC::local_values.clear();
+  b.SetInsertPoint(BasicBlock::Create(context(), "entrypoint", f));
+
+  Constant *r = nullptr;
+  auto *v = e->codegen();
+  double d;
+  if (any_errors()) {
+    // Already reported; lowering it again would only repeat them
+    r = UndefValue::get(b.getDoubleTy());
+  } else if (v && v->getType()->isDoubleTy()) {
+    b.CreateRet(v);
+    if (comptime_eval(f, d))
+      r = ConstantFP::get(context(), APFloat(d));
+  }
+
+  USERFUNC::local_values = saved;
+  b.restoreIP(ip);
+  std::vector<GlobalValue *> added;
+  for (auto &g : m.global_values())
+    if (!before.count(&g))
+      added.push_back(&g);
+  for (auto *g : added)
+    if (auto *fn = dyn_cast<Function>(g))
+      fn->deleteBody();
+    else if (auto *gv = dyn_cast<GlobalVariable>(g))
+      gv->setInitializer(nullptr);
+  for (auto *g : added) {
+    g->removeDeadConstantUsers();
+    g->eraseFromParent();
+  }
+  return r;
 }
 
 Value *BIDEFVAR::codegen() {
   if (dump("lower"))
     printf("lowering defvar '%s'\n", id.c_str());
-  add_value(id, v->codegen());
+  // Top-level initializers that are pure are computed while compiling, so
+  // main does not have to
+  Value *val = nullptr;
+  if (comptime() && at_top_level())
+    val = try_comptime(v);
+  if (!val)
+    val = v->codegen();
+  add_value(id, val);
   return get_value(id);
 }
 
-Value *STR::codegen() {
-  return get_builder().CreateGlobalStringPtr(this->s, "str" + lower_id());
+Value *BICOMPTIME::codegen() {
+  if (dump("lower"))
+    puts("lowering BICOMPTIME");
+  if (auto *c = try_comptime(e))
+    return c;
+  reg_msg(LC_MSG{"comptime",
+                 "expression is not pure, so it is computed at run time",
+                 MSG_WARN, offset});
+  return e->codegen();
+}
+
+using CAPTURES = std::vector<std::pair<std::string, Value *>>;
+
+// Find the values an outlined body refers to that are local to the function
+// being lowered. Constants and globals can be used directly from anywhere, so
+// only the rest has to be passed to the outlined function.
+static CAPTURES captures(const std::vector<std::shared_ptr<EXPR>> &body,
+                         const std::set<std::string> &bound) {
+  auto c = std::make_shared<collect_ids>();
+  for (auto e : body)
+    expr_visit(e, c);
+
+  CAPTURES caps;
+  for (auto &n : c->ids) {
+    if (bound.count(n))
+      continue;
+    Value *v = lookup_value(n);
+    if (v && !isa<Constant>(v))
+      caps.push_back({n, v});
+  }
+  return caps;
+}
+
+static StructType *env_type(const CAPTURES &caps) {
+  std::vector<Type *> tys;
+  for (auto &[n, v] : caps)
+    tys.push_back(v->getType());
+  return StructType::get(context(), tys);
+}
+
+// Store the captured values into env, which points to an envty
+static void store_env(const CAPTURES &caps, StructType *envty, Value *env) {
+  auto &b = get_builder();
+  for (unsigned i = 0; i < caps.size(); i++)
+    b.CreateStore(caps[i].second, b.CreateStructGEP(envty, env, i));
+}
+
+// Store the captured values into a fresh environment and return it as an i8*.
+static Value *pack_env(const CAPTURES &caps, StructType *envty) {
+  auto &b = get_builder();
+  if (caps.empty())
+    return ConstantPointerNull::get(b.getInt8PtrTy());
+  auto *env = entry_alloca(envty, "env");
+  store_env(caps, envty, env);
+  return b.CreateBitCast(env, b.getInt8PtrTy());
+}
+
+// Load the captured values back out of env inside the outlined function and
+// make them visible under their original names.
+static void unpack_env(Value *env, StructType *envty, const CAPTURES &caps) {
+  auto &b = get_builder();
+  if (caps.empty())
+    return;
+  auto *p = b.CreateBitCast(env, envty->getPointerTo());
+  for (unsigned i = 0; i < caps.size(); i++)
+    USERFUNC::local_values[caps[i].first] =
+        b.CreateLoad(envty->getElementType(i), b.CreateStructGEP(envty, p, i),
+                     caps[i].first);
+}
+
+Value *BIPARFOR::codegen() {
+  if (dump("lower"))
+    printf("lowering parallel-for '%s'\n", var.c_str());
+  auto &b = get_builder();
+  auto *i64 = b.getInt64Ty();
+  auto *i8p = b.getInt8PtrTy();
+  auto *lo = b.CreateFPToSI(start->codegen(), i64, "start");
+  auto *hi = b.CreateFPToSI(end->codegen(), i64, "end");
+
+  auto caps = captures(body, {var});
+  auto *envty = env_type(caps);
+  auto *env = pack_env(caps, envty);
+
+  auto *ft = FunctionType::get(b.getVoidTy(), {i64, i64, i8p}, false);
+  auto *parent = b.GetInsertBlock()->getParent();
+  auto *f = Function::Create(ft, Function::InternalLinkage,
+                             parent->getName() + ".pfor" + lower_id(),
+                             get_module());
+  f->getArg(0)->setName("lo");
+  f->getArg(1)->setName("hi");
+  f->getArg(2)->setName("env");
+
+  auto ip = b.saveIP();
+  auto saved = USERFUNC::local_values;
+
+  auto *entry = BasicBlock::Create(context(), "entrypoint", f);
+  auto *cond = BasicBlock::Create(context(), "cond", f);
+  auto *loop = BasicBlock::Create(context(), "loop", f);
+  auto *exit = BasicBlock::Create(context(), "exit", f);
+
+  b.SetInsertPoint(entry);
+  unpack_env(f->getArg(2), envty, caps);
+  b.CreateBr(cond);
+
+  b.SetInsertPoint(cond);
+  auto *i = b.CreatePHI(i64, 2, var);
+  i->addIncoming(f->getArg(0), entry);
+  b.CreateCondBr(b.CreateICmpSLT(i, f->getArg(1)), loop, exit);
+
+  b.SetInsertPoint(loop);
+  USERFUNC::local_values[var] = b.CreateSIToFP(i, b.getDoubleTy(), var);
+  for (auto e : body)
+    e->codegen();
+  auto *next = b.CreateAdd(i, b.getInt64(1), "next");
+  i->addIncoming(next, b.GetInsertBlock());
+  b.CreateBr(cond);
+
+  b.SetInsertPoint(exit);
+  b.CreateRetVoid();
+
+  USERFUNC::local_values = saved;
+  b.restoreIP(ip);
+
+  auto pfor = runtime_func(
+      "lcrt_parallel_for",
+      FunctionType::get(b.getVoidTy(), {i64, i64, ft->getPointerTo(), i8p},
+                        false));
+  b.CreateCall(pfor, {lo, hi, f, env});
+  return ConstantFP::get(context(), APFloat(0.0));
+}
+
+Value *BISPAWN::codegen() {
+  if (dump("lower"))
+    puts("lowering BISPAWN");
+  auto &b = get_builder();
+  auto *i8p = b.getInt8PtrTy();
+
+  auto caps = captures({e}, {});
+  auto *envty = env_type(caps);
+  auto *env = pack_env(caps, envty);
+
+  auto *ft = FunctionType::get(b.getDoubleTy(), {i8p}, false);
+  auto *parent = b.GetInsertBlock()->getParent();
+  auto *f = Function::Create(ft, Function::InternalLinkage,
+                             parent->getName() + ".spawn" + lower_id(),
+                             get_module());
+  f->getArg(0)->setName("env");
+
+  auto ip = b.saveIP();
+  auto saved = USERFUNC::local_values;
+
+  b.SetInsertPoint(BasicBlock::Create(context(), "entrypoint", f));
+  unpack_env(f->getArg(0), envty, caps);
+  auto *r = e->codegen();
+  if (r->getType()->isPointerTy())
+    r = box_ptr(r);
+  b.CreateRet(r);
+
+  USERFUNC::local_values = saved;
+  b.restoreIP(ip);
+
+  // The runtime copies the environment, so the future may outlive this frame.
+  auto spawn = runtime_func(
+      "lcrt_spawn",
+      FunctionType::get(i8p, {ft->getPointerTo(), i8p, b.getInt64Ty()},
+                        false));
+  auto *size = caps.empty() ? b.getInt64(0) : ConstantExpr::getSizeOf(envty);
+  return box_ptr(b.CreateCall(spawn, {f, env, size}, "future"));
+}
+
+Value *BIAWAIT::codegen() {
+  if (dump("lower"))
+    puts("lowering BIAWAIT");
+  auto &b = get_builder();
+  auto await = runtime_func(
+      "lcrt_await",
+      FunctionType::get(b.getDoubleTy(), {b.getInt8PtrTy()}, false));
+  return b.CreateCall(await, {unbox_ptr(h->codegen())}, "await" + lower_id());
+}
+
+Value *BIREGION::codegen() {
+  if (dump("lower"))
+    puts("lowering BIREGION");
+  auto &b = get_builder();
+  auto *vt = FunctionType::get(b.getVoidTy(), false);
+  b.CreateCall(runtime_func("lcrt_region_push", vt));
+  Value *r = nullptr;
+  for (auto e : body)
+    r = e->codegen();
+  b.CreateCall(runtime_func("lcrt_region_pop", vt));
+  return r;
+}
+
+// cdr of a list element is the next slot unless the element is the last one
+// of its chunk (or nil), which only the runtime handles.
+static Value *list_cdr(Value *l) {
+  auto &b = get_builder();
+  auto *i64 = b.getInt64Ty();
+  auto *bits = b.CreateBitCast(l, i64);
+  auto *next = b.CreateAdd(bits, b.getInt64(sizeof(double)), "next");
+  auto *in_chunk = b.CreateICmpNE(
+      b.CreateAnd(next, b.getInt64(LCRT_LIST_CHUNK - 1)), b.getInt64(0));
+  auto *fast = b.CreateAnd(in_chunk, b.CreateICmpNE(bits, b.getInt64(0)));
+
+  auto *f = b.GetInsertBlock()->getParent();
+  auto *from = b.GetInsertBlock();
+  auto *slow = BasicBlock::Create(context(), "cdr.slow", f);
+  auto *done = BasicBlock::Create(context(), "cdr.done", f);
+  b.CreateCondBr(fast, done, slow);
+
+  b.SetInsertPoint(slow);
+  auto cdr = runtime_func(
+      "lcrt_cdr", FunctionType::get(b.getInt8PtrTy(), {b.getInt8PtrTy()}, false));
+  auto *rest = b.CreatePtrToInt(b.CreateCall(cdr, {unbox_ptr(l)}), i64);
+  b.CreateBr(done);
+
+  b.SetInsertPoint(done);
+  auto *r = b.CreatePHI(i64, 2, "cdr");
+  r->addIncoming(next, from);
+  r->addIncoming(rest, slow);
+  return b.CreateBitCast(r, b.getDoubleTy());
+}
+
+// car of nil is 0, like nth past the end of a list
+static Value *list_car(Value *l) {
+  auto &b = get_builder();
+  auto *dbl = b.getDoubleTy();
+  auto *f = b.GetInsertBlock()->getParent();
+  auto *from = b.GetInsertBlock();
+  auto *load = BasicBlock::Create(context(), "car.load", f);
+  auto *done = BasicBlock::Create(context(), "car.done", f);
+  b.CreateCondBr(
+      b.CreateICmpNE(b.CreateBitCast(l, b.getInt64Ty()), b.getInt64(0)), load,
+      done);
+
+  b.SetInsertPoint(load);
+  auto *x = b.CreateLoad(dbl, b.CreateBitCast(unbox_ptr(l), dbl->getPointerTo()));
+  b.CreateBr(done);
+
+  b.SetInsertPoint(done);
+  auto *r = b.CreatePHI(dbl, 2, "car" + lower_id());
+  r->addIncoming(ConstantFP::get(dbl, 0.0), from);
+  r->addIncoming(x, load);
+  return r;
+}
+
+Value *BILISTOP::codegen() {
+  if (dump("lower"))
+    puts("lowering BILISTOP");
+  auto &b = get_builder();
+  auto *dbl = b.getDoubleTy();
+  auto *i8p = b.getInt8PtrTy();
+  auto *i64 = b.getInt64Ty();
+
+  switch (op) {
+  case LIST_CONS: {
+    auto cons = runtime_func("lcrt_cons",
+                             FunctionType::get(i8p, {dbl, i8p}, false));
+    auto *x = args[0]->codegen();
+    auto *l = unbox_ptr(args[1]->codegen());
+    return box_ptr(b.CreateCall(cons, {x, l}, "cons" + lower_id()));
+  }
+  case LIST_CAR:
+    return list_car(args[0]->codegen());
+  case LIST_CDR:
+    return list_cdr(args[0]->codegen());
+  case LIST_LIST: {
+    if (args.empty())
+      return get_value("nil");
+    auto *elems = entry_alloca(ArrayType::get(dbl, args.size()), "elems");
+    for (unsigned i = 0; i < args.size(); i++)
+      b.CreateStore(args[i]->codegen(),
+                    b.CreateConstInBoundsGEP2_32(elems->getAllocatedType(),
+                                                 elems, 0, i));
+    auto list = runtime_func(
+        "lcrt_list", FunctionType::get(i8p, {i64, dbl->getPointerTo()}, false));
+    auto *p = b.CreateConstInBoundsGEP2_32(elems->getAllocatedType(), elems, 0, 0);
+    return box_ptr(
+        b.CreateCall(list, {b.getInt64(args.size()), p}, "list" + lower_id()));
+  }
+  case LIST_LENGTH: {
+    auto length =
+        runtime_func("lcrt_length", FunctionType::get(i64, {i8p}, false));
+    auto *n = b.CreateCall(length, {unbox_ptr(args[0]->codegen())});
+    return b.CreateSIToFP(n, dbl, "length" + lower_id());
+  }
+  case LIST_NTH: {
+    auto nth =
+        runtime_func("lcrt_nth", FunctionType::get(dbl, {i64, i8p}, false));
+    auto *n = b.CreateFPToSI(args[0]->codegen(), i64);
+    return b.CreateCall(nth, {n, unbox_ptr(args[1]->codegen())},
+                        "nth" + lower_id());
+  }
+  }
+  return nullptr;
+}
+
+// Everything passed through a closure is a double
+static Value *as_double(Value *v) {
+  return v->getType()->isPointerTy() ? box_ptr(v) : v;
+}
+
+/**
+ * A lambda lowers to the code of its body, which finds its captures in the
+ * closure passed to it, and a closure holding them by value. A lambda that
+ * captures nothing needs no closure of its own and gets a constant one. A
+ * let has decided whether the closure can outlive the frame it is made in:
+ * if not it lives on the stack, and otherwise in the current region.
+ */
+Value *BILAMBDA::codegen() {
+  if (dump("lower"))
+    puts("lowering BILAMBDA");
+  auto &b = get_builder();
+
+  auto caps = captures(body, {params.begin(), params.end()});
+  auto *envty = env_type(caps);
+  auto *cloty = closure_type(envty);
+
+  auto *ft = closure_code_type(params.size());
+  auto *parent = b.GetInsertBlock()->getParent();
+  auto *f = Function::Create(ft, Function::InternalLinkage,
+                             parent->getName() + ".lambda" + lower_id(),
+                             get_module());
+  f->getArg(0)->setName("self");
+
+  auto ip = b.saveIP();
+  auto saved = USERFUNC::local_values;
+  USERFUNC::local_values.clear();
+
+  b.SetInsertPoint(BasicBlock::Create(context(), "entrypoint", f));
+  auto *self = b.CreateBitCast(f->getArg(0), cloty->getPointerTo());
+  unpack_env(b.CreateStructGEP(cloty, self, 2), envty, caps);
+  for (unsigned i = 0; i < params.size(); i++) {
+    auto *a = f->getArg(i + 1);
+    a->setName(params[i]);
+    auto *slot = entry_alloca(a->getType(), params[i]);
+    b.CreateStore(a, slot);
+    USERFUNC::local_values[params[i]] = slot;
+  }
+  Value *r = nullptr;
+  for (auto e : body)
+    r = e->codegen();
+  b.CreateRet(as_double(r));
+
+  USERFUNC::local_values = saved;
+  b.restoreIP(ip);
+
+  auto *code = ConstantExpr::getBitCast(f, b.getInt8PtrTy());
+  auto *arity = b.getInt64(params.size());
+  if (caps.empty()) {
+    auto *g = new GlobalVariable(
+        get_module(), cloty, true, GlobalValue::InternalLinkage,
+        ConstantStruct::get(cloty,
+                            {code, arity, ConstantStruct::get(envty, {})}),
+        f->getName() + ".closure");
+    return box_ptr(g);
+  }
+
+  Value *clo;
+  if (stack)
+    clo = entry_alloca(cloty, "closure");
+  else
+    clo = b.CreateBitCast(lc_alloc(ConstantExpr::getSizeOf(cloty), 8),
+                          cloty->getPointerTo(), "closure");
+  b.CreateStore(code, b.CreateStructGEP(cloty, clo, 0));
+  b.CreateStore(arity, b.CreateStructGEP(cloty, clo, 1));
+  store_env(caps, envty, b.CreateStructGEP(cloty, clo, 2));
+  return box_ptr(clo);
+}
+
+// The closure of a defun calls it through a trampoline with the closure
+// calling convention
+Value *BIFUNCTION::codegen() {
+  if (dump("lower"))
+    puts("lowering BIFUNCTION");
+  auto &b = get_builder();
+  auto &m = get_module();
+  auto *target = m.getFunction(n);
+  if (!target) {
+    reg_msg(LC_MSG{"lower", "could not find function '" + n + "'", MSG_ERROR,
+                   offset});
+    return UndefValue::get(b.getDoubleTy());
+  }
+  if (auto *g = m.getNamedGlobal(n + ".closure"))
+    return box_ptr(g);
+
+  auto *ft = closure_code_type(target->arg_size());
+  auto *f = Function::Create(ft, Function::InternalLinkage, n + ".trampoline",
+                             m);
+  IRBuilder<> tb(BasicBlock::Create(context(), "entrypoint", f));
+  std::vector<Value *> args;
+  for (unsigned i = 0; i < target->arg_size(); i++)
+    args.push_back(f->getArg(i + 1));
+  tb.CreateRet(tb.CreateCall(target, args));
+
+  auto *envty = StructType::get(context(), {});
+  auto *cloty = closure_type(envty);
+  auto *g = new GlobalVariable(
+      m, cloty, true, GlobalValue::InternalLinkage,
+      ConstantStruct::get(cloty, {ConstantExpr::getBitCast(f, b.getInt8PtrTy()),
+                                  b.getInt64(target->arg_size()),
+                                  ConstantStruct::get(envty, {})}),
+      n + ".closure");
+  return box_ptr(g);
+}
+
+// What a funcall, mapcar or fold calls. A lambda written in place is lowered
+// where it is applied, and a defun named directly is called directly; only
+// other function values go through a closure.
+struct CALLEE {
+  std::shared_ptr<BILAMBDA> lam;
+  Function *f = nullptr;
+  Value *clo = nullptr;
+  // What clo was called by in messages, and the let binding it comes from
+  std::string name = "function value";
+  std::shared_ptr<EXPR> known;
+};
+
+// Values a let can bind that are numbers, strings or lists, never closures
+static bool not_callable(std::shared_ptr<EXPR> e) {
+  if (auto l = dynamic_pointer_cast<BILISTOP>(e))
+    return l->op != LIST_CAR && l->op != LIST_NTH;
+  return dynamic_pointer_cast<NUM>(e) || dynamic_pointer_cast<STR>(e) ||
+         dynamic_pointer_cast<BIARITH>(e) || dynamic_pointer_cast<BICMP>(e);
+}
+
+static CALLEE callee_of(std::shared_ptr<EXPR> fn) {
+  CALLEE c;
+  auto e = unwrap(fn);
+  if ((c.lam = dynamic_pointer_cast<BILAMBDA>(e)))
+    return c;
+  if (auto fe = dynamic_pointer_cast<BIFUNCTION>(e)) {
+    c.f = get_module().getFunction(fe->n);
+  } else if (auto id = dynamic_pointer_cast<ID>(e)) {
+    c.name = id->n;
+    if (!lookup_value(id->n))
+      c.f = get_module().getFunction(id->n);
+    else
+      c.known = known_value(id->n);
+  }
+  if (!c.f)
+    c.clo = fn->codegen();
+  return c;
+}
+
+// The number of arguments the closure c calls takes, when it is known
+static int known_arity(CALLEE &c) {
+  if (auto lm = dynamic_pointer_cast<BILAMBDA>(c.known))
+    return lm->params.size();
+  if (auto fe = dynamic_pointer_cast<BIFUNCTION>(c.known))
+    if (auto *f = get_module().getFunction(fe->n))
+      return f->arg_size();
+  return -1;
+}
+
+static Value *apply(CALLEE &c, std::vector<Value *> args, int offset) {
+  auto &b = get_builder();
+  for (auto &a : args)
+    a = as_double(a);
+
+  if (c.clo && not_callable(c.known)) {
+    reg_msg(LC_MSG{"lower", "'" + c.name + "' is not a function", MSG_ERROR,
+                   offset});
+    return UndefValue::get(b.getDoubleTy());
+  }
+  int arity = c.lam ? c.lam->params.size() : c.f ? c.f->arg_size()
+                                                 : known_arity(c);
+  if (arity >= 0 && args.size() != arity) {
+    char msg[1024];
+    snprintf(msg, sizeof(msg),
+             "argument mismatch for '%s'. got %zu arguments, expected %d.",
+             c.name.c_str(), args.size(), arity);
+    reg_msg(LC_MSG{"lower", msg, MSG_ERROR, offset});
+    return UndefValue::get(b.getDoubleTy());
+  }
+
+  if (c.f)
+    return b.CreateCall(c.f, args, "call" + lower_id());
+  if (c.clo)
+    return call_closure(c.clo, args, c.name);
+
+  auto saved = USERFUNC::local_values;
+  for (unsigned i = 0; i < args.size(); i++) {
+    auto *slot = entry_alloca(args[i]->getType(), c.lam->params[i]);
+    b.CreateStore(args[i], slot);
+    USERFUNC::local_values[c.lam->params[i]] = slot;
+  }
+  Value *r = nullptr;
+  for (auto e : c.lam->body)
+    r = e->codegen();
+  USERFUNC::local_values = saved;
+  return as_double(r);
+}
+
+static Value *call_value(const std::string &n,
+                         std::vector<std::shared_ptr<EXPR>> &args, int offset) {
+  auto c = callee_of(std::make_shared<ID>(n, offset));
+  std::vector<Value *> vargs;
+  for (auto a : args)
+    vargs.push_back(a->codegen());
+  return apply(c, vargs, offset);
+}
+
+Value *BIFUNCALL::codegen() {
+  if (dump("lower"))
+    puts("lowering BIFUNCALL");
+  auto c = callee_of(fn);
+  std::vector<Value *> vargs;
+  for (auto a : args)
+    vargs.push_back(a->codegen());
+  return apply(c, vargs, offset);
+}
+
+// mapcar and fold walk the list in a loop, with fn applied in its body
+Value *BIHOF::codegen() {
+  if (dump("lower"))
+    puts(op == HOF_MAPCAR ? "lowering mapcar" : "lowering fold");
+  auto &b = get_builder();
+  auto *dbl = b.getDoubleTy();
+  auto *i8p = b.getInt8PtrTy();
+  auto *i64 = b.getInt64Ty();
+
+  auto c = callee_of(fn);
+  auto *rest = entry_alloca(dbl, "rest");
+  auto *acc = entry_alloca(dbl, "acc");
+  auto *idx = entry_alloca(i64, "idx");
+  Value *buf = nullptr, *n = nullptr;
+  if (op == HOF_MAPCAR) {
+    auto *l = args[0]->codegen();
+    auto length =
+        runtime_func("lcrt_length", FunctionType::get(i64, {i8p}, false));
+    n = b.CreateCall(length, {unbox_ptr(l)}, "n");
+    // Only a scratch buffer for lcrt_list to copy from, so it stays out of
+    // the region. Long lists would not fit on the stack.
+    auto malloc = get_module().getOrInsertFunction(
+        "malloc", FunctionType::get(i8p, {i64}, false));
+    buf = b.CreateBitCast(
+        b.CreateCall(malloc, {b.CreateMul(n, b.getInt64(sizeof(double)))}),
+        dbl->getPointerTo(), "elems");
+    b.CreateStore(l, rest);
+    b.CreateStore(b.getInt64(0), idx);
+  } else {
+    b.CreateStore(as_double(args[0]->codegen()), acc);
+    b.CreateStore(args[1]->codegen(), rest);
+  }
+
+  auto *f = b.GetInsertBlock()->getParent();
+  auto *cond = BasicBlock::Create(context(), "hof.cond", f);
+  auto *body = BasicBlock::Create(context(), "hof.body", f);
+  auto *done = BasicBlock::Create(context(), "hof.done", f);
+  b.CreateBr(cond);
+
+  b.SetInsertPoint(cond);
+  auto *l = b.CreateLoad(dbl, rest, "l");
+  b.CreateCondBr(b.CreateICmpNE(b.CreateBitCast(l, i64), b.getInt64(0)), body,
+                 done);
+
+  b.SetInsertPoint(body);
+  auto *x = b.CreateLoad(dbl, b.CreateBitCast(unbox_ptr(l), dbl->getPointerTo()),
+                         "x");
+  if (op == HOF_MAPCAR) {
+    auto *i = b.CreateLoad(i64, idx, "i");
+    b.CreateStore(apply(c, {x}, offset), b.CreateInBoundsGEP(dbl, buf, i));
+    b.CreateStore(b.CreateAdd(i, b.getInt64(1)), idx);
+  } else {
+    auto *a = b.CreateLoad(dbl, acc, "a");
+    b.CreateStore(apply(c, {a, x}, offset), acc);
+  }
+  b.CreateStore(list_cdr(b.CreateLoad(dbl, rest)), rest);
+  b.CreateBr(cond);
+
+  b.SetInsertPoint(done);
+  if (op == HOF_FOLD)
+    return b.CreateLoad(dbl, acc, "fold" + lower_id());
+  auto list = runtime_func(
+      "lcrt_list", FunctionType::get(i8p, {i64, dbl->getPointerTo()}, false));
+  auto *r = b.CreateCall(list, {n, buf}, "mapcar" + lower_id());
+  auto free = get_module().getOrInsertFunction(
+      "free", FunctionType::get(b.getVoidTy(), {i8p}, false));
+  b.CreateCall(free, {b.CreateBitCast(buf, i8p)});
+  return box_ptr(r);
 }
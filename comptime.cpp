@@ -0,0 +1,111 @@
+#include "comptime.h"
+#include "config.h"
+#include "err.h"
+#include "lower.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include <set>
+
+using namespace llvm::orc;
+
+// Collect f and everything it calls into fns, or return false if any of it
+// could have an effect outside its own frame
+static bool pure(Function *f, std::set<const Function *> &fns) {
+  if (!fns.insert(f).second)
+    return true;
+  if (f->isDeclaration() || f->isVarArg())
+    return false;
+  for (auto &bb : *f)
+    for (auto &i : bb) {
+      if (auto *cb = dyn_cast<CallBase>(&i)) {
+        auto *callee = cb->getCalledFunction();
+        if (!callee)
+          return false;
+        if (callee->isIntrinsic()) {
+          if (!callee->doesNotAccessMemory())
+            return false;
+          continue;
+        }
+        if (!pure(callee, fns))
+          return false;
+      } else if (auto *ld = dyn_cast<LoadInst>(&i)) {
+        if (!isa<AllocaInst>(ld->getPointerOperand()))
+          return false;
+      } else if (auto *st = dyn_cast<StoreInst>(&i)) {
+        if (!isa<AllocaInst>(st->getPointerOperand()))
+          return false;
+      } else if (isa<PtrToIntInst>(i) || i.mayReadOrWriteMemory()) {
+        // Addresses of JIT memory must not leak into the output
+        return false;
+      }
+    }
+  return true;
+}
+
+static LLJIT *jit() {
+  static std::unique_ptr<LLJIT> j;
+  static bool tried = false;
+  if (!tried) {
+    tried = true;
+    InitializeNativeTarget();
+    InitializeNativeTargetAsmPrinter();
+    auto e = LLJITBuilder().create();
+    if (e)
+      j = std::move(*e);
+    else
+      reg_msg(LC_MSG{"comptime", toString(e.takeError()), MSG_WARN});
+  }
+  return j.get();
+}
+
+bool comptime_eval(Function *f, double &r) {
+  std::set<const Function *> fns;
+  if (!pure(f, fns) || !jit())
+    return false;
+
+  // Only f and what it calls are compiled; the rest of the module, main
+  // included, may still be half lowered
+  ValueToValueMapTy vmap;
+  auto m = CloneModule(get_module(), vmap, [&](const GlobalValue *gv) {
+    auto *fn = dyn_cast<Function>(gv);
+    return fn && fns.count(fn);
+  });
+
+  // Internal symbols cannot be looked up
+  cast<Function>(vmap[f])->setLinkage(GlobalValue::ExternalLinkage);
+
+  // The JIT owns its context, so move the module over as bitcode
+  SmallVector<char, 0> buf;
+  raw_svector_ostream os(buf);
+  WriteBitcodeToFile(*m, os);
+  auto ctx = std::make_unique<LLVMContext>();
+  auto jm = parseBitcodeFile(MemoryBufferRef(StringRef(buf.data(), buf.size()),
+                                             "comptime"),
+                             *ctx);
+  if (!jm) {
+    consumeError(jm.takeError());
+    return false;
+  }
+
+  // A dylib per evaluation, so functions cloned again later do not clash
+  static int n = 0;
+  auto &jd = jit()->getExecutionSession().createBareJITDylib(
+      "comptime" + std::to_string(n++));
+  if (auto e = jit()->addIRModule(
+          jd, ThreadSafeModule(std::move(*jm), std::move(ctx)))) {
+    reg_msg(LC_MSG{"comptime", toString(std::move(e)), MSG_WARN});
+    return false;
+  }
+  auto sym = jit()->lookup(jd, f->getName());
+  if (!sym) {
+    reg_msg(LC_MSG{"comptime", toString(sym.takeError()), MSG_WARN});
+    return false;
+  }
+  r = ((double (*)())sym->getAddress())();
+  if (dump("comptime"))
+    printf("computed %g at compile time\n", r);
+  return true;
+}
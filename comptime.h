@@ -0,0 +1,14 @@
+#pragma once
+#include "ll.h"
+
+/**
+ * Compile-time evaluation. A function taking no arguments and returning a
+ * double is run in an in-process JIT when everything it can reach is pure:
+ * only arithmetic, stack slots and calls to other pure functions defined in
+ * the module. Anything touching the runtime, libc or memory other than its
+ * own stack slots stays a run time computation.
+ */
+
+// Runs f and stores its result in r. Returns false without running anything
+// if f is not pure or the JIT is not available.
+bool comptime_eval(Function *f, double &r);
@@ -5,37 +5,98 @@
 
 void help() {
   puts("lc: help");
+  puts("lc [options] <file>");
+  puts("lc [options] -");
+  puts("\t\tread the program from stdin, compiling each top-level form as");
+  puts("\t\tsoon as it is complete. Calls may only refer to functions");
+  puts("\t\tdefined earlier in the input.");
   puts("-o");
   puts("\t\tfile compiler output will be written to");
   puts("-target <target>");
   puts("\t\ttarget output type. Valid values are:");
-  puts("\t\t\tinterpret (default), llvm, asm, native");
+  puts("\t\t\tinterpret (default), llvm, asm, native, object");
+  puts("\t\tobject writes a ThinLTO bitcode object <file>.o and the interface");
+  puts("\t\tfile <file>.lci of its exported functions, for other modules to");
+  puts("\t\timport. Objects named on the command line are linked in with ThinLTO.");
   puts("\t\tnote: this implies only temporary files will be generated and the ");
   puts("\t\t-o argument will be ignored if used.");
   puts("-fdump-<phase>");
   puts("\t\tdump all info from phase <phase>");
   puts("\t\tpossible phases include:");
-  puts("\t\t\tpreproc, tok, lex, parse, parse-sexpr, ast, ast1, lower");
+  puts("\t\t\ttok, lex, parse, parse-sexpr, ast, ast1, lower, inline,");
+  puts("\t\t\tspecialize, comptime, macro, multiversion");
   puts("-info");
   puts("\t\tprint extra information about compilation phases");
+  puts("-fcache-ast");
+  puts("\t\treuse the post-sema AST stored in <file>.lcast when the source is");
+  puts("\t\tunchanged, and write it there otherwise");
   puts("-fsyntax-only");
   puts("\t\tstop compilation after parse");
   puts("-llvm <path>");
   puts("\t\tpath to llvm toolchain to be used internally (default: /usr)");
+  puts("-I <dir>");
+  puts("\t\tadditional directory to search for imported interface files");
+  puts("-rt <path>");
+  puts("\t\tdirectory containing the lc runtime library liblcrt.so");
   puts("-O<level>");
   puts("\t\tuse optimization level <level> when invoking clang (default: -O0)");
+  puts("-march=<cpu>, -mcpu=<cpu>");
+  puts("\t\tgenerate code for <cpu>, or for the host with -march=native");
+  puts("\t\t(default: a generic CPU of the host architecture)");
+  puts("-fno-inline");
+  puts("\t\tdisable lc's own inliner (functions declared inline are still inlined)");
+  puts("-finline-threshold=<n>");
+  puts("\t\tinline callees whose estimated size is at most <n> (default: 25)");
+  puts("-fno-comptime");
+  puts("\t\tcompute top-level defvars at run time even when they are pure");
+  puts("-fspecialize-budget=<n>");
+  puts("\t\tclone at most <n> functions for calls with constant arguments");
+  puts("\t\t(default: 32, 0 disables specialization)");
+  puts("-fmemo-capacity=<n>");
+  puts("\t\tnumber of cached results kept per defun-memo function (default: 4096)");
+  puts("-fmemo-stats");
+  puts("\t\tprint hit/miss counts of each defun-memo function at program exit");
+  puts("-fprofile-generate[=<file>]");
+  puts("\t\tinstrument the program to write an IR-level profile to <file>");
+  puts("\t\t(default: default_%m.profraw, or $LLVM_PROFILE_FILE at run time)");
+  puts("-fprofile-use=<file>");
+  puts("\t\tannotate the program with the indexed profile <file> (see llvm-profdata)");
+  puts("-freport-function-cost[=<file>]");
+  puts("\t\tprint the time spent lowering and optimizing each function, its");
+  puts("\t\tAST, IR and machine code size, most expensive first, or write");
+  puts("\t\tthem to <file> as CSV");
+  puts("-finstrument-functions=<mode>");
+  puts("\t\tcount calls of every defun (counts), or calls and the cycles spent");
+  puts("\t\tin them (cycles), and print a report when the program finishes.");
+  puts("\t\tLCRT_PROF_FORMAT=json selects JSON output, LCRT_PROF_OUTPUT=<file>");
+  puts("\t\twrites the report to <file> instead of stderr");
 }
 
 static struct {
   std::string infile = "", outfile = "", llvmroot = "/usr", lvl = "-O0";
+  std::string rtdir = LCRT_DIR;
+  std::string march = "";
   std::vector<std::string> dumps;
+  std::vector<std::string> objects, incdirs;
   std::vector<std::string> debugs;
   bool dumpall = false;
   bool debugall = false;
   bool info = false;
   bool repl = false;
   bool syntaxonly = false;
+  bool cache_ast = false;
+  bool inlining = true;
+  int inline_threshold = 25;
+  int specialize_budget = 32;
+  bool comptime = true;
+  long memo_capacity = 4096;
+  bool memo_stats = false;
+  bool profile_generate = false;
+  std::string profile_file = "", profile_use = "";
+  bool function_cost = false;
+  std::string function_cost_file = "";
   TARGET target = TARGET::INTERPRET;
+  INSTRUMENT instrument = INSTRUMENT::NONE;
 } opts;
 
 void parse_opts(int argc, char **argv) {
@@ -62,6 +123,19 @@ void parse_opts(int argc, char **argv) {
         std::exit(EXIT_FAILURE);
       }
       opts.llvmroot = *it;
+    } else if (*it == "-rt") {
+      it++;
+      if (it == args.end()) {
+        puts("option '-rt' requires an argument");
+        std::exit(EXIT_FAILURE);
+      }
+      opts.rtdir = *it;
+    } else if ((*it).starts_with("-I")) {
+      if (*it == "-I" and ++it == args.end()) {
+        puts("option '-I' requires an argument");
+        std::exit(EXIT_FAILURE);
+      }
+      opts.incdirs.push_back((*it).starts_with("-I") ? (*it).substr(2) : *it);
     } else if (*it == "-i" or *it == "-interpret") {
       opts.target = TARGET::INTERPRET;
     } else if ((*it).starts_with("-O")) {
@@ -83,9 +157,12 @@ void parse_opts(int argc, char **argv) {
         opts.target = TARGET::NATIVE;
       else if (target == "interpret")
         opts.target = TARGET::INTERPRET;
+      else if (target == "object")
+        opts.target = TARGET::OBJECT;
       else {
-        std::string err =
-            "expected -target to be one of llvm, asm, or native, but got " + target;
+        std::string err = "expected -target to be one of llvm, asm, native, "
+                          "interpret or object, but got " +
+                          target;
         printf("%s\n", err.c_str());
         std::exit(EXIT_FAILURE);
       }
@@ -101,12 +178,54 @@ void parse_opts(int argc, char **argv) {
         opts.debugall = true;
       else
         opts.debugs.push_back(d);
-    } else if (*it == "-fsyntax-only")
+    } else if ((*it).starts_with("-march=") or (*it).starts_with("-mcpu=")) {
+      opts.march = (*it).substr((*it).find('=') + 1);
+    } else if (*it == "-fno-inline") {
+      opts.inlining = false;
+    } else if ((*it).starts_with("-finline-threshold=")) {
+      opts.inline_threshold = std::atoi((*it).substr(19).c_str());
+    } else if (*it == "-fno-comptime") {
+      opts.comptime = false;
+    } else if ((*it).starts_with("-fspecialize-budget=")) {
+      opts.specialize_budget = std::atoi((*it).substr(20).c_str());
+    } else if ((*it).starts_with("-fmemo-capacity=")) {
+      opts.memo_capacity = std::atol((*it).substr(16).c_str());
+    } else if (*it == "-fmemo-stats") {
+      opts.memo_stats = true;
+    } else if (*it == "-fprofile-generate") {
+      opts.profile_generate = true;
+    } else if ((*it).starts_with("-fprofile-generate=")) {
+      opts.profile_generate = true;
+      opts.profile_file = (*it).substr(19);
+    } else if ((*it).starts_with("-fprofile-use=")) {
+      opts.profile_use = (*it).substr(14);
+    } else if (*it == "-freport-function-cost") {
+      opts.function_cost = true;
+    } else if ((*it).starts_with("-freport-function-cost=")) {
+      opts.function_cost = true;
+      opts.function_cost_file = (*it).substr(23);
+    } else if ((*it).starts_with("-finstrument-functions=")) {
+      const auto m = (*it).substr(23);
+      if (m == "counts")
+        opts.instrument = INSTRUMENT::COUNTS;
+      else if (m == "cycles")
+        opts.instrument = INSTRUMENT::CYCLES;
+      else {
+        printf("expected -finstrument-functions to be one of counts or cycles, "
+               "but got %s\n",
+               m.c_str());
+        std::exit(EXIT_FAILURE);
+      }
+    } else if (*it == "-fcache-ast")
+      opts.cache_ast = true;
+    else if (*it == "-fsyntax-only")
       opts.syntaxonly = true;
     else if ((*it).starts_with("-info"))
       opts.info = true;
     else if (*it == "-i" or *it == "--interactive")
       opts.repl = true;
+    else if ((*it).ends_with(".o"))
+      opts.objects.push_back(*it);
     else
       opts.infile = *it;
     it++;
@@ -134,6 +253,37 @@ std::string outfile() { return opts.outfile; }
 
 std::string llvmroot() { return opts.llvmroot; }
 
+std::string rtdir() { return opts.rtdir; }
+
 std::string optlevel() { return opts.lvl; }
 
+std::string march() { return opts.march; }
+
+bool inlining() { return opts.inlining; }
+
+int inline_threshold() { return opts.inline_threshold; }
+
+int specialize_budget() { return opts.specialize_budget; }
+
+bool comptime() { return opts.comptime; }
+
+const std::vector<std::string> &link_objects() { return opts.objects; }
+const std::vector<std::string> &include_dirs() { return opts.incdirs; }
+bool cache_ast() { return opts.cache_ast; }
+long memo_capacity() { return opts.memo_capacity; }
+
+bool memo_stats() { return opts.memo_stats; }
+
+bool profile_generate() { return opts.profile_generate; }
+
+std::string profile_file() { return opts.profile_file; }
+
+std::string profile_use() { return opts.profile_use; }
+
+bool function_cost() { return opts.function_cost; }
+
+std::string function_cost_file() { return opts.function_cost_file; }
+
 TARGET target() { return opts.target; }
+
+INSTRUMENT instrument() { return opts.instrument; }
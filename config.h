@@ -15,16 +15,41 @@ bool debug(std::string_view sv);
 bool info();
 bool repl();
 bool syntaxonly();
+bool cache_ast();
+const std::vector<std::string>& link_objects();
+const std::vector<std::string>& include_dirs();
 std::string outfile();
 std::string infile();
 std::string llvmroot();
+std::string rtdir();
 std::string optlevel();
+std::string march();
+bool inlining();
+int inline_threshold();
+int specialize_budget();
+bool comptime();
+long memo_capacity();
+bool memo_stats();
+bool profile_generate();
+std::string profile_file();
+std::string profile_use();
+bool function_cost();
+std::string function_cost_file();
 
 enum class TARGET {
   LLVM,
   ASM,
   NATIVE,
   INTERPRET,
+  OBJECT,
 };
 
 TARGET target();
+
+enum class INSTRUMENT {
+  NONE,
+  COUNTS,
+  CYCLES,
+};
+
+INSTRUMENT instrument();
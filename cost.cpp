@@ -0,0 +1,218 @@
+#include "cost.h"
+#include "config.h"
+#include "err.h"
+#include "lower.h"
+#include "opt.h"
+#include "target.h"
+#include "llvm/Analysis/LazyCallGraph.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Object/ELFObjectFile.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include <chrono>
+#include <map>
+
+struct COST {
+  double lower = 0, opt = 0;
+  size_t nodes = 0, insts = 0, blocks = 0, mc = 0;
+};
+
+static std::map<std::string, COST> costs;
+// Functions lowered for a defun under another name
+static std::map<std::string, std::string> owners;
+
+double cost_clock() {
+  using namespace std::chrono;
+  return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+// The defun a function's cost is charged to. Clones made by the optimizer
+// share the name of what they were cloned from up to a '.'.
+static COST &cost_of(std::string n) {
+  for (auto c = n;;) {
+    if (auto it = owners.find(c); it != owners.end())
+      return costs[it->second];
+    if (auto it = costs.find(c); it != costs.end())
+      return it->second;
+    auto dot = c.rfind('.');
+    if (dot == std::string::npos || dot == 0)
+      return costs[n];
+    c.erase(dot);
+  }
+}
+
+void cost_lowered(Function *f, Function *body, double secs, size_t nodes) {
+  auto n = f->getName().str();
+  auto &c = costs[n];
+  c.lower += secs;
+  c.nodes += nodes;
+  for (auto *fn : {f, body}) {
+    for (auto &bb : *fn)
+      c.insts += bb.size();
+    c.blocks += fn->size();
+    if (fn == body)
+      break;
+  }
+  if (body != f)
+    owners[body->getName().str()] = n;
+}
+
+void cost_optimized(Function *f, double secs) {
+  cost_of(f->getName().str()).opt += secs;
+}
+
+// Passes nest: a function pass manager is itself a pass, and a CGSCC pipeline
+// runs function passes. Only the outermost pass on a function or SCC is timed,
+// and SCC time is split evenly between its functions. Module passes cannot be
+// charged to any one function and are left out.
+static std::vector<std::string> timed;
+static double started;
+static int depth;
+
+static bool per_function(Any ir) {
+  return any_isa<const Function *>(ir) ||
+         any_isa<const LazyCallGraph::SCC *>(ir) || any_isa<const Loop *>(ir);
+}
+
+static void before_pass(StringRef, Any ir) {
+  if (!per_function(ir) || depth++)
+    return;
+  timed.clear();
+  if (any_isa<const Function *>(ir))
+    timed.push_back(any_cast<const Function *>(ir)->getName().str());
+  else if (any_isa<const LazyCallGraph::SCC *>(ir))
+    for (auto &n : *any_cast<const LazyCallGraph::SCC *>(ir))
+      timed.push_back(n.getFunction().getName().str());
+  started = cost_clock();
+}
+
+static void after_pass() {
+  if (--depth || timed.empty())
+    return;
+  double secs = (cost_clock() - started) / timed.size();
+  for (auto &n : timed)
+    cost_of(n).opt += secs;
+}
+
+PassInstrumentationCallbacks *cost_callbacks() {
+  static PassInstrumentationCallbacks pic;
+  static bool registered = false;
+  if (!function_cost())
+    return nullptr;
+  if (!registered) {
+    pic.registerBeforeNonSkippedPassCallback(before_pass);
+    pic.registerAfterPassCallback(
+        [](StringRef, Any ir, const PreservedAnalyses &) {
+          if (per_function(ir))
+            after_pass();
+        });
+    // Only SCCs and loops are invalidated by the passes running on them
+    pic.registerAfterPassInvalidatedCallback(
+        [](StringRef, const PreservedAnalyses &) { after_pass(); });
+    registered = true;
+  }
+  return &pic;
+}
+
+static CodeGenOpt::Level codegen_level() {
+  auto ol = optlevel();
+  if (ol == "-O0")
+    return CodeGenOpt::None;
+  if (ol == "-O1")
+    return CodeGenOpt::Less;
+  if (ol == "-O3")
+    return CodeGenOpt::Aggressive;
+  return CodeGenOpt::Default;
+}
+
+// Build a copy of the module the way clang will, through the -O<level>
+// pipeline to a native object, and charge each function symbol's size
+static void measure_machine_code() {
+  auto triple = sys::getDefaultTargetTriple();
+  InitializeNativeTarget();
+  InitializeNativeTargetAsmPrinter();
+  std::string err;
+  auto *t = TargetRegistry::lookupTarget(triple, err);
+  if (!t) {
+    reg_msg(LC_MSG{"cost", "no native target, machine code size not measured",
+                   MSG_WARN});
+    return;
+  }
+  std::unique_ptr<TargetMachine> tm(t->createTargetMachine(
+      triple, march().empty() ? "generic" : target_cpu(), "", {}, Reloc::PIC_,
+      None, codegen_level()));
+
+  auto m = CloneModule(get_module());
+  m->setTargetTriple(triple);
+  m->setDataLayout(tm->createDataLayout());
+  run_default_pipeline(*m, tm.get());
+
+  SmallVector<char, 0> buf;
+  raw_svector_ostream os(buf);
+  legacy::PassManager pm;
+  if (tm->addPassesToEmitFile(pm, os, nullptr, CGFT_ObjectFile)) {
+    reg_msg(LC_MSG{"cost", "cannot emit an object, machine code size not measured",
+                   MSG_WARN});
+    return;
+  }
+  pm.run(*m);
+
+  auto obj = object::ObjectFile::createObjectFile(
+      MemoryBufferRef(StringRef(buf.data(), buf.size()), "cost"));
+  if (!obj) {
+    consumeError(obj.takeError());
+    return;
+  }
+  auto *elf = dyn_cast<object::ELFObjectFileBase>(obj->get());
+  if (!elf)
+    return;
+  for (auto sym : elf->symbols()) {
+    auto type = sym.getType();
+    auto name = sym.getName();
+    if (!type || *type != object::SymbolRef::ST_Function || !name) {
+      consumeError(type.takeError());
+      consumeError(name.takeError());
+      continue;
+    }
+    cost_of(name->str()).mc += sym.getSize();
+  }
+}
+
+void cost_report() {
+  if (!function_cost())
+    return;
+  measure_machine_code();
+
+  std::vector<std::pair<std::string, COST>> rows(costs.begin(), costs.end());
+  std::stable_sort(rows.begin(), rows.end(), [](auto &a, auto &b) {
+    return a.second.lower + a.second.opt > b.second.lower + b.second.opt;
+  });
+
+  auto file = function_cost_file();
+  if (file.empty()) {
+    fprintf(stderr, "%-24s %10s %10s %10s %10s %10s %10s\n", "function",
+            "lower ms", "opt ms", "ast nodes", "ir insts", "ir blocks",
+            "mc bytes");
+    for (auto &[n, c] : rows)
+      fprintf(stderr, "%-24s %10.3f %10.3f %10zu %10zu %10zu %10zu\n",
+              n.c_str(), c.lower * 1e3, c.opt * 1e3, c.nodes, c.insts,
+              c.blocks, c.mc);
+    return;
+  }
+
+  FILE *fp = fopen(file.c_str(), "w");
+  if (!fp) {
+    reg_msg(LC_MSG{"cost", "could not open " + file + " for writing",
+                   MSG_ERROR});
+    return;
+  }
+  fputs("function,lower_ms,opt_ms,ast_nodes,ir_insts,ir_blocks,mc_bytes\n", fp);
+  for (auto &[n, c] : rows)
+    fprintf(fp, "%s,%.3f,%.3f,%zu,%zu,%zu,%zu\n", n.c_str(), c.lower * 1e3,
+            c.opt * 1e3, c.nodes, c.insts, c.blocks, c.mc);
+  fclose(fp);
+}
@@ -0,0 +1,29 @@
+#pragma once
+#include "ll.h"
+#include "llvm/IR/PassInstrumentation.h"
+
+/**
+ * Per-function compile cost, for -freport-function-cost. Each defun records
+ * the time spent lowering it, its AST size and the IR it was lowered to. Pass
+ * instrumentation charges optimization time to the function or call graph SCC
+ * a pass ran on, and the report compiles a copy of the module to a native
+ * object to read off each function's machine code size. Clones lc makes of a
+ * defun (specializations, memoized bodies) are charged to the defun.
+ */
+
+// Seconds since an arbitrary fixed point
+double cost_clock();
+
+// f was lowered in secs from nodes AST nodes. body is the function holding the
+// defun's code when that is not f itself.
+void cost_lowered(Function *f, Function *body, double secs, size_t nodes);
+
+// Optimization time spent on f outside of a pass manager
+void cost_optimized(Function *f, double secs);
+
+// Callbacks to hand a PassBuilder, or nullptr when no report was asked for
+PassInstrumentationCallbacks *cost_callbacks();
+
+// Prints the report, sorted by compile time, or writes it as CSV to the file
+// given with the option
+void cost_report();
@@ -4,19 +4,67 @@
 #include <cstring>
 #include <cstdlib>
 #include <vector>
+#include <algorithm>
 
 static std::vector<LC_MSG> errs;
+static std::string         source;
+static size_t              source_base = 0;
+// Starts of the lines overlapping the window; the first may begin before it
+static std::vector<size_t> line_starts{0};
+static int                 first_line = 1;
+
+static void resolve(LC_MSG& e)
+{
+  if (e.offset < (int)source_base or e.offset > (int)(source_base + source.size()))
+    return;
+  // last line start <= offset; lines and columns are 1-based
+  auto   it    = std::upper_bound(line_starts.begin(), line_starts.end(), (size_t)e.offset) - 1;
+  size_t start = std::max(*it, source_base);
+  size_t end   = source.find('\n', start - source_base);
+  if (end == std::string::npos)
+    end = source.size();
+  e.line  = first_line + (it - line_starts.begin());
+  e.col   = e.offset - *it + 1;
+  e.caret = e.offset - start;
+  e.text  = source.substr(start - source_base, end - (start - source_base));
+}
 
 void reg_msg(LC_MSG err)
 {
+  if (err.offset >= 0)
+    resolve(err);
   errs.push_back(err);
   if (err.lvl == MSG_FATAL)
     std::exit(EXIT_FAILURE);
 }
 
+void set_source(std::string_view src, size_t base)
+{
+  if (base == 0)
+  {
+    first_line = 1;
+    line_starts.assign(1, 0);
+  }
+  else
+  {
+    first_line += line_starts.size() - 1;
+    line_starts.erase(line_starts.begin(), line_starts.end() - 1);
+  }
+  // keep the start of a line the previous chunk ended in, so messages on it
+  // still show the whole line
+  std::string prefix;
+  if (base > 0 and line_starts.back() >= source_base and base == source_base + source.size())
+    prefix = source.substr(line_starts.back() - source_base);
+  source_base = base - prefix.size();
+  source      = std::move(prefix);
+  source.append(src);
+  for (size_t i = base - source_base; i < source.size(); i++)
+    if (source[i] == '\n')
+      line_starts.push_back(source_base + i + 1);
+}
+
 void err_printer()
 {
-  FILE* fp = fopen(infile().c_str(), "r");
   for (auto const& e : errs)
   {
     if (e.lvl == MSG_INFO and !info())
@@ -31,27 +79,13 @@ void err_printer()
         lvl = "?";
     }
     printf("LC(%s):%s:%s", lvl.c_str(), e.phase.c_str(), e.msg.c_str());
-    if (e.offset > 0)
+    if (e.line > 0)
     {
-      printf(":offset=%d",e.offset);
-      int start=0, end=0;
-      char* line=nullptr;
-      size_t len, last_offset = 0, lineno = 0;
-      while (getline(&line, &len, fp) >= 0)
-      {
-        if (ftell(fp) >= e.offset)
-          break;
-        last_offset = ftell(fp);
-        lineno++;
-      }
-      int col = e.offset - last_offset;
-      int linelen = strlen(line);
-      line[linelen-1] = 0;
-      printf("\n%s:%zu:%d:\n%s\n", infile().c_str(), lineno, col, line);
-      for (int i=0; i < col-1; i++)
+      printf("\n%s:%d:%d:\n%s\n", infile() == "-" ? "<stdin>" : infile().c_str(),
+             e.line, e.col, e.text.c_str());
+      for (int i = 0; i < e.caret; i++)
         printf("~");
       printf("^");
-      free(line);
     }
     puts("");
   }
@@ -60,7 +94,6 @@ void err_printer()
   {
     puts("LC: fatal errors occured. lc did not successfully run to completion.");
   }
-  fclose(fp);
 }
 
 bool any_errors()
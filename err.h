@@ -1,5 +1,6 @@
 #pragma once
 #include <string>
+#include <string_view>
 
 enum MSGLVL
 {
@@ -14,6 +15,12 @@ struct LC_MSG
   std::string msg;
   MSGLVL      lvl;
   int         offset = -1;
+
+  // Filled in from the source window when the message is registered
+  int         line  = 0;
+  int         col   = 0;
+  int         caret = 0;
+  std::string text;
 };
 
 #define LCASSERT_P(ph, msg, cond) \
@@ -22,6 +29,15 @@ struct LC_MSG
 
 #define LCASSERT(msg, cond) LCASSERT_P("internal compiler error", msg, (cond));
 
+/**
+ * Hand the diagnostics engine the source text that messages registered from
+ * now on refer to. Message offsets are absolute byte offsets; src starts at
+ * offset base. A streaming driver passes consecutive chunks with increasing
+ * bases and only the current chunk is kept: line numbers carry over from the
+ * previous chunks, and each message resolves its line:col and source line as
+ * it is registered.
+ */
+void set_source(std::string_view src, size_t base = 0);
 void reg_msg(LC_MSG err);
 void err_printer();
 bool any_errors();
@@ -0,0 +1,62 @@
+#include "iface.h"
+#include "config.h"
+#include "lower.h"
+#include "parse.h"
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+
+namespace fs = std::filesystem;
+
+static fs::path find_interface(const std::string &module) {
+  fs::path src = infile() == "-" ? fs::path(".") : fs::path(infile());
+  auto dir = infile() == "-" ? src : src.parent_path();
+  auto p = dir / (module + ".lci");
+  if (fs::exists(p))
+    return p;
+  for (auto &d : include_dirs())
+    if (fs::exists(p = fs::path(d) / (module + ".lci")))
+      return p;
+  return {};
+}
+
+bool read_interface(const std::string &module,
+                    std::vector<std::shared_ptr<PROTOTYPE>> &protos) {
+  auto path = find_interface(module);
+  if (path.empty())
+    return false;
+  std::ifstream is(path);
+  for (std::string line; std::getline(is, line);) {
+    if (auto c = line.find(';'); c != std::string::npos)
+      line.erase(c);
+    if (line.find_first_not_of(" \t\r") == std::string::npos)
+      continue;
+    // '(import (name args...))'; the parens carry no other structure here
+    for (auto &c : line)
+      if (c == '(' or c == ')')
+        c = ' ';
+    std::istringstream ws(line);
+    std::string kw, n, a;
+    if (!(ws >> kw >> n) or kw != "import")
+      return false;
+    std::vector<std::string> args;
+    while (ws >> a)
+      args.push_back(a);
+    protos.push_back(std::make_shared<PROTOTYPE>(n, args));
+  }
+  return true;
+}
+
+bool write_interface(const std::string &path) {
+  std::ofstream os(path);
+  os << "; lc module interface of " << infile() << "\n";
+  for (auto &f : get_module()) {
+    if (f.isDeclaration() or f.hasLocalLinkage() or f.getName() == "main")
+      continue;
+    os << "(import (" << f.getName().str();
+    for (auto &a : f.args())
+      os << " " << a.getName().str();
+    os << "))\n";
+  }
+  return bool(os);
+}
@@ -0,0 +1,20 @@
+#pragma once
+#include <memory>
+#include <string>
+#include <vector>
+
+struct PROTOTYPE;
+
+/**
+ * Module interface files (.lci). An interface is itself lc source: one
+ * '(import (<name> <arg>...))' form per function the module exports, so it
+ * can be read back without the object it describes.
+ */
+
+// Looks for <module>.lci next to the input file, then in each -I directory.
+// Returns false if none is found or it is malformed.
+bool read_interface(const std::string &module,
+                    std::vector<std::shared_ptr<PROTOTYPE>> &protos);
+
+// Writes the externally visible functions defined in the lowered module
+bool write_interface(const std::string &path);
@@ -1,5 +1,9 @@
 #include "lower.h"
 #include "config.h"
+#include "astcache.h"
+#include "cost.h"
+#include "target.h"
+#include "rt/lcrt.h"
 
 using namespace llvm;
 
@@ -7,6 +11,8 @@ static std::unique_ptr<LLVMContext>  ctx;
 static std::unique_ptr<Module>       module;
 static std::unique_ptr<IRBuilder<>>  builder;
 static std::map<std::string, Value*> named_values;
+static bool                          uses_runtime = false;
+static std::vector<GlobalVariable*>  prof_entries;
 
 LLVMContext& context()
 {
@@ -31,13 +37,22 @@ IRBuilder<>& get_builder()
   return *builder;
 }
 
-Value* get_value(std::string n)
+/**
+ * Like get_value, but returns nullptr without reporting anything when n is
+ * not defined.
+ */
+Value* lookup_value(std::string n)
 {
   {
     // First try to find in local function scope
     auto v = USERFUNC::local_values.find(n);
     if(v != USERFUNC::local_values.end())
+    {
+      // Mutable variables stay in their stack slot until mem2reg
+      if(auto* slot = dyn_cast<AllocaInst>((*v).second))
+        return builder->CreateLoad(slot->getAllocatedType(), slot, n);
       return (*v).second;
+    }
   }
 
   {
@@ -47,35 +62,214 @@ Value* get_value(std::string n)
       return (*v).second;
   }
 
-  std::string msg = "could not find named value '" + n + "'";
-  reg_msg(LC_MSG{"sema", msg, MSG_ERROR});
   return nullptr;
 }
 
+Value* get_value(std::string n, int offset)
+{
+  if(auto* v = lookup_value(n))
+    return v;
+
+  // Keep lowering after the error so every undefined name gets reported; the
+  // driver stops before anything is emitted.
+  std::string msg = "could not find named value '" + n + "'";
+  reg_msg(LC_MSG{"lower", msg, MSG_ERROR, offset});
+  return UndefValue::get(Type::getDoubleTy(*ctx));
+}
+
+/**
+ * Create an alloca in the entry block of the function being lowered, so it is
+ * allocated once no matter where in the function it is needed.
+ */
+AllocaInst* entry_alloca(Type* t, std::string n)
+{
+  auto&       entry = builder->GetInsertBlock()->getParent()->getEntryBlock();
+  IRBuilder<> b(&entry, entry.begin());
+  return b.CreateAlloca(t, nullptr, n);
+}
+
+/**
+ * Every lc value is a double, so handles to runtime objects travel as doubles
+ * holding the bits of the pointer. They are only ever moved around, never
+ * used in arithmetic.
+ */
+Value* box_ptr(Value* p)
+{
+  auto* bits = builder->CreatePtrToInt(p, builder->getInt64Ty());
+  return builder->CreateBitCast(bits, builder->getDoubleTy());
+}
+
+Value* unbox_ptr(Value* d)
+{
+  auto* bits = builder->CreateBitCast(d, builder->getInt64Ty());
+  return builder->CreateIntToPtr(bits, builder->getInt8PtrTy());
+}
+
+/**
+ * Allocate memory for a language-level object. Every such allocation goes
+ * through the runtime's region allocator, so it is a pointer bump and is
+ * reclaimed when the enclosing with-region exits.
+ */
+Value* lc_alloc(Value* size, unsigned align)
+{
+  auto* i64   = builder->getInt64Ty();
+  auto  alloc = runtime_func("lcrt_alloc",
+                             FunctionType::get(builder->getInt8PtrTy(), {i64, i64}, false));
+  return builder->CreateCall(alloc, {size, builder->getInt64(align)}, "alloc");
+}
+
+/**
+ * Entry of the table -finstrument-functions maintains: the function name,
+ * the number of calls and the cycles spent in it (see lcrt_prof_entry).
+ */
+static StructType* prof_entry_type()
+{
+  auto* i64 = builder->getInt64Ty();
+  return StructType::get(*ctx, {builder->getInt8PtrTy(), i64, i64});
+}
+
+/**
+ * Add entry and exit hooks to a fully lowered function. The hooks update the
+ * function's entry in a static table directly, without calling into the
+ * runtime; the table is only handed to the runtime when main returns.
+ */
+void instrument_function(Function* f)
+{
+  if(instrument() == INSTRUMENT::NONE)
+    return;
+
+  auto* ty    = prof_entry_type();
+  auto* entry = new GlobalVariable(*module, ty, false, GlobalValue::InternalLinkage,
+                                   Constant::getNullValue(ty), f->getName() + ".prof");
+  prof_entries.push_back(entry);
+
+  bool        cycles = instrument() == INSTRUMENT::CYCLES;
+  auto*       i64    = builder->getInt64Ty();
+  auto*       rdtsc  = Intrinsic::getDeclaration(module.get(), Intrinsic::readcyclecounter);
+  IRBuilder<> b(&*f->getEntryBlock().getFirstInsertionPt());
+  b.CreateAtomicRMW(AtomicRMWInst::Add, b.CreateStructGEP(ty, entry, 1), b.getInt64(1),
+                    MaybeAlign(8), AtomicOrdering::Monotonic);
+  Value* start = cycles ? b.CreateCall(rdtsc, {}, "prof.start") : nullptr;
+  if(!cycles)
+    return;
+
+  for(auto& bb : *f)
+    if(auto* ret = dyn_cast<ReturnInst>(bb.getTerminator()))
+    {
+      b.SetInsertPoint(ret);
+      auto* delta = b.CreateSub(b.CreateCall(rdtsc), start, "prof.cycles");
+      b.CreateAtomicRMW(AtomicRMWInst::Add, b.CreateStructGEP(ty, entry, 2), delta,
+                        MaybeAlign(8), AtomicOrdering::Monotonic);
+    }
+}
+
+/**
+ * Gather the per-function entries into one array, named after the functions,
+ * and report it before main returns.
+ */
+static void emit_prof_report()
+{
+  if(instrument() == INSTRUMENT::NONE)
+    return;
+
+  auto*                  ty = prof_entry_type();
+  auto*                  at = ArrayType::get(ty, prof_entries.size());
+  std::vector<Constant*> init;
+  for(auto* e : prof_entries)
+  {
+    auto n = e->getName();
+    n.consume_back(".prof");
+    auto* name = builder->CreateGlobalStringPtr(n, "prof.name");
+    init.push_back(ConstantStruct::get(ty, {name, builder->getInt64(0), builder->getInt64(0)}));
+  }
+  auto* table = new GlobalVariable(*module, at, false, GlobalValue::InternalLinkage,
+                                   ConstantArray::get(at, init), "lc.prof");
+  for(unsigned i = 0; i < prof_entries.size(); i++)
+  {
+    auto* gep = ConstantExpr::getInBoundsGetElementPtr(
+        at, table, ArrayRef<Constant*>{builder->getInt32(0), builder->getInt32(i)});
+    prof_entries[i]->replaceAllUsesWith(gep);
+    prof_entries[i]->eraseFromParent();
+  }
+  prof_entries.clear();
+
+  auto* i64    = builder->getInt64Ty();
+  auto  report = runtime_func("lcrt_prof_report",
+                              FunctionType::get(builder->getVoidTy(),
+                                                {ty->getPointerTo(), i64, builder->getInt32Ty()},
+                                                false));
+  auto* first  = builder->CreateConstInBoundsGEP2_32(at, table, 0, 0);
+  builder->CreateCall(report, {first, builder->getInt64(at->getNumElements()),
+                               builder->getInt32(instrument() == INSTRUMENT::CYCLES
+                                                     ? LCRT_PROF_CYCLES
+                                                     : LCRT_PROF_COUNTS)});
+}
+
 void add_value(std::string name, Value* v)
 {
   named_values[name] = v;
 }
 
-void add_print()
+/**
+ * Declare a function provided by the lc runtime library (rt/) and note that
+ * the output has to be linked against it.
+ */
+FunctionCallee runtime_func(std::string n, FunctionType* ft)
 {
-  module->getOrInsertFunction("printf", FunctionType::get(IntegerType::getInt8PtrTy(context()),
-                                          PointerType::get(Type::getInt8Ty(context()), 0), true));
+  uses_runtime = true;
+  return module->getOrInsertFunction(n, ft);
 }
 
-void add_puts()
+bool needs_runtime()
 {
-  module->getOrInsertFunction("puts", FunctionType::get(IntegerType::getInt8PtrTy(context()),
-                                        PointerType::get(Type::getInt8Ty(context()), 0), true));
+  return uses_runtime;
 }
 
 void add_builtins()
 {
-  add_print();
-  add_puts();
+  // The empty list is the null pointer, which as a double is 0
+  add_value("nil", ConstantFP::get(context(), APFloat(0.0)));
 }
 
-void lower(std::shared_ptr<MODULE> m)
+static Function*                  mainf;
+static Value*                     last;
+static std::map<std::string, int> exports;
+// Cost of the top-level forms, charged to main
+static double                     toplevel_secs;
+static size_t                     toplevel_nodes;
+
+/**
+ * Whether the builder is in main, i.e. lowering a top-level form rather than
+ * the body of a function.
+ */
+bool at_top_level()
+{
+  return builder->GetInsertBlock()->getParent() == mainf;
+}
+
+void add_export(std::string name, int offset)
+{
+  exports.emplace(name, offset);
+}
+
+/**
+ * A module compiled on its own only exposes what it exports; everything else
+ * is internal so ThinLTO can inline and drop it freely.
+ */
+static void internalize()
+{
+  for(auto& [n, offset] : exports)
+  {
+    auto* f = module->getFunction(n);
+    if(!f or f->isDeclaration())
+      reg_msg(LC_MSG{"lower", "exported function '" + n + "' is not defined", MSG_ERROR, offset});
+  }
+  for(auto& f : *module)
+    if(!f.isDeclaration() and &f != mainf and !exports.count(std::string(f.getName())))
+      f.setLinkage(GlobalValue::InternalLinkage);
+}
+
+void lower_begin()
 {
   ctx     = std::make_unique<LLVMContext>();
   module  = std::make_unique<Module>("lisp compiler", *ctx);
@@ -83,17 +277,83 @@ void lower(std::shared_ptr<MODULE> m)
 
   add_builtins();
 
-  m->codegen_funcs();
-
-  std::vector<Type*> entrypoint;
-  FunctionType*      ft = FunctionType::get(IntegerType::get(*ctx, 8), false);
-  Function*          f  = Function::Create(ft, Function::ExternalLinkage, "main", module.get());
-  BasicBlock*        bb = BasicBlock::Create(*ctx, "entry", f);
+  FunctionType* ft = FunctionType::get(IntegerType::get(*ctx, 8), false);
+  mainf            = Function::Create(ft, Function::ExternalLinkage, "main", module.get());
+  BasicBlock* bb   = BasicBlock::Create(*ctx, "entry", mainf);
   builder->SetInsertPoint(bb);
-  auto* v = m->codegen();
+  last = nullptr;
+  exports.clear();
+  toplevel_secs  = 0;
+  toplevel_nodes = 0;
+}
+
+static Value* lower_toplevel(std::shared_ptr<SEXPR> se)
+{
+  double started = cost_clock();
+  auto*  v       = se->codegen();
+  toplevel_secs += cost_clock() - started;
+  if(function_cost())
+    toplevel_nodes += ast_size(se);
+  return v;
+}
+
+void lower_form(std::shared_ptr<SEXPR> se)
+{
+  if(is_decl_form(se))
+  {
+    // defuns move the builder into their own body; pick main back up after
+    auto ip = builder->saveIP();
+    se->codegen();
+    builder->restoreIP(ip);
+    USERFUNC::local_values.clear();
+  }
+  else
+    last = lower_toplevel(se);
+}
+
+void lower_end()
+{
+  if(target() == TARGET::OBJECT)
+  {
+    // a library module has no top-level expressions, and so no main
+    if(!last and mainf->getEntryBlock().empty())
+    {
+      mainf->eraseFromParent();
+      mainf = nullptr;
+    }
+    internalize();
+  }
+  lower_targets();
+  if(!mainf)
+    return;
+
+  auto* v = last;
   if(!v)
     v = ConstantFP::get(context(), APFloat((double)0.0));
-  builder->SetInsertPoint(bb);
   auto* ret = builder->CreateFPToSI(v, IntegerType::get(*ctx, 8), "return");
+  emit_prof_report();
   builder->CreateRet(ret);
+  if(function_cost())
+    cost_lowered(mainf, mainf, toplevel_secs, toplevel_nodes);
+}
+
+void lower(std::shared_ptr<MODULE> m)
+{
+  lower_begin();
+
+  // Lower every defun before main's body, so calls may refer to functions
+  // defined later in the file
+  auto ip = builder->saveIP();
+  m->codegen_funcs();
+  builder->restoreIP(ip);
+  USERFUNC::local_values.clear();
+
+  double started = cost_clock();
+  last           = m->codegen();
+  toplevel_secs += cost_clock() - started;
+  if(function_cost())
+    for(auto se : m->sexprs)
+      if(!is_decl_form(se))
+        toplevel_nodes += ast_size(se);
+  lower_end();
 }
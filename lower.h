@@ -2,10 +2,29 @@
 #include "ll.h"
 #include "parse.h"
 struct MODULE;
+struct SEXPR;
 void lower(std::shared_ptr<MODULE> m);
+/**
+ * Incremental lowering for the streaming driver: lower_form lowers one
+ * sema'd top-level form into the module as soon as it is available. Unlike
+ * lower(), a call can only refer to functions defined earlier in the input.
+ */
+void lower_begin();
+void lower_form(std::shared_ptr<SEXPR> se);
+void lower_end();
 void add_value(std::string name, Value* v);
-Value* get_value(std::string n);
+void add_export(std::string name, int offset);
+bool at_top_level();
+Value* get_value(std::string n, int offset = -1);
+Value* lookup_value(std::string n);
+AllocaInst* entry_alloca(Type* t, std::string n);
+Value* box_ptr(Value* p);
+Value* unbox_ptr(Value* d);
+Value* lc_alloc(Value* size, unsigned align);
+void instrument_function(Function* f);
 LLVMContext& context();
 IRBuilder<>& get_builder();
 Module& get_module();
 std::string lower_id();
+FunctionCallee runtime_func(std::string n, FunctionType* ft);
+bool needs_runtime();
@@ -1,23 +1,39 @@
+#include <cerrno>
 #include <cstdlib>
 #include <filesystem>
 #include <sys/wait.h>
 #include <unistd.h>
 #include <uuid/uuid.h>
 
+#include "astcache.h"
 #include "config.h"
+#include "cost.h"
+#include "iface.h"
 #include "err.h"
 #include "lower.h"
+#include "opt.h"
 #include "parse.h"
 #include "sema.h"
+#include "target.h"
+#include "llvm/Analysis/ModuleSummaryAnalysis.h"
+#include "llvm/Analysis/ProfileSummaryInfo.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Target/TargetMachine.h"
 
 namespace fs = std::filesystem;
 
 // Get the input file without a file extension
 std::string infile_noext() {
   auto inf = infile();
+  if (inf == "-")
+    return "a";
 
   auto dot = inf.rfind('.');
-  inf.erase(dot);
+  if (dot != std::string::npos)
+    inf.erase(dot);
 
   auto slash = inf.rfind('/');
   inf.erase(0, slash + 1);
@@ -91,10 +107,14 @@ void emit_asm() {
   {
     auto clang = llvmroot() + "/bin/clang";
     auto ol = optlevel();
-    char *const argv[] = {clang.data(), "-Wno-override-module",
-                          ol.data(),    "-S",
-                          tmpfile.data(),      "-o",
-                          of.data(),    NULL};
+    auto cpu = "-march=" + target_cpu();
+    std::vector<char *> argv = {clang.data(), "-Wno-override-module",
+                                ol.data(),    "-S",
+                                tmpfile.data(),      "-o",
+                                of.data()};
+    if (!march().empty())
+      argv.push_back(cpu.data());
+    argv.push_back(NULL);
     if (info()) {
       puts("exec'ing the following command:");
       int i = 0;
@@ -103,7 +123,7 @@ void emit_asm() {
       }
       puts("");
     }
-    execv(argv[0], argv);
+    execv(argv[0], argv.data());
     std::exit(0);
   }
 
@@ -116,14 +136,9 @@ void emit_asm() {
   }
 }
 
-void emit_native() {
+void build_native(std::string of) {
   auto tmpfile = gen_llvm();
 
-  std::string of;
-  if ((of = outfile()) == "") {
-    of = "a.out";
-  }
-
   if (info())
     printf("writing asm output to %s\n", of.c_str());
 
@@ -134,10 +149,31 @@ void emit_native() {
   {
     auto clang = llvmroot() + "/bin/clang";
     auto ol = optlevel();
-    char *const argv[] = {clang.data(), "-Wno-override-module",
-                          ol.data(),    tmpfile.data(),
-                          "-o",         of.data(),
-                          NULL};
+    auto rtlib = rtdir() + "/liblcrt.so";
+    auto rpath = "-Wl,-rpath," + rtdir();
+    auto cpu = "-march=" + target_cpu();
+    std::vector<char *> argv = {clang.data(),   "-Wno-override-module",
+                                ol.data(),      tmpfile.data(),
+                                "-o",           of.data()};
+    if (!march().empty())
+      argv.push_back(cpu.data());
+    // Linked objects may print, which goes through the runtime too
+    if (needs_runtime() || !link_objects().empty()) {
+      argv.push_back(rtlib.data());
+      argv.push_back(rpath.data());
+    }
+    // Objects from -target object are ThinLTO bitcode
+    std::vector<std::string> objects = link_objects();
+    if (!objects.empty()) {
+      argv.push_back("-flto=thin");
+      argv.push_back("-fuse-ld=lld");
+      for (auto &o : objects)
+        argv.push_back(o.data());
+    }
+    // The module is already instrumented; this only links the profile runtime
+    if (profile_generate())
+      argv.push_back("-fprofile-instr-generate");
+    argv.push_back(NULL);
     if (info()) {
       puts("exec'ing the following command:");
       int i = 0;
@@ -146,7 +182,7 @@ void emit_native() {
       }
       puts("");
     }
-    execv(argv[0], argv);
+    execv(argv[0], argv.data());
     std::exit(0);
   }
 
@@ -159,8 +195,79 @@ void emit_native() {
   }
 }
 
+// Bitcode with a ThinLTO summary, the same kind of object clang -flto=thin -c
+// writes, so the final link can import and inline across modules
+void emit_object() {
+  std::string of;
+  if ((of = outfile()) == "")
+    of = infile_noext() + ".o";
+  auto iface = fs::path(of).replace_extension(".lci").string();
+
+  // ThinLTO needs the triple and data layout of the host to import across
+  // modules
+  auto triple = sys::getDefaultTargetTriple();
+  InitializeNativeTarget();
+  std::string err;
+  if (auto *t = TargetRegistry::lookupTarget(triple, err)) {
+    std::unique_ptr<TargetMachine> tm(
+        t->createTargetMachine(triple, march().empty() ? "generic" : target_cpu(),
+                               "", {}, None));
+    get_module().setDataLayout(tm->createDataLayout());
+  }
+  get_module().setTargetTriple(triple);
+  ProfileSummaryInfo psi(get_module());
+  auto index = buildModuleSummaryIndex(get_module(), nullptr, &psi);
+
+  if (info())
+    printf("writing object to %s and interface to %s\n", of.c_str(),
+           iface.c_str());
+  std::error_code ec;
+  raw_fd_ostream os{of, ec};
+  if (ec)
+    reg_msg(LC_MSG{"object", "could not open output file for writing",
+                   MSG_FATAL});
+  WriteBitcodeToFile(get_module(), os, false, &index);
+  if (!write_interface(iface))
+    reg_msg(LC_MSG{"object", "could not write interface file " + iface,
+                   MSG_ERROR});
+}
+
+void emit_native() {
+  std::string of;
+  if ((of = outfile()) == "") {
+    of = "a.out";
+  }
+  build_native(of);
+}
+
+// The profile runtime cannot be hosted by lli, so instrumented programs are
+// built natively into a temporary executable and run from there.
+void run_native() {
+  char exe[1024];
+  sprintf(exe, "/tmp/lc-exe-%s", suuid().c_str());
+  build_native(exe);
+
+  pid_t pid;
+  pid = fork();
+
+  if (pid == 0) {
+    char *const argv[] = {exe, NULL};
+    execv(argv[0], argv);
+    std::exit(0);
+  }
+
+  while (wait(NULL) > 0)
+    ;
+  fs::remove(fs::path(exe));
+}
+
 void interpret()
 {
+  if (profile_generate()) {
+    run_native();
+    return;
+  }
+
   auto tmpfile = gen_llvm();
 
   pid_t pid;
@@ -170,7 +277,20 @@ void interpret()
   {
     auto lli = llvmroot() + "/bin/lli";
     auto ol = optlevel();
-    char *const argv[] = {lli.data(), tmpfile.data(), NULL};
+    auto rtlib = "-load=" + rtdir() + "/liblcrt.so";
+    auto cpu = "-mcpu=" + target_cpu();
+    std::vector<char *> argv = {lli.data()};
+    if (!march().empty())
+      argv.push_back(cpu.data());
+    if (needs_runtime() || !link_objects().empty())
+      argv.push_back(rtlib.data());
+    std::vector<std::string> extra;
+    for (auto &o : link_objects())
+      extra.push_back("-extra-module=" + o);
+    for (auto &e : extra)
+      argv.push_back(e.data());
+    argv.push_back(tmpfile.data());
+    argv.push_back(NULL);
     if (info()) {
       puts("exec'ing the following command:");
       int i = 0;
@@ -179,7 +299,7 @@ void interpret()
       }
       puts("");
     }
-    execv(argv[0], argv);
+    execv(argv[0], argv.data());
     std::exit(0);
   }
 
@@ -187,27 +307,10 @@ void interpret()
     ;
 }
 
-int main(int argc, char **argv) {
-  parse_opts(argc, argv);
-
-  atexit(err_printer);
-  atexit(parse_finalize);
-
-  FILE *fp = fopen(infile().c_str(), "r");
-  fp = preproc(fp);
-  if (dump("preproc")) {
-    puts("-- preproc dump:");
-    char c;
-    while ((c = getc(fp)) != EOF)
-      putc(c, stdout);
-    rewind(fp);
-  }
-
-  lex(fp);
-  fclose(fp);
-
-  if (any_errors())
-    std::exit(EXIT_FAILURE);
+// Lex, parse and sema one piece of source starting at byte offset base
+std::shared_ptr<MODULE> front_end(std::string_view src, size_t base) {
+  set_source(src, base);
+  lex(src, base);
 
   if (dump("tok")) {
     puts("-- parse tok:");
@@ -228,11 +331,98 @@ int main(int argc, char **argv) {
     puts("-- ast after subsitution");
     m->print(0);
   }
+  return m;
+}
+
+// 'lc -': compile each top-level form as soon as its closing paren is read,
+// so only the form in flight is held in memory
+void compile_stdin() {
+  if (!syntaxonly())
+    lower_begin();
+
+  std::string pending;
+  size_t base = 0;
+  FORMSCAN scan;
+  char buf[1 << 16];
+  auto consume = [&](size_t n) {
+    auto m = front_end(std::string_view(pending).substr(0, n), base);
+    if (!syntaxonly())
+      for (auto se : m->sexprs)
+        lower_form(se);
+    pending.erase(0, n);
+    base += n;
+    scan.pos -= n;
+  };
+
+  for (;;) {
+    ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
+    if (n < 0 and errno == EINTR)
+      continue;
+    if (n < 0)
+      reg_msg(LC_MSG{"driver", "error reading stdin", MSG_FATAL});
+    if (n == 0)
+      break;
+    pending.append(buf, n);
+    for (size_t end; (end = next_form_end(pending, scan)) != std::string::npos;)
+      consume(end);
+  }
+  // trailing comments, or an unclosed form to report
+  if (pending.find_first_not_of(" \t\r\n") != std::string::npos)
+    consume(pending.size());
 
-  if (syntaxonly())
-    goto cleanup;
+  if (!syntaxonly())
+    lower_end();
+}
 
-  lower(m);
+int main(int argc, char **argv) {
+  parse_opts(argc, argv);
+
+  atexit(err_printer);
+
+  if (infile() == "-") {
+    compile_stdin();
+    if (syntaxonly() or any_errors())
+      goto cleanup;
+  } else {
+    FILE *fp = fopen(infile().c_str(), "r");
+    if (!fp)
+      reg_msg(LC_MSG{"driver", "could not open input file " + infile(),
+                     MSG_FATAL});
+    std::string src;
+    char buf[1 << 16];
+    for (size_t n; (n = fread(buf, 1, sizeof(buf), fp)) > 0;)
+      src.append(buf, n);
+    fclose(fp);
+
+    std::shared_ptr<MODULE> m;
+    auto cache = infile() + ".lcast";
+    uint64_t hash = cache_ast() ? ast_hash(src) : 0;
+    if (cache_ast() and (m = ast_cache_load(cache, hash))) {
+      if (info())
+        printf("using cached AST from %s\n", cache.c_str());
+      set_source(src, 0);
+      if (dump("ast1")) {
+        puts("-- ast after subsitution");
+        m->print(0);
+      }
+    } else {
+      m = front_end(src, 0);
+      if (cache_ast() and !any_errors() and !ast_cache_store(cache, hash, m))
+        reg_msg(LC_MSG{"driver", "could not write AST cache " + cache,
+                       MSG_WARN});
+    }
+    if (syntaxonly())
+      goto cleanup;
+
+    // Forms that failed sema were dropped, so the rest can still be lowered
+    // to report their errors in the same run. Nothing is emitted past this
+    // point.
+    lower(m);
+    if (any_errors())
+      goto cleanup;
+  }
+  optimize();
+  cost_report();
 
   switch (target()) {
   case TARGET::LLVM:
@@ -247,6 +437,9 @@ int main(int argc, char **argv) {
   case TARGET::INTERPRET:
     interpret();
     break;
+  case TARGET::OBJECT:
+    emit_object();
+    break;
   }
 
 cleanup:
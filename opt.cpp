@@ -0,0 +1,320 @@
+#include "opt.h"
+#include "config.h"
+#include "cost.h"
+#include "lower.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Transforms/Instrumentation/InstrProfiling.h"
+#include "llvm/Transforms/Instrumentation/PGOInstrumentation.h"
+#include "llvm/Transforms/InstCombine/InstCombine.h"
+#include "llvm/Transforms/Scalar/ADCE.h"
+#include "llvm/Transforms/Scalar/SCCP.h"
+#include "llvm/Transforms/Scalar/SROA.h"
+#include "llvm/Transforms/Scalar/SimplifyCFG.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+
+// Give up after this many rounds so mutually recursive inline candidates
+// cannot grow the module without bound.
+static constexpr int max_inline_rounds = 4;
+
+// Size estimate for a callee: every instruction counts once, and the call
+// sequence we remove (the call itself plus one operand per argument) is
+// credited back.
+static int inline_cost(Function &callee) {
+  int cost = 0;
+  for (auto &bb : callee)
+    cost += bb.size();
+  return cost - 1 - (int)callee.arg_size();
+}
+
+static bool should_inline(CallBase &cb) {
+  Function *callee = cb.getCalledFunction();
+  if (!callee || callee->isDeclaration() || callee->isVarArg())
+    return false;
+  if (callee == cb.getFunction())
+    return false;
+  if (callee->hasFnAttribute(Attribute::NoInline))
+    return false;
+  if (callee->hasFnAttribute(Attribute::AlwaysInline))
+    return true;
+  return inlining() && inline_cost(*callee) <= inline_threshold();
+}
+
+static void inline_calls() {
+  for (int round = 0; round < max_inline_rounds; round++) {
+    std::vector<CallBase *> calls;
+    for (auto &f : get_module())
+      for (auto &bb : f)
+        for (auto &i : bb)
+          if (auto *cb = dyn_cast<CallBase>(&i))
+            if (should_inline(*cb))
+              calls.push_back(cb);
+
+    if (calls.empty())
+      return;
+
+    for (auto *cb : calls) {
+      if (dump("inline"))
+        printf("inlining %s into %s (cost %d)\n",
+               cb->getCalledFunction()->getName().str().c_str(),
+               cb->getFunction()->getName().str().c_str(),
+               inline_cost(*cb->getCalledFunction()));
+      Function *caller = cb->getFunction();
+      double t0 = cost_clock();
+      InlineFunctionInfo ifi;
+      InlineFunction(*cb, ifi);
+      cost_optimized(caller, cost_clock() - t0);
+    }
+  }
+}
+
+// Internal functions whose every call site was inlined are dead.
+static void drop_dead_functions() {
+  std::vector<Function *> dead;
+  for (auto &f : get_module())
+    if (f.hasLocalLinkage() && f.use_empty())
+      dead.push_back(&f);
+  for (auto *f : dead)
+    f->eraseFromParent();
+}
+
+// Analysis managers with everything registered, for running one pipeline
+struct ANALYSES {
+  LoopAnalysisManager lam;
+  FunctionAnalysisManager fam;
+  CGSCCAnalysisManager cgam;
+  ModuleAnalysisManager mam;
+  PassBuilder pb;
+  ANALYSES(TargetMachine *tm = nullptr)
+      : pb(tm, PipelineTuningOptions(), None, cost_callbacks()) {
+    pb.registerModuleAnalyses(mam);
+    pb.registerCGSCCAnalyses(cgam);
+    pb.registerFunctionAnalyses(fam);
+    pb.registerLoopAnalyses(lam);
+    pb.crossRegisterProxies(lam, fam, cgam, mam);
+  }
+};
+
+static void run_passes(ModulePassManager &mpm) {
+  ANALYSES a;
+  mpm.run(get_module(), a.mam);
+}
+
+static void run_passes(Function &f, FunctionPassManager &fpm) {
+  ANALYSES a;
+  fpm.run(f, a.fam);
+}
+
+// IR-level PGO. Instrumentation is inserted and lowered to counter updates
+// here; the profile runtime that writes them out is linked in by clang.
+// Profile data is read back in before any of our own transformations, so the
+// module handed on carries branch weights and function entry counts.
+static void run_pgo() {
+  ModulePassManager mpm;
+  if (profile_generate()) {
+    InstrProfOptions o;
+    o.InstrProfileOutput = profile_file();
+    mpm.addPass(PGOInstrumentationGen());
+    mpm.addPass(InstrProfiling(o));
+  } else if (profile_use().size()) {
+    mpm.addPass(PGOInstrumentationUse(profile_use()));
+  } else {
+    return;
+  }
+  run_passes(mpm);
+}
+
+static int size_of(Function &f) {
+  int n = 0;
+  for (auto &bb : f)
+    n += bb.size();
+  return n;
+}
+
+// Propagate the constants substituted into a clone and clean up after it
+static void fold(Function &f) {
+  FunctionPassManager fpm;
+  fpm.addPass(SCCPPass());
+  fpm.addPass(InstCombinePass());
+  fpm.addPass(SimplifyCFGPass());
+  fpm.addPass(ADCEPass());
+  run_passes(f, fpm);
+}
+
+static std::string describe(Function &callee, std::vector<Constant *> &consts) {
+  std::string s = callee.getName().str() + "(";
+  for (size_t i = 0; i < consts.size(); i++) {
+    if (i)
+      s += ", ";
+    if (auto *c = dyn_cast_or_null<ConstantFP>(consts[i]))
+      s += std::to_string(c->getValueAPF().convertToDouble());
+    else
+      s += "_";
+  }
+  return s + ")";
+}
+
+// The function each specialized clone was made from
+static std::map<Function *, Function *> origins;
+
+// f is callee, or a clone made from it, directly or through other clones
+static bool cloned_from(Function *f, Function *callee) {
+  for (; f; f = origins.count(f) ? origins[f] : nullptr)
+    if (f == callee)
+      return true;
+  return false;
+}
+
+// Calls in f passing at least one literal to a defined function. Recursive
+// calls are left alone: in a clone they still name the function it was made
+// from, and specializing them would unroll the recursion.
+static void specialize_candidates(Function &f, std::vector<CallBase *> &calls) {
+  for (auto &bb : f)
+    for (auto &i : bb)
+      if (auto *cb = dyn_cast<CallBase>(&i)) {
+        Function *callee = cb->getCalledFunction();
+        if (!callee || callee->isDeclaration() || callee->isVarArg() ||
+            cloned_from(&f, callee))
+          continue;
+        if (any_of(cb->args(), [](Use &a) { return isa<ConstantFP>(a); }))
+          calls.push_back(cb);
+      }
+}
+
+// Clones by the function and constants they were made for; nullptr when the
+// clone was not worth keeping
+using CLONES =
+    std::map<std::pair<Function *, std::vector<Constant *>>, Function *>;
+
+static void specialize_calls(Function &f, CLONES &clones, int &budget);
+
+/**
+ * Clone callee with consts substituted, or return nullptr if the clone is not
+ * worth keeping. The clone's own calls are specialized first, so a constant
+ * passed through a wrapper reaches the helper it forwards to; a clone that
+ * comes out no smaller is still kept when it calls such a specialized helper.
+ */
+static Function *specialize_clone(Function *callee,
+                                  std::vector<Constant *> &consts,
+                                  CLONES &clones, int &budget) {
+  // Arguments in the map are dropped from the clone's signature
+  ValueToValueMapTy vmap;
+  for (size_t i = 0; i < consts.size(); i++)
+    if (consts[i])
+      vmap[callee->getArg(i)] = consts[i];
+  Function *spec = CloneFunction(callee, vmap);
+  spec->setLinkage(GlobalValue::InternalLinkage);
+  spec->setName(callee->getName() + ".spec");
+  origins[spec] = callee;
+  fold(*spec);
+  specialize_calls(*spec, clones, budget);
+  fold(*spec);
+
+  bool forwards = false;
+  for (auto &bb : *spec)
+    for (auto &i : bb)
+      if (auto *cb = dyn_cast<CallBase>(&i))
+        forwards |= origins.count(cb->getCalledFunction()) > 0;
+
+  int before = size_of(*callee), after = size_of(*spec);
+  bool keep = after < before || (after == before && forwards);
+  if (dump("specialize"))
+    printf("%s %s as %s: %d -> %d instructions%s\n",
+           keep ? "specializing" : "not worth specializing",
+           describe(*callee, consts).c_str(), spec->getName().str().c_str(),
+           before, after, forwards ? ", calls a specialized clone" : "");
+  if (keep)
+    return spec;
+  origins.erase(spec);
+  spec->eraseFromParent();
+  return nullptr;
+}
+
+// Point calls in f passing literals at clones specialized for them. Call
+// sites with the same constants share a clone.
+static void specialize_calls(Function &f, CLONES &clones, int &budget) {
+  std::vector<CallBase *> calls;
+  specialize_candidates(f, calls);
+  for (auto *cb : calls) {
+    Function *callee = cb->getCalledFunction();
+    std::vector<Constant *> consts;
+    for (auto &a : cb->args())
+      consts.push_back(dyn_cast<ConstantFP>(a));
+
+    auto [it, fresh] = clones.try_emplace({callee, consts}, nullptr);
+    if (fresh) {
+      if (budget == 0) {
+        if (dump("specialize"))
+          printf("budget exhausted, not specializing %s\n",
+                 describe(*callee, consts).c_str());
+        continue;
+      }
+      budget--;
+      it->second = specialize_clone(callee, consts, clones, budget);
+    }
+    if (!it->second)
+      continue;
+
+    std::vector<Value *> args;
+    for (size_t i = 0; i < consts.size(); i++)
+      if (!consts[i])
+        args.push_back(cb->getArgOperand(i));
+    auto *call = CallInst::Create(it->second, args, "", cb);
+    call->takeName(cb);
+    call->setDebugLoc(cb->getDebugLoc());
+    cb->replaceAllUsesWith(call);
+    cb->eraseFromParent();
+  }
+}
+
+/**
+ * Call-site specialization: a call passing literals to a defun gets a clone of
+ * the defun with the literals substituted and folded. Calls in new clones are
+ * candidates too, so constants propagate down through chains of helpers.
+ * Clones that do not pay off are thrown away, and at most specialize_budget()
+ * are attempted.
+ */
+static void specialize() {
+  int budget = specialize_budget();
+  if (budget <= 0)
+    return;
+
+  origins.clear();
+  CLONES clones;
+  std::vector<Function *> fs;
+  for (auto &f : get_module())
+    fs.push_back(&f);
+  for (auto *f : fs)
+    specialize_calls(*f, clones, budget);
+}
+
+// let variables and assigned arguments are lowered to stack slots; turn them
+// into SSA values before anything else looks at the module, whatever the
+// optimization level.
+static void promote_locals() {
+  ModulePassManager mpm;
+  mpm.addPass(createModuleToFunctionPassAdaptor(SROAPass()));
+  run_passes(mpm);
+}
+
+void run_default_pipeline(Module &m, TargetMachine *tm) {
+  static const std::map<std::string, OptimizationLevel> levels = {
+      {"-O0", OptimizationLevel::O0}, {"-O1", OptimizationLevel::O1},
+      {"-O2", OptimizationLevel::O2}, {"-O3", OptimizationLevel::O3},
+      {"-Os", OptimizationLevel::Os}, {"-Oz", OptimizationLevel::Oz}};
+  auto it = levels.find(optlevel());
+  auto level = it == levels.end() ? OptimizationLevel::O2 : it->second;
+
+  ANALYSES a(tm);
+  ModulePassManager mpm = level == OptimizationLevel::O0
+                              ? a.pb.buildO0DefaultPipeline(level)
+                              : a.pb.buildPerModuleDefaultPipeline(level);
+  mpm.run(m, a.mam);
+}
+
+void optimize() {
+  promote_locals();
+  run_pgo();
+  specialize();
+  inline_calls();
+  drop_dead_functions();
+}
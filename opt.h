@@ -0,0 +1,18 @@
+#pragma once
+#include "ll.h"
+
+namespace llvm {
+class TargetMachine;
+}
+
+/**
+ * Run lc's own IR-level transformations over the lowered module. These run
+ * regardless of the optimization level handed to the downstream toolchain.
+ */
+void optimize();
+
+/**
+ * Run the pipeline clang applies at optlevel() over m, so its result can be
+ * looked at in-process. tm may be null.
+ */
+void run_default_pipeline(Module &m, TargetMachine *tm);
@@ -1,5 +1,15 @@
+#include <array>
+#include <charconv>
+#include <cstdint>
 #include <cstdlib>
 #include <cstring>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#define LC_LEX_SIMD
+#if defined(__x86_64__) || defined(__i386__)
+#define LC_LEX_AVX2
+#endif
+#endif
 #include "parse.h"
 #include "opc.h"
 #include "err.h"
@@ -7,61 +17,57 @@
 #include "dbg.h"
 #include "config.h"
 
-static unsigned preproc_providence[MAXFILESZ];
+static TOKSTREAM toks;
 
-static TOKEN tok_table[TOKSZ];
-static int   tok_it  = 1;
-static int   tok_max = 1;
-static int   cur_tok = 1;
-static int   tok_cur()
+void TOKSTREAM::push(TOK t, uint32_t off, uint32_t pl)
 {
-  return cur_tok;
+  kind.push_back(t);
+  offset.push_back(off);
+  payload.push_back(pl);
 }
-static int tok_next_pre()
+
+uint32_t TOKSTREAM::intern(std::string_view s)
 {
-  if(cur_tok < tok_it)
-    return ++cur_tok;
-  return -1;
+  auto it = interned.find(s);
+  if(it != interned.end())
+    return it->second;
+  // deque never moves its elements, so the key can view the pooled string
+  strs.emplace_back(s);
+  return interned[strs.back()] = strs.size() - 1;
 }
-static int tok_next()
+
+uint32_t TOKSTREAM::literal(double v)
 {
-  if(cur_tok < tok_it)
-    return cur_tok++;
-  return -1;
+  nums.push_back(v);
+  return nums.size() - 1;
 }
-static int tok_unget()
+
+void TOKSTREAM::clear()
 {
-  if(cur_tok > 1)
-    return --cur_tok;
-  return -1;
+  kind.clear();
+  offset.clear();
+  payload.clear();
+  interned.clear();
+  strs.clear();
+  nums.clear();
 }
-static int tok_peek()
+
+const TOKSTREAM& tokens()
 {
-  if(tok_it < cur_tok)
-    return cur_tok + 1;
-  return -1;
+  return toks;
 }
-#define TOK_PUSH(T)                                                            \
-  {                                                                            \
-    if(tok_it + 1 > TOKSZ)                                                     \
-      reg_msg(LC_MSG{"tokenize", "exceeded max token table size", MSG_FATAL}); \
-    tok_table[tok_it++] = T;                                                   \
-    tok_max             = tok_max > tok_it ? tok_max : tok_it;                 \
-  }
-#define TOK_ITER(X) for(int X = 1; X < tok_it; X++)
-#define TOKI(I)     tok_table[I]
 
-TOKEN* tok(int i)
+TOKCURSOR tok_cursor()
 {
-  return &TOKI(i);
+  return TOKCURSOR{&toks};
 }
 
-static void dump_tok_i(int toki, const char* msg = nullptr)
+static void dump_tok_i(TOKCURSOR c, const char* msg = nullptr)
 {
   if(msg != nullptr)
     printf("%s:", msg);
 
-  switch(TOKI(toki).t)
+  switch(c.kind())
   {
 #define TOK_PROC(T) \
   case T:           \
@@ -72,54 +78,23 @@ static void dump_tok_i(int toki, const char* msg = nullptr)
   default:
     printf("t:?unknown token?");
   }
-  switch(TOKI(toki).t)
+  switch(c.kind())
   {
   case TOK_NUMLIT:
-    printf(":%d", TOKI(toki).val.i_val);
+    printf(":%g", c.num());
     break;
   case TOK_STRLIT:
-    printf(":%s", TOKI(toki).val.s_val);
-    break;
   case TOK_ID:
-    printf(":%s", TOKI(toki).val.s_val);
-    break;
-  case TOK_BINOP:
-    printf(":%c", TOKI(toki).val.bin);
+    printf(":%s", c.str().c_str());
     break;
   }
-  printf("\t\t(offset=%d)", TOKI(toki).offset);
+  printf("\t\t(offset=%u)", c.offset());
   puts("");
 }
 
-std::shared_ptr<EXPR> parse_expr()
+static void eat(TOKCURSOR& c, TOK t)
 {
-  static int toki = 1;
-  while(true)
-  {
-    TOKEN t = TOKI(toki);
-  tryagain:
-    switch(t.t)
-    {
-    case TOK_EOF:
-    case TOK_EOL:
-    case TOK_LPAREN:
-      reg_msg(LC_MSG{"parse", "sub-sexprs not yet supported", MSG_FATAL});
-      break;
-    case TOK_NUMLIT:
-      return std::make_shared<NUM>(t.val.i_val);
-    case TOK_STRLIT:
-      return std::make_shared<STR>(std::string(t.val.s_val));
-    case TOK_ID:
-      return std::make_shared<ID>(std::string(t.val.s_val));
-    }
-    toki++;
-  }
-}
-
-static void eat(TOK t)
-{
-  int ti = tok_next();
-  if(TOKI(ti).t != t)
+  if(c.kind() != t)
   {
     std::string ts = "eat:expected token ";
     switch(t)
@@ -132,7 +107,7 @@ static void eat(TOK t)
 #undef TOK_PROC
     }
     ts += ", got token ";
-    switch(TOKI(ti).t)
+    switch(c.kind())
     {
 #define TOK_PROC(T) \
   case T:           \
@@ -141,21 +116,24 @@ static void eat(TOK t)
 #include "parse.def"
 #undef TOK_PROC
     }
-    reg_msg(LC_MSG{"parse", ts, MSG_FATAL, TOKI(ti).offset});
+    reg_msg(LC_MSG{"parse", ts, MSG_ERROR, (int)c.offset()});
   }
+  c.next();
 }
 
-std::shared_ptr<SEXPR> parse_sexpr()
+static std::shared_ptr<SEXPR> parse_sexpr(TOKCURSOR& c)
 {
   if(dump("parse-sexpr"))
     puts("start sexpr parse");
-  eat(TOK_LPAREN);
-  int  ti = tok_next(), ei = -1;
-  TOK  tt;
-  auto se = std::make_shared<SEXPR>(TOKI(ti).offset);
+  auto se = std::make_shared<SEXPR>(c.offset());
+  eat(c, TOK_LPAREN);
 
-  while((tt = TOKI(ti).t) != TOK_RPAREN)
+  for(TOK tt; (tt = c.kind()) != TOK_RPAREN;)
   {
+    // unbalanced parens are diagnosed by lex_sema; leave EOF for the
+    // top-level parser to see
+    if(tt == TOK_EOF)
+      return se;
     if(dump("parse-sexpr"))
       switch(tt)
       {
@@ -168,180 +146,372 @@ std::shared_ptr<SEXPR> parse_sexpr()
       }
     if(tt == TOK_LPAREN)
     {
-      tok_unget();
-      se->exprs.push_back(parse_sexpr());
+      se->exprs.push_back(parse_sexpr(c));
+      continue;
     }
     else if(tt == TOK_ID)
-      se->exprs.push_back(std::make_shared<ID>(std::string(TOKI(ti).val.s_val)));
+      se->exprs.push_back(std::make_shared<ID>(c.str(), c.offset()));
     else if(tt == TOK_STRLIT)
-      se->exprs.push_back(std::make_shared<STR>(std::string(TOKI(ti).val.s_val)));
+      se->exprs.push_back(std::make_shared<STR>(c.str(), c.offset()));
     else if(tt == TOK_NUMLIT)
-      se->exprs.push_back(std::make_shared<NUM>(TOKI(ti).val.i_val));
-    ti = tok_next();
+      se->exprs.push_back(std::make_shared<NUM>(c.num(), c.offset()));
+    c.next();
   }
+  c.next();
   if(dump("parse-sexpr"))
     puts("end sexpr parse");
-  return std::move(se);
+  return se;
 }
 
 std::shared_ptr<MODULE> parse()
 {
   auto m = std::make_shared<MODULE>();
 
-  for(int ti = tok_cur(); TOKI(tok_cur()).t != TOK_EOF; ti = tok_cur())
+  for(auto c = tok_cursor(); !c.at_end();)
   {
-    if(TOKI(ti).t == TOK_LPAREN)
+    if(c.kind() == TOK_LPAREN)
     {
-      m->sexprs.push_back(parse_sexpr());
+      m->sexprs.push_back(parse_sexpr(c));
     }
-    else if(TOKI(ti).t == TOK_EOL)
+    else if(c.kind() == TOK_EOL)
     {
-      eat(TOK_EOL);
+      eat(c, TOK_EOL);
     }
     else
     {
-      reg_msg(LC_MSG{"parse", "unexpected token at top-level parser", MSG_FATAL});
+      // stray ')' was already reported by lex_sema
+      if(c.kind() != TOK_RPAREN)
+        reg_msg(LC_MSG{"parse", "unexpected token at top-level parser", MSG_ERROR,
+                       (int)c.offset()});
+      c.next();
     }
   }
 
-  return std::move(m);
+  return m;
+}
+
+/*------------------------------------------------------------------------------
+ * Character classification
+ *
+ * The lexer works on the whole source buffer. The hot loops -- finding the end
+ * of an atom and skipping runs of blanks -- classify 16 (SSE2) or 32 (AVX2)
+ * bytes per iteration, with AVX2 picked at startup when the CPU has it; the
+ * scalar loops below them handle the tail and hosts without SIMD. Comments
+ * and string bodies only need the next '\n' or '"', which memchr already
+ * finds a word or vector at a time.
+ *----------------------------------------------------------------------------*/
+enum CHARCLS : uint8_t
+{
+  CC_ATOM = 0,
+  CC_BLANK,
+  CC_EOL,
+  CC_LPAREN,
+  CC_RPAREN,
+  CC_QUOTE,
+  CC_SEMI,
+};
+
+static constexpr std::array<uint8_t, 256> charcls = []
+{
+  std::array<uint8_t, 256> c{};
+  c[' ']  = CC_BLANK;
+  c['\t'] = CC_BLANK;
+  c['\r'] = CC_BLANK;
+  c['\n'] = CC_EOL;
+  c['(']  = CC_LPAREN;
+  c[')']  = CC_RPAREN;
+  c['"']  = CC_QUOTE;
+  c[';']  = CC_SEMI;
+  return c;
+}();
+
+#ifdef LC_LEX_SIMD
+static inline unsigned delim_mask(const char* p)
+{
+  __m128i v = _mm_loadu_si128((const __m128i*)p);
+  __m128i m = _mm_or_si128(
+    _mm_or_si128(
+      _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))),
+      _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\r')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\n')))),
+    _mm_or_si128(
+      _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('(')), _mm_cmpeq_epi8(v, _mm_set1_epi8(')'))),
+      _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')), _mm_cmpeq_epi8(v, _mm_set1_epi8(';')))));
+  return (unsigned)_mm_movemask_epi8(m);
+}
+static inline unsigned blank_mask(const char* p)
+{
+  __m128i v = _mm_loadu_si128((const __m128i*)p);
+  __m128i m = _mm_or_si128(
+    _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))),
+    _mm_cmpeq_epi8(v, _mm_set1_epi8('\r')));
+  return (unsigned)_mm_movemask_epi8(m);
+}
+
+// The vector loops stop at the first byte of interest, or where fewer than a
+// vector's worth of bytes is left; the scalar loops after them finish up.
+static const char* scan_atom_sse2(const char* p, const char* end)
+{
+  for(; end - p >= 16; p += 16)
+    if(unsigned m = delim_mask(p))
+      return p + __builtin_ctz(m);
+  return p;
+}
+static const char* skip_blank_sse2(const char* p, const char* end)
+{
+  for(; end - p >= 16; p += 16)
+    if(unsigned m = blank_mask(p) ^ 0xffffu)
+      return p + __builtin_ctz(m);
+  return p;
 }
+#endif
 
-int lex(FILE* istream)
+#ifdef LC_LEX_AVX2
+// Built for AVX2 whatever the compiler flags, and only called when the CPU
+// running lc has it
+__attribute__((target("avx2"))) static inline unsigned delim_mask_avx2(const char* p)
+{
+  __m256i v = _mm256_loadu_si256((const __m256i*)p);
+  __m256i m = _mm256_or_si256(
+    _mm256_or_si256(
+      _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t'))),
+      _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')))),
+    _mm256_or_si256(
+      _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('(')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8(')'))),
+      _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8(';')))));
+  return (unsigned)_mm256_movemask_epi8(m);
+}
+__attribute__((target("avx2"))) static inline unsigned blank_mask_avx2(const char* p)
+{
+  __m256i v = _mm256_loadu_si256((const __m256i*)p);
+  __m256i m = _mm256_or_si256(
+    _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t'))),
+    _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r')));
+  return (unsigned)_mm256_movemask_epi8(m);
+}
+__attribute__((target("avx2"))) static const char* scan_atom_avx2(const char* p, const char* end)
+{
+  for(; end - p >= 32; p += 32)
+    if(unsigned m = delim_mask_avx2(p))
+      return p + __builtin_ctz(m);
+  return p;
+}
+__attribute__((target("avx2"))) static const char* skip_blank_avx2(const char* p, const char* end)
 {
-#define DIE()                                                       \
-  do                                                                \
-  {                                                                 \
-    printf("unrecognized token at position %d, char=%c\n", pos, c); \
-    std::abort();                                                   \
-  } while(0);
-  char  c;
-  int   it;
-  char  s[1024];
-  int   num;
-  TOKEN t;
-  int   pos = 0;
-  while((c = getc(istream)) != EOF)
+  for(; end - p >= 32; p += 32)
+    if(unsigned m = blank_mask_avx2(p) ^ 0xffffffffu)
+      return p + __builtin_ctz(m);
+  return p;
+}
+
+static const bool lex_avx2 = []
+{
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2") != 0;
+}();
+#endif
+
+/**
+ * Returns the first byte at or after p that ends an atom: a blank, newline,
+ * paren, quote or comment start.
+ */
+static const char* scan_atom(const char* p, const char* end)
+{
+#ifdef LC_LEX_AVX2
+  if(lex_avx2)
+    p = scan_atom_avx2(p, end);
+  else
+#endif
+#ifdef LC_LEX_SIMD
+    p = scan_atom_sse2(p, end);
+#endif
+  while(p < end and charcls[(uint8_t)*p] == CC_ATOM)
+    p++;
+  return p;
+}
+
+/**
+ * Returns the first byte at or after p that is not a blank. Newlines are
+ * tokens, so they are not skipped.
+ */
+static const char* skip_blank(const char* p, const char* end)
+{
+  // most runs are a single space between atoms
+  if(p < end and charcls[(uint8_t)*p] != CC_BLANK)
+    return p;
+#ifdef LC_LEX_AVX2
+  if(lex_avx2)
+    p = skip_blank_avx2(p, end);
+  else
+#endif
+#ifdef LC_LEX_SIMD
+    p = skip_blank_sse2(p, end);
+#endif
+  while(p < end and charcls[(uint8_t)*p] == CC_BLANK)
+    p++;
+  return p;
+}
+
+/**
+ * An atom is a number when the whole atom parses as one: "12", "-3", "0.5",
+ * "1e9". Anything else, including a lone "-", is an identifier.
+ */
+static bool lex_number(const char* p, const char* end, double& v)
+{
+  const char* d = p + (*p == '-' or *p == '+');
+  if(d < end and *d == '.')
+    d++;
+  if(d == end or !isdigit((unsigned char)*d))
+    return false;
+  // from_chars does not accept a leading '+'
+  auto [ptr, ec] = std::from_chars(p + (*p == '+'), end, v);
+  return ec == std::errc() and ptr == end;
+}
+
+int lex(std::string_view src, uint32_t base)
+{
+  const char* const begin = src.data();
+  const char* const end   = begin + src.size();
+  const char*       p     = begin;
+  uint32_t          off;
+  double            num;
+
+  toks.clear();
+  // a token per ~4 bytes is typical; avoids regrowing the arrays while lexing
+  toks.kind.reserve(src.size() / 4);
+  toks.offset.reserve(src.size() / 4);
+  toks.payload.reserve(src.size() / 4);
+  while((p = skip_blank(p, end)) < end)
   {
-    t.offset = preproc_providence[ftell(istream)];
-    switch(c)
+    off = base + (p - begin);
+    switch(charcls[(uint8_t)*p])
     {
-
-    case '(':
-      t.t = TOK_LPAREN;
+    case CC_LPAREN:
+      toks.push(TOK_LPAREN, off);
+      p++;
+      break;
+    case CC_RPAREN:
+      toks.push(TOK_RPAREN, off);
+      p++;
       break;
-    case ')':
-      t.t = TOK_RPAREN;
+    case CC_EOL:
+      toks.push(TOK_EOL, off);
+      p++;
       break;
 
     /*------------------------------------------------------------------------
      * Skipper
      *----------------------------------------------------------------------*/
-    case ' ':
-    case '\t':
-      continue;
-    case '\n':
-      t.t = TOK_EOL;
-      break;
-    case ';':
-      while((c = getc(istream)) != '\n')
-        ;
+    case CC_SEMI:
+      if(auto* nl = (const char*)memchr(p, '\n', end - p))
+        p = nl;
+      else
+        p = end;
       continue;
 
     /*------------------------------------------------------------------------
      * Literal Parsing
      *----------------------------------------------------------------------*/
-    case '0':
-    case '1':
-    case '2':
-    case '3':
-    case '4':
-    case '5':
-    case '6':
-    case '7':
-    case '8':
-    case '9':
-      ungetc(c, istream);
-      fscanf(istream, "%d", &num);
-      t.t         = TOK_NUMLIT;
-      t.val.i_val = num;
-      break;
-
-    case '"':
-      memset(s, 0, sizeof(s));
-      it = 0;
-      while((c = getc(istream)) != '"')
+    case CC_QUOTE:
+    {
+      auto* q = (const char*)memchr(p + 1, '"', end - p - 1);
+      if(!q)
       {
-        s[it++] = c;
+        reg_msg(LC_MSG{"lex", "unterminated string literal", MSG_ERROR, (int)off});
+        p = end;
+        continue;
       }
-      t.t         = TOK_STRLIT;
-      t.val.s_val = strdup(s);
+      toks.push(TOK_STRLIT, off, toks.intern(std::string_view(p + 1, q - p - 1)));
+      p = q + 1;
       break;
+    }
 
     /*------------------------------------------------------------------------
-     * ID Parsing
+     * Numbers and IDs
      *----------------------------------------------------------------------*/
     default:
-      ungetc(c, istream);
-      if(fscanf(istream, "%s", s) != EOF)
-      {
-        if(debug("lex"))
-          printf("str=%s\n", s);
-        t.t         = TOK_ID;
-        t.val.s_val = strdup(s);
-      }
+    {
+      const char* q = scan_atom(p, end);
+      if(lex_number(p, q, num))
+        toks.push(TOK_NUMLIT, off, toks.literal(num));
       else
       {
-        reg_msg(LC_MSG{"lex", "unrecognized token", MSG_ERROR, t.offset});
-        continue;
+        toks.push(TOK_ID, off, toks.intern(std::string_view(p, q - p)));
+        if(debug("lex"))
+          printf("str=%.*s\n", (int)(q - p), p);
       }
+      p = q;
       break;
     }
-    TOK_PUSH(t);
-    pos++;
+    }
   }
 
-  t.t = TOK_EOF;
-  TOK_PUSH(t);
+  int pos = toks.size();
+  toks.push(TOK_EOF, base + src.size());
 
   if(dump("lex"))
   {
     puts("-- lex dump:");
-    TOK_ITER(i)
-    dump_tok_i(i);
+    for(auto c = tok_cursor(); !c.at_end(); c.next())
+      dump_tok_i(c);
   }
 
   return pos;
 }
 
-void parse_finalize()
+/**
+ * Scans buf from st.pos and returns the index one past the ')' that closes the
+ * next top-level form, or npos if the form is not complete yet. Scanning
+ * resumes from st on the next call once more input has been appended.
+ */
+size_t next_form_end(std::string_view buf, FORMSCAN& st)
 {
-  for(int i = 1; i < tok_max; i++)
+  while(st.pos < buf.size())
   {
-    switch(TOKI(i).t)
+    const char* p = buf.data() + st.pos;
+    if(st.comment or st.str)
     {
-    case TOK_ID:
-    case TOK_STRLIT:
-      if(debug("parse"))
-        printf("deallocating id token %d\n", i);
-      free(TOKI(i).val.s_val);
+      auto* q = (const char*)memchr(p, st.comment ? '\n' : '"', buf.size() - st.pos);
+      if(!q)
+      {
+        st.pos = buf.size();
+        break;
+      }
+      st.pos     = q - buf.data() + 1;
+      st.comment = st.str = false;
+      continue;
+    }
+    st.pos++;
+    switch(charcls[(uint8_t)*p])
+    {
+    case CC_SEMI:
+      st.comment = true;
+      break;
+    case CC_QUOTE:
+      st.str = true;
+      break;
+    case CC_LPAREN:
+      st.depth++;
+      break;
+    case CC_RPAREN:
+      // a stray ')' ends its own chunk and is reported by lex_sema
+      if(st.depth == 0 or --st.depth == 0)
+        return st.pos;
+      break;
     }
   }
+  return std::string_view::npos;
 }
 
 void dump_tok()
 {
-  int   indent = 0;
-  TOKEN t;
-  int   indent_i;
+  int indent = 0;
 #define INDENT()                                       \
   for(int indent_i = 0; indent_i < indent; indent_i++) \
     printf("  ");
 
-  for(int i = 1; i < tok_max; i++)
+  for(auto c = tok_cursor(); !c.at_end(); c.next())
   {
-    t = tok_table[i];
-    switch(t.t)
+    switch(c.kind())
     {
     case TOK_LPAREN:
       INDENT();
@@ -355,26 +525,25 @@ void dump_tok()
       break;
     case TOK_ID:
       INDENT();
-      printf("id:%s", tok_table[i].val.s_val);
+      printf("id:%s", c.str().c_str());
       break;
     case TOK_STRLIT:
       INDENT();
-      printf("str:%s", tok_table[i].val.s_val);
+      printf("str:%s", c.str().c_str());
       break;
     case TOK_NUMLIT:
       INDENT();
-      printf("num:%d", tok_table[i].val.i_val);
+      printf("num:%g", c.num());
       break;
     case TOK_DEFVAR:
       INDENT();
       printf("defvar");
       break;
-    case TOK_EOF:
     case TOK_EOL:
       continue;
     case TOK_BINOP:
       INDENT();
-      printf("binop:%c", TOKI(i).val.bin);
+      printf("binop");
       break;
     default:
       INDENT();
@@ -384,48 +553,3 @@ void dump_tok()
   }
 #undef INDENT
 }
-
-void tok_iter(void (*visitor)(TOKEN*))
-{
-  TOK_ITER(i)
-  {
-    (*visitor)(&TOKI(i));
-  }
-}
-
-/*
- * Owns: istream
- * Nonowner of return fp
- */
-FILE* preproc(FILE* istream)
-{
-  char  c;
-  FILE* iostream = tmpfile();
-
-  // maps offsets in the source file to offsets in the preprocesses source file
-  int srci = 0, proci = 0;
-  if(iostream == NULL)
-  {
-    printf("couldnt open temp file\n");
-    std::abort();
-  }
-  while((c = getc(istream)) != EOF)
-  {
-    if(c == '(' || c == ')')
-    {
-      preproc_providence[proci++] = srci;
-      fputc(' ', iostream);
-    }
-    preproc_providence[proci++] = srci++;
-    fputc(c, iostream);
-    if(c == '(' || c == ')')
-    {
-      preproc_providence[proci++] = srci;
-      fputc(' ', iostream);
-    }
-  }
-  fclose(istream);
-
-  rewind(iostream);
-  return iostream;
-}
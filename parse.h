@@ -1,6 +1,11 @@
 #pragma once
+#include <cstdint>
 #include <cstdio>
+#include <deque>
+#include <map>
 #include <memory>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
 #include "opc.h"
 #include "err.h"
@@ -43,8 +48,8 @@ struct ID : public EXPR
 
 struct NUM : public EXPR
 {
-  int v;
-  NUM(int v, int offset = -1)
+  double v;
+  NUM(double v, int offset = -1)
       : v(v)
       , EXPR(offset)
   {
@@ -52,7 +57,7 @@ struct NUM : public EXPR
   void print(int indent = 0) const override
   {
     INDENT(indent);
-    printf("%d\n", v);
+    printf("%g\n", v);
   }
   Value* codegen() override;
 };
@@ -101,11 +106,294 @@ struct BIDEFVAR : public BIFUNC
   Value* codegen() override;
 };
 
-struct BISUM : public BIFUNC
+enum ARITHOP
 {
+#define ARITH_PROC(X, NAME, ALIAS, MINARGS) X,
+#include "arith.def"
+#undef ARITH_PROC
+};
+
+/**
+ * Arithmetic, of the form:
+ *
+ *  '(' { '+' | '-' | '*' | '/' | 'min' | 'max' } <expr>... ')'
+ *
+ * sum, sub, mul and div name the first four too. With no operands + is 0 and
+ * * is 1; a single operand is negated by - and inverted by /. Otherwise - and
+ * / take the rest of the operands off the first, as a sum or a product. The
+ * operands are combined as a balanced tree rather than one at a time, so the
+ * operations on independent pairs can run in parallel; this may round
+ * differently from strict left-to-right evaluation.
+ */
+struct BIARITH : public BIFUNC
+{
+  ARITHOP                            op;
+  std::vector<std::shared_ptr<EXPR>> args;
+  BIARITH(ARITHOP op, std::vector<std::shared_ptr<EXPR>> args, int offset = -1)
+      : op(op)
+      , args(args)
+      , BIFUNC(offset)
+  {
+  }
+  void print(int indent = 0) const override
+  {
+    INDENT(indent);
+    switch(op)
+    {
+#define ARITH_PROC(X, NAME, ALIAS, MINARGS) \
+  case X:                                   \
+    puts(NAME);                             \
+    break;
+#include "arith.def"
+#undef ARITH_PROC
+    }
+    for(auto a : args)
+      a->print(indent + 1);
+  }
+  Value* codegen() override;
+};
+
+/**
+ * Data-parallel loop, of the form:
+ *
+ *  '(' 'parallel-for' <id> <start expr> <end expr> <body expr>... ')'
+ *
+ * The body is outlined into its own function and run over [start, end) on
+ * the runtime's thread pool.
+ */
+struct BIPARFOR : public BIFUNC
+{
+  std::string                        var;
+  std::shared_ptr<EXPR>              start, end;
+  std::vector<std::shared_ptr<EXPR>> body;
+  BIPARFOR(std::string var, std::shared_ptr<EXPR> start, std::shared_ptr<EXPR> end,
+           std::vector<std::shared_ptr<EXPR>> body, int offset = -1)
+      : var(var)
+      , start(start)
+      , end(end)
+      , body(body)
+      , BIFUNC(offset)
+  {
+  }
+  void print(int indent = 0) const override
+  {
+    INDENT(indent);
+    printf("parallel-for %s\n", var.c_str());
+    start->print(indent + 1);
+    end->print(indent + 1);
+    for(auto b : body)
+      b->print(indent + 2);
+  }
+  Value* codegen() override;
+};
+
+/**
+ * Run an expression asynchronously on the runtime's thread pool:
+ *
+ *  '(' 'spawn' <expr> ')'
+ *
+ * Evaluates to a future handle to be passed to 'await' exactly once.
+ */
+struct BISPAWN : public BIFUNC
+{
+  std::shared_ptr<EXPR> e;
+  BISPAWN(std::shared_ptr<EXPR> e, int offset = -1)
+      : e(e)
+      , BIFUNC(offset)
+  {
+  }
+  void print(int indent = 0) const override
+  {
+    INDENT(indent);
+    puts("spawn");
+    e->print(indent + 1);
+  }
+  Value* codegen() override;
+};
+
+struct BIAWAIT : public BIFUNC
+{
+  std::shared_ptr<EXPR> h;
+  BIAWAIT(std::shared_ptr<EXPR> h, int offset = -1)
+      : h(h)
+      , BIFUNC(offset)
+  {
+  }
+  void print(int indent = 0) const override
+  {
+    INDENT(indent);
+    puts("await");
+    h->print(indent + 1);
+  }
+  Value* codegen() override;
+};
+
+/**
+ * Scope for allocations, of the form:
+ *
+ *  '(' 'with-region' <body expr>... ')'
+ *
+ * Everything allocated while the body runs is freed when it exits, so the
+ * value of the body must not refer to such allocations.
+ */
+struct BIREGION : public BIFUNC
+{
+  std::vector<std::shared_ptr<EXPR>> body;
+  BIREGION(std::vector<std::shared_ptr<EXPR>> body, int offset = -1)
+      : body(body)
+      , BIFUNC(offset)
+  {
+  }
+  void print(int indent = 0) const override
+  {
+    INDENT(indent);
+    puts("with-region");
+    for(auto b : body)
+      b->print(indent + 1);
+  }
+  Value* codegen() override;
+};
+
+/**
+ * Lexically scoped variables, of the form:
+ *
+ *  '(' 'let' '(' { '(' <id> <init expr> ')' }... ')' <body expr>... ')'
+ *
+ * Every init is evaluated before any of the names is bound. The variables
+ * live in stack slots that 'setq' may assign to, and are promoted to
+ * registers by the optimizer.
+ */
+struct BILET : public BIFUNC
+{
+  std::vector<std::string>           names;
+  std::vector<std::shared_ptr<EXPR>> inits;
+  std::vector<std::shared_ptr<EXPR>> body;
+  BILET(std::vector<std::string> names, std::vector<std::shared_ptr<EXPR>> inits,
+        std::vector<std::shared_ptr<EXPR>> body, int offset = -1)
+      : names(names)
+      , inits(inits)
+      , body(body)
+      , BIFUNC(offset)
+  {
+  }
+  void print(int indent = 0) const override
+  {
+    INDENT(indent);
+    puts("let");
+    for(int i = 0; i < names.size(); i++)
+    {
+      INDENT(indent + 1);
+      printf("%s =\n", names[i].c_str());
+      inits[i]->print(indent + 2);
+    }
+    for(auto b : body)
+      b->print(indent + 1);
+  }
+  Value* codegen() override;
+};
+
+/**
+ * Assignment to a let variable or a function argument:
+ *
+ *  '(' 'setq' <id> <expr> ')'
+ *
+ * Evaluates to the assigned value.
+ */
+struct BISETQ : public BIFUNC
+{
+  std::string           id;
+  std::shared_ptr<EXPR> v;
+  BISETQ(std::string id, std::shared_ptr<EXPR> v, int offset = -1)
+      : id(id)
+      , v(v)
+      , BIFUNC(offset)
+  {
+  }
+  void print(int indent = 0) const override
+  {
+    INDENT(indent);
+    printf("setq id=%s\n", id.c_str());
+    v->print(indent + 1);
+  }
+  Value* codegen() override;
+};
+
+/**
+ * Sequential counted loop, of the form:
+ *
+ *  '(' 'loop' <id> <count expr> <body expr>... ')'
+ *
+ * Runs the body with the id bound to 0, 1, ... up to but not including the
+ * count, which is evaluated once. Evaluates to 0.
+ */
+struct BILOOP : public BIFUNC
+{
+  std::string                        var;
+  std::shared_ptr<EXPR>              count;
+  std::vector<std::shared_ptr<EXPR>> body;
+  BILOOP(std::string var, std::shared_ptr<EXPR> count, std::vector<std::shared_ptr<EXPR>> body,
+         int offset = -1)
+      : var(var)
+      , count(count)
+      , body(body)
+      , BIFUNC(offset)
+  {
+  }
+  void print(int indent = 0) const override
+  {
+    INDENT(indent);
+    printf("loop %s\n", var.c_str());
+    count->print(indent + 1);
+    for(auto b : body)
+      b->print(indent + 2);
+  }
+  Value* codegen() override;
+};
+
+/**
+ * Evaluate an expression while compiling, of the form:
+ *
+ *  '(' 'comptime' <expr> ')'
+ *
+ * The result is baked into the output as a constant. An expression that is
+ * not pure is computed at run time instead, with a warning.
+ */
+struct BICOMPTIME : public BIFUNC
+{
+  std::shared_ptr<EXPR> e;
+  BICOMPTIME(std::shared_ptr<EXPR> e, int offset = -1)
+      : e(e)
+      , BIFUNC(offset)
+  {
+  }
+  void print(int indent = 0) const override
+  {
+    INDENT(indent);
+    puts("comptime");
+    e->print(indent + 1);
+  }
+  Value* codegen() override;
+};
+
+enum CMPOP
+{
+#define CMPOP_PROC(X, NAME, PRED) X,
+#include "cmpop.def"
+#undef CMPOP_PROC
+};
+
+/**
+ * Numeric comparison, one of '<' '<=' '=' '/=' '>' '>='. Evaluates to 1 when
+ * it holds and 0 otherwise; as the test of a conditional it branches on the
+ * comparison directly.
+ */
+struct BICMP : public BIFUNC
+{
+  CMPOP                 op;
   std::shared_ptr<EXPR> lhs, rhs;
-  BISUM(std::shared_ptr<EXPR> l, std::shared_ptr<EXPR> r, int offset = -1)
-      : lhs(l)
+  BICMP(CMPOP op, std::shared_ptr<EXPR> l, std::shared_ptr<EXPR> r, int offset = -1)
+      : op(op)
+      , lhs(l)
       , rhs(r)
       , BIFUNC(offset)
   {
@@ -113,26 +401,299 @@ struct BISUM : public BIFUNC
   void print(int indent = 0) const override
   {
     INDENT(indent);
-    puts("+");
+    switch(op)
+    {
+#define CMPOP_PROC(X, NAME, PRED) \
+  case X:                         \
+    puts(NAME);                   \
+    break;
+#include "cmpop.def"
+#undef CMPOP_PROC
+    }
     lhs->print(indent + 1);
     rhs->print(indent + 1);
   }
   Value* codegen() override;
 };
 
-struct BIMUL : public BIFUNC
+/**
+ * Conditional, of the forms:
+ *
+ *  '(' 'if' <test> <then expr> [ <else expr> ] ')'
+ *  '(' 'when' <test> <body expr>... ')'
+ *  '(' 'cond' { '(' { <test> | 'else' } <body expr>... ')' }... ')'
+ *
+ * cond becomes a chain of ifs. Any test other than 0 is true. Evaluates to
+ * the last expression of the branch taken, or 0 when there is none.
+ */
+struct BIIF : public BIFUNC
+{
+  std::shared_ptr<EXPR>              test;
+  std::vector<std::shared_ptr<EXPR>> then, els;
+  BIIF(std::shared_ptr<EXPR> test, std::vector<std::shared_ptr<EXPR>> then,
+       std::vector<std::shared_ptr<EXPR>> els, int offset = -1)
+      : test(test)
+      , then(then)
+      , els(els)
+      , BIFUNC(offset)
+  {
+  }
+  void print(int indent = 0) const override
+  {
+    INDENT(indent);
+    puts("if");
+    test->print(indent + 1);
+    INDENT(indent);
+    puts("then:");
+    for(auto t : then)
+      t->print(indent + 1);
+    if(els.empty())
+      return;
+    INDENT(indent);
+    puts("else:");
+    for(auto e : els)
+      e->print(indent + 1);
+  }
+  Value* codegen() override;
+};
+
+/**
+ * Dispatch on an integer, of the form:
+ *
+ *  '(' 'case' <key expr> { '(' { <num> | '(' <num>... ')' } <body expr>... ')' }...
+ *      [ '(' 'otherwise' <body expr>... ')' ] ')'
+ *
+ * Keys are integer literals, each used at most once. A key that matches none
+ * of them, or is not an integer, runs the otherwise body, which defaults to 0.
+ */
+struct BICASE : public BIFUNC
 {
-  std::shared_ptr<EXPR> lhs, rhs;
-  BIMUL(std::shared_ptr<EXPR> l, std::shared_ptr<EXPR> r, int offset = -1)
-      : lhs(l)
-      , rhs(r)
+  std::shared_ptr<EXPR>                           key;
+  std::vector<std::vector<int64_t>>               keys;
+  std::vector<std::vector<std::shared_ptr<EXPR>>> bodies;
+  std::vector<std::shared_ptr<EXPR>>              otherwise;
+  BICASE(std::shared_ptr<EXPR> key, std::vector<std::vector<int64_t>> keys,
+         std::vector<std::vector<std::shared_ptr<EXPR>>> bodies,
+         std::vector<std::shared_ptr<EXPR>> otherwise, int offset = -1)
+      : key(key)
+      , keys(keys)
+      , bodies(bodies)
+      , otherwise(otherwise)
+      , BIFUNC(offset)
+  {
+  }
+  void print(int indent = 0) const override
+  {
+    INDENT(indent);
+    puts("case");
+    key->print(indent + 1);
+    for(int i = 0; i < keys.size(); i++)
+    {
+      INDENT(indent);
+      for(auto k : keys[i])
+        printf("%lld ", (long long)k);
+      puts(":");
+      for(auto e : bodies[i])
+        e->print(indent + 1);
+    }
+    INDENT(indent);
+    puts("otherwise:");
+    for(auto e : otherwise)
+      e->print(indent + 1);
+  }
+  Value* codegen() override;
+};
+
+/**
+ * Branch probability hint, of the form:
+ *
+ *  '(' { 'likely' | 'unlikely' } <expr> ')'
+ *
+ * As the test of a conditional it becomes branch weights, so the expected
+ * branch is laid out as the fall-through. Anywhere else it is just <expr>.
+ */
+struct BILIKELY : public BIFUNC
+{
+  bool                  likely;
+  std::shared_ptr<EXPR> e;
+  BILIKELY(bool likely, std::shared_ptr<EXPR> e, int offset = -1)
+      : likely(likely)
+      , e(e)
+      , BIFUNC(offset)
+  {
+  }
+  void print(int indent = 0) const override
+  {
+    INDENT(indent);
+    puts(likely ? "likely" : "unlikely");
+    e->print(indent + 1);
+  }
+  Value* codegen() override;
+};
+
+enum LISTOP
+{
+#define LISTOP_PROC(X, NAME, NARGS) X,
+#include "listop.def"
+#undef LISTOP_PROC
+};
+
+/**
+ * List builtins (cons, car, cdr, list, length, nth). Lists are runtime
+ * objects and, like every other value, travel as doubles.
+ */
+struct BILISTOP : public BIFUNC
+{
+  LISTOP                             op;
+  std::vector<std::shared_ptr<EXPR>> args;
+  BILISTOP(LISTOP op, std::vector<std::shared_ptr<EXPR>> args, int offset = -1)
+      : op(op)
+      , args(args)
+      , BIFUNC(offset)
+  {
+  }
+  void print(int indent = 0) const override
+  {
+    INDENT(indent);
+    switch(op)
+    {
+#define LISTOP_PROC(X, NAME, NARGS) \
+  case X:                           \
+    puts(NAME);                     \
+    break;
+#include "listop.def"
+#undef LISTOP_PROC
+    }
+    for(auto a : args)
+      a->print(indent + 1);
+  }
+  Value* codegen() override;
+};
+
+/**
+ * Anonymous function, of the form:
+ *
+ *  '(' 'lambda' '(' <param>... ')' <body expr>... ')'
+ *
+ * Evaluates to a closure: a pointer to the function's code followed by the
+ * values of the local variables the body uses, copied when the lambda is
+ * evaluated, so the body cannot setq them. A closure bound by a let that is
+ * only ever called lives on the let's stack frame; one that may be kept
+ * longer is allocated in the current region. A lambda using no local
+ * variables needs no allocation at all.
+ */
+struct BILAMBDA : public BIFUNC
+{
+  std::vector<std::string>           params;
+  std::vector<std::shared_ptr<EXPR>> body;
+  bool                               stack = false; // decided while lowering
+  BILAMBDA(std::vector<std::string> params, std::vector<std::shared_ptr<EXPR>> body,
+           int offset = -1)
+      : params(params)
+      , body(body)
       , BIFUNC(offset)
   {
   }
   void print(int indent = 0) const override
   {
     INDENT(indent);
-    puts("*");
+    printf("lambda");
+    for(auto& p : params)
+      printf(" %s", p.c_str());
+    puts("");
+    for(auto b : body)
+      b->print(indent + 1);
+  }
+  Value* codegen() override;
+};
+
+/**
+ * Call of a function value, of the form:
+ *
+ *  '(' 'funcall' <fn expr> <arg expr>... ')'
+ *
+ * A lambda written in place is lowered inline, with its parameters bound to
+ * the arguments, and the name of a defun that is not also a variable calls
+ * the defun directly. Anything else must evaluate to a closure.
+ */
+struct BIFUNCALL : public BIFUNC
+{
+  std::shared_ptr<EXPR>              fn;
+  std::vector<std::shared_ptr<EXPR>> args;
+  BIFUNCALL(std::shared_ptr<EXPR> fn, std::vector<std::shared_ptr<EXPR>> args, int offset = -1)
+      : fn(fn)
+      , args(args)
+      , BIFUNC(offset)
+  {
+  }
+  void print(int indent = 0) const override
+  {
+    INDENT(indent);
+    puts("funcall");
+    fn->print(indent + 1);
+    for(auto a : args)
+      a->print(indent + 1);
+  }
+  Value* codegen() override;
+};
+
+/**
+ * A defun as a value, '(' 'function' <name> ')'. Evaluates to a closure that
+ * calls it.
+ */
+struct BIFUNCTION : public BIFUNC
+{
+  std::string n;
+  BIFUNCTION(std::string n, int offset = -1)
+      : n(n)
+      , BIFUNC(offset)
+  {
+  }
+  void print(int indent = 0) const override
+  {
+    INDENT(indent);
+    printf("function %s\n", n.c_str());
+  }
+  Value* codegen() override;
+};
+
+enum HOFOP
+{
+  HOF_MAPCAR,
+  HOF_FOLD,
+};
+
+/**
+ * Higher-order list builtins, of the forms:
+ *
+ *  '(' 'mapcar' <fn expr> <list expr> ')'
+ *  '(' 'fold' <fn expr> <init expr> <list expr> ')'
+ *
+ * mapcar is the list of fn applied to each element. fold is
+ * (fn (... (fn (fn init e0) e1) ...) en), or init for the empty list. fn is
+ * applied as by funcall, so a lambda written in place becomes the body of
+ * the loop and makes no closure.
+ */
+struct BIHOF : public BIFUNC
+{
+  HOFOP                              op;
+  std::shared_ptr<EXPR>              fn;
+  std::vector<std::shared_ptr<EXPR>> args;
+  BIHOF(HOFOP op, std::shared_ptr<EXPR> fn, std::vector<std::shared_ptr<EXPR>> args,
+        int offset = -1)
+      : op(op)
+      , fn(fn)
+      , args(args)
+      , BIFUNC(offset)
+  {
+  }
+  void print(int indent = 0) const override
+  {
+    INDENT(indent);
+    puts(op == HOF_MAPCAR ? "mapcar" : "fold");
+    fn->print(indent + 1);
+    for(auto a : args)
+      a->print(indent + 1);
   }
   Value* codegen() override;
 };
@@ -167,13 +728,18 @@ struct SEXPR : public EXPR
  * Prototype of a function, of the form:
  *
  *  '(' 'defun' <proto sexpr> <body sexpr> ')'
- *  '(' 'extern' <proto sexpr> ')'
+ *  '(' 'import' <proto sexpr> ')'
  */
 struct PROTOTYPE
 {
   std::string              n;
   std::vector<std::string> args;
   PROTOTYPE(std::shared_ptr<SEXPR> se);
+  PROTOTYPE(std::string n, std::vector<std::string> args)
+      : n(n)
+      , args(args)
+  {
+  }
   void print(int indent = 0) const
   {
     INDENT(indent);
@@ -189,11 +755,25 @@ struct PROTOTYPE
   Function* codegen();
 };
 
+/**
+ * Inlining preference set by a '(declare inline)' or '(declare noinline)'
+ * form at the start of a defun body.
+ */
+enum INLINEKIND
+{
+  INLINE_DEFAULT,
+  INLINE_ALWAYS,
+  INLINE_NEVER,
+};
+
 struct USERFUNC : public EXPR
 {
   static std::map<std::string, Value*> local_values;
   std::shared_ptr<PROTOTYPE>           proto;
   std::vector<std::shared_ptr<SEXPR>>  body;
+  INLINEKIND                           inl  = INLINE_DEFAULT;
+  bool                                 memo = false; // defined with defun-memo
+  std::vector<std::string>             versions;     // from '(declare multiversion ...)'
   USERFUNC(std::shared_ptr<PROTOTYPE> p, std::vector<std::shared_ptr<SEXPR>> b, int offset = -1)
       : proto(p)
       , body(b)
@@ -203,8 +783,21 @@ struct USERFUNC : public EXPR
   void print(int indent = 0) const override
   {
     INDENT(indent);
-    puts("user function:");
+    puts(memo ? "user function (memo):" : "user function:");
     proto->print(indent + 1);
+    if(inl != INLINE_DEFAULT)
+    {
+      INDENT(indent + 1);
+      puts(inl == INLINE_ALWAYS ? "declare: inline" : "declare: noinline");
+    }
+    if(!versions.empty())
+    {
+      INDENT(indent + 1);
+      printf("declare: multiversion");
+      for(auto& v : versions)
+        printf(" %s", v.c_str());
+      puts("");
+    }
     INDENT(indent + 1);
     puts("body:");
     for (auto b : body)
@@ -235,6 +828,65 @@ struct CALLEXPR : public EXPR
   Value* codegen() override;
 };
 
+/**
+ * Declarations of functions defined in other modules, of the form:
+ *
+ *  '(' 'import' { <module id> | <proto sexpr> }... ')'
+ *
+ * A module id names an interface file <module>.lci, written when that module
+ * was compiled with -target object, and imports every prototype in it.
+ */
+struct BIIMPORT : public BIFUNC
+{
+  std::vector<std::string>                modules; // read again when lowered
+  std::vector<std::shared_ptr<PROTOTYPE>> protos;
+  BIIMPORT(std::vector<std::string> modules, std::vector<std::shared_ptr<PROTOTYPE>> protos,
+           int offset = -1)
+      : modules(modules)
+      , protos(protos)
+      , BIFUNC(offset)
+  {
+  }
+  void print(int indent = 0) const override
+  {
+    INDENT(indent);
+    printf("import:");
+    for(auto& m : modules)
+      printf(" %s", m.c_str());
+    puts("");
+    for(auto p : protos)
+      p->print(indent + 1);
+  }
+  Value* codegen() override;
+};
+
+/**
+ * Functions visible to other modules, of the form:
+ *
+ *  '(' 'export' <id>... ')'
+ *
+ * When compiling with -target object, every other function is internal and
+ * the exported prototypes are written to the module's interface file.
+ */
+struct BIEXPORT : public BIFUNC
+{
+  std::vector<std::string> names;
+  BIEXPORT(std::vector<std::string> names, int offset = -1)
+      : names(names)
+      , BIFUNC(offset)
+  {
+  }
+  void print(int indent = 0) const override
+  {
+    INDENT(indent);
+    printf("export:");
+    for(auto& n : names)
+      printf(" %s", n.c_str());
+    puts("");
+  }
+  Value* codegen() override;
+};
+
 struct MODULE : public EXPR
 {
   std::vector<std::shared_ptr<SEXPR>> sexprs;
@@ -266,6 +918,17 @@ struct E_EOF : public EXPR
   }
 };
 
+/**
+ * Top-level forms that only declare things. They are lowered ahead of the
+ * expressions that make up main, and do not produce main's result.
+ */
+inline bool is_decl_form(std::shared_ptr<SEXPR> se)
+{
+  auto e = se->exprs[0];
+  return std::dynamic_pointer_cast<USERFUNC>(e) || std::dynamic_pointer_cast<BIIMPORT>(e) ||
+         std::dynamic_pointer_cast<BIEXPORT>(e);
+}
+
 #undef INDENT
 
 enum TOK
@@ -275,25 +938,86 @@ enum TOK
 #undef TOK_PROC
 };
 
-typedef struct
+/**
+ * The token stream, stored as parallel arrays so passes that only care about
+ * token kinds (paren balancing, skipping to the end of a form) scan one byte
+ * per token. Identifiers and string literals are interned into strs and
+ * number literals pooled in nums; payload indexes whichever pool the token's
+ * kind uses.
+ */
+struct TOKSTREAM
 {
-  TOK t;
-  int offset;
-  union
+  std::vector<uint8_t>    kind;
+  std::vector<uint32_t>   offset;
+  std::vector<uint32_t>   payload;
+  std::deque<std::string> strs;
+  std::vector<double>     nums;
+
+  size_t size() const
+  {
+    return kind.size();
+  }
+  void     push(TOK t, uint32_t off, uint32_t pl = 0);
+  uint32_t intern(std::string_view s);
+  uint32_t literal(double v);
+  void     clear();
+
+private:
+  std::unordered_map<std::string_view, uint32_t> interned;
+};
+
+/**
+ * A position in the token stream. The stream always ends in TOK_EOF and the
+ * cursor never moves past it.
+ */
+struct TOKCURSOR
+{
+  const TOKSTREAM* ts;
+  uint32_t         i = 0;
+
+  TOK kind() const
+  {
+    return (TOK)ts->kind[i];
+  }
+  uint32_t offset() const
+  {
+    return ts->offset[i];
+  }
+  const std::string& str() const
+  {
+    return ts->strs[ts->payload[i]];
+  }
+  double num() const
   {
-    int   i_val;
-    char* s_val;
-    char  bin;
-  } val;
-} TOKEN;
+    return ts->nums[ts->payload[i]];
+  }
+  bool at_end() const
+  {
+    return kind() == TOK_EOF;
+  }
+  void next()
+  {
+    i += i + 1 < ts->size();
+  }
+};
+
+/**
+ * State for finding top-level forms in input that arrives in pieces, so a
+ * streaming driver can compile each form as soon as its closing paren is read.
+ */
+struct FORMSCAN
+{
+  size_t pos   = 0;
+  int    depth = 0;
+  bool   str = false, comment = false;
+};
 
-int                     lex(FILE*);
+int                     lex(std::string_view src, uint32_t base = 0);
+size_t                  next_form_end(std::string_view buf, FORMSCAN& st);
 std::shared_ptr<MODULE> parse();
-void                    parse_finalize();
 void                    parse_dump();
 
-TOKEN* tok(int toki);
-void   tok_iter(void (*visitor)(TOKEN*));
-EXPR*  expr(int expi);
-FILE*  preproc(FILE* istream);
-void   dump_tok();
+const TOKSTREAM& tokens();
+TOKCURSOR        tok_cursor();
+EXPR*            expr(int expi);
+void             dump_tok();
@@ -0,0 +1,14 @@
+#include "lcrt.h"
+#include <cstdio>
+#include <cstdlib>
+
+void lcrt_bad_call(const char *name, int64_t nargs, int64_t arity) {
+  lcrt_flush();
+  if (arity < 0)
+    fprintf(stderr, "lc: '%s' is called but is not a function\n", name);
+  else
+    fprintf(stderr,
+            "lc: '%s' is called with %lld arguments, but takes %lld\n", name,
+            (long long)nargs, (long long)arity);
+  exit(1);
+}
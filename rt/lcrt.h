@@ -0,0 +1,151 @@
+#pragma once
+/**
+ * lc runtime library.
+ *
+ * Entry points called by code lc generates. lc links this library into native
+ * outputs and loads it into lli for the interpret target whenever the lowered
+ * module references one of these functions.
+ */
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*----------------------------------------------------------------------------
+ * Memoization tables for defun-memo (memo.cpp)
+ *--------------------------------------------------------------------------*/
+
+/* Create the table stored in *slot unless another thread already did, and
+ * return whichever table ended up in *slot. */
+void *lcrt_memo_init(void **slot, const char *name, int32_t nargs,
+                     int64_t capacity, int32_t stats);
+/* Look up the nargs doubles at key. On a hit, store the cached result in *out
+ * and return 1. */
+int32_t lcrt_memo_get(void *tbl, const double *key, double *out);
+void lcrt_memo_put(void *tbl, const double *key, double v);
+
+/*----------------------------------------------------------------------------
+ * Work-stealing thread pool (pool.cpp)
+ *
+ * The pool starts on first use with LCRT_NUM_THREADS threads (default: one
+ * per hardware thread). LCRT_GRAIN sets the number of iterations run as one
+ * unit of work (default: a few chunks per thread).
+ *--------------------------------------------------------------------------*/
+
+typedef void (*lcrt_body)(int64_t lo, int64_t hi, void *env);
+
+/* Run fn over [start, end) split into subranges, and return once every
+ * iteration has completed. */
+void lcrt_parallel_for(int64_t start, int64_t end, lcrt_body fn, void *env);
+
+/* Futures share the pool with parallel-for. */
+typedef struct lcrt_future lcrt_future;
+typedef double (*lcrt_thunk)(void *env);
+
+/* Copy size bytes of env and queue fn(env) to run on the pool. */
+lcrt_future *lcrt_spawn(lcrt_thunk fn, const void *env, int64_t size);
+/* Wait for f, helping with other work meanwhile, and return its result. The
+ * future is recycled, so each one must be awaited exactly once. */
+double lcrt_await(lcrt_future *f);
+
+/*----------------------------------------------------------------------------
+ * Region allocator (region.cpp)
+ *
+ * All language-level allocations are bump allocations in the calling
+ * thread's arena. Memory is reclaimed when the innermost enclosing
+ * with-region exits, or when the thread exits.
+ *
+ * Work run on the pool follows the thread that started it: every
+ * parallel-for subrange runs in a region of its own, as nothing it allocates
+ * outlives it, and what a future allocates is kept apart and handed to the
+ * thread that awaits it, to be reclaimed with that thread's region.
+ *--------------------------------------------------------------------------*/
+
+void *lcrt_alloc(int64_t size, int64_t align);
+void lcrt_region_push(void);
+void lcrt_region_pop(void);
+/* Allocate into a fresh chain of chunks until lcrt_detach_end, which returns
+ * the chain and goes back to the thread's arena. */
+void lcrt_detach_begin(void);
+void *lcrt_detach_end(void);
+/* Make a detached chain part of the innermost region of this thread. */
+void lcrt_adopt(void *chunks);
+
+/*----------------------------------------------------------------------------
+ * Lists (list.cpp)
+ *
+ * A list is a pointer to its first element, nil is the null pointer. Elements
+ * are stored unboxed in cdr-coded chunks of LCRT_LIST_CHUNK bytes aligned to
+ * their size, so generated code can do car and most cdrs inline: the next
+ * element directly follows unless the element is the last slot of its chunk,
+ * in which case the chunk header (its first field) points to the rest.
+ *--------------------------------------------------------------------------*/
+
+#define LCRT_LIST_CHUNK 256
+#define LCRT_LIST_HEADER 16
+
+double *lcrt_cons(double x, double *l);
+double *lcrt_cdr(double *l);
+/* Build a list of the n doubles at elems. */
+double *lcrt_list(int64_t n, const double *elems);
+int64_t lcrt_length(double *l);
+/* The nth element of l, or 0 (nil) if l is shorter. */
+double lcrt_nth(int64_t n, double *l);
+
+/*----------------------------------------------------------------------------
+ * Function values (call.cpp)
+ *
+ * A closure is a pointer to its code, the number of arguments it takes and
+ * the values it captured. Calls through one are checked as they are made.
+ *--------------------------------------------------------------------------*/
+
+/* Report a call of name, with nargs arguments, of a closure taking arity, or
+ * of a value that is no closure when arity < 0, and exit. */
+void lcrt_bad_call(const char *name, int64_t nargs, int64_t arity);
+
+/*----------------------------------------------------------------------------
+ * Function instrumentation (prof.cpp)
+ *
+ * With -finstrument-functions, generated code keeps a static table with one
+ * entry per defun, updated inline on every call, and reports it when main
+ * returns. Cycles are inclusive and only counted in LCRT_PROF_CYCLES mode.
+ *--------------------------------------------------------------------------*/
+
+#define LCRT_PROF_COUNTS 1
+#define LCRT_PROF_CYCLES 2
+
+typedef struct {
+  const char *name;
+  int64_t calls;
+  int64_t cycles;
+} lcrt_prof_entry;
+
+/* Print the table sorted by cycles (or calls), as a table or as JSON when
+ * LCRT_PROF_FORMAT=json, to stderr or the file named by LCRT_PROF_OUTPUT. */
+void lcrt_prof_report(const lcrt_prof_entry *table, int64_t n, int32_t mode);
+
+/*----------------------------------------------------------------------------
+ * Buffered output (out.cpp)
+ *
+ * Everything lc programs print goes through a per-thread buffer written to
+ * stdout when it fills, at every newline when stdout is a terminal, and at
+ * exit. printf calls with a constant format are split by the compiler into
+ * lcrt_write runs and one lcrt_print_fmt per conversion.
+ *--------------------------------------------------------------------------*/
+
+void lcrt_write(const char *s, int64_t n);
+void lcrt_print_str(const char *s);
+/* Shortest text that reads back as v. */
+void lcrt_print_num(double v);
+/* One printf conversion of v: conv is one of f F e E g G, prec < 0 means the
+ * printf default of 6. */
+void lcrt_print_fmt(double v, int32_t conv, int32_t prec);
+void lcrt_newline(void);
+/* Fallback for formats the compiler does not split. */
+int32_t lcrt_printf(const char *fmt, ...);
+void lcrt_flush(void);
+
+#ifdef __cplusplus
+}
+#endif
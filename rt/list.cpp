@@ -0,0 +1,98 @@
+#include "lcrt.h"
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstring>
+
+namespace {
+
+// Lists are cdr-coded: elements live in 256 byte chunks, aligned to their
+// size, and consecutive elements of a list are consecutive slots of a chunk.
+// Only the last slot of a chunk continues through a pointer. A list is a
+// pointer to its first element, so car is a load and cdr usually an add.
+constexpr uintptr_t chunk_bytes = 256;
+constexpr uint32_t slots = (chunk_bytes - 16) / sizeof(double);
+
+struct chunk {
+  // The rest of the list after the last slot.
+  double *next;
+  // First used slot. Chunks fill from the back, so cons can claim the slot in
+  // front of a list that starts here instead of allocating.
+  std::atomic<uint32_t> start;
+  uint32_t pad;
+  double e[slots];
+};
+static_assert(sizeof(chunk) == chunk_bytes, "chunk must fill its alignment");
+static_assert(offsetof(chunk, e) == LCRT_LIST_HEADER, "header size mismatch");
+
+chunk *chunk_of(const double *p) {
+  return reinterpret_cast<chunk *>(reinterpret_cast<uintptr_t>(p) &
+                                   ~(chunk_bytes - 1));
+}
+
+chunk *new_chunk(double *next, uint32_t start) {
+  auto *c = static_cast<chunk *>(lcrt_alloc(chunk_bytes, chunk_bytes));
+  c->next = next;
+  c->start.store(start, std::memory_order_relaxed);
+  return c;
+}
+
+} // namespace
+
+double *lcrt_cons(double x, double *l) {
+  if (l) {
+    chunk *c = chunk_of(l);
+    uint32_t s = l - c->e;
+    // Lists are immutable, so the slot in front of l may only be claimed once.
+    // Whoever loses the race allocates a fresh chunk instead.
+    if (s > 0 && c->start.compare_exchange_strong(s, s - 1)) {
+      c->e[s - 1] = x;
+      return &c->e[s - 1];
+    }
+  }
+  chunk *c = new_chunk(l, slots - 1);
+  c->e[slots - 1] = x;
+  return &c->e[slots - 1];
+}
+
+double *lcrt_cdr(double *l) {
+  if (!l)
+    return nullptr;
+  chunk *c = chunk_of(l);
+  return l + 1 < c->e + slots ? l + 1 : c->next;
+}
+
+double *lcrt_list(int64_t n, const double *elems) {
+  double *l = nullptr;
+  while (n > 0) {
+    uint32_t k = std::min<int64_t>(n, slots);
+    chunk *c = new_chunk(l, slots - k);
+    memcpy(&c->e[slots - k], &elems[n - k], k * sizeof(double));
+    l = &c->e[slots - k];
+    n -= k;
+  }
+  return l;
+}
+
+int64_t lcrt_length(double *l) {
+  int64_t n = 0;
+  while (l) {
+    chunk *c = chunk_of(l);
+    __builtin_prefetch(c->next);
+    n += c->e + slots - l;
+    l = c->next;
+  }
+  return n;
+}
+
+double lcrt_nth(int64_t n, double *l) {
+  while (l && n >= 0) {
+    chunk *c = chunk_of(l);
+    int64_t avail = c->e + slots - l;
+    if (n < avail)
+      return l[n];
+    n -= avail;
+    l = c->next;
+  }
+  return 0.0;
+}
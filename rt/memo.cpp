@@ -0,0 +1,158 @@
+#include "lcrt.h"
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace {
+
+// A lookup or insert never looks at more than this many consecutive slots.
+// When an insert finds the whole window full, the least recently used entry in
+// the window is evicted.
+constexpr uint64_t max_probe = 8;
+
+struct memo_table {
+  // Copied, since the string may live in JIT memory that is gone by exit.
+  std::string name;
+  int nargs;
+  uint64_t mask;
+  // Per slot: the key hash (0 if empty), the tick of its last use, and the
+  // cached result followed by the nargs key doubles.
+  std::vector<uint64_t> tags;
+  std::vector<uint64_t> stamps;
+  std::vector<double> vals;
+  uint64_t tick = 0;
+  uint64_t hits = 0, misses = 0, evictions = 0;
+  bool stats;
+  std::atomic_flag busy = ATOMIC_FLAG_INIT;
+
+  double *slot(uint64_t s) { return &vals[s * (nargs + 1)]; }
+  void lock() {
+    while (busy.test_and_set(std::memory_order_acquire))
+      ;
+  }
+  void unlock() { busy.clear(std::memory_order_release); }
+};
+
+std::mutex registry_lock;
+std::vector<memo_table *> registry;
+
+void dump_stats() {
+  std::lock_guard<std::mutex> g(registry_lock);
+  for (auto *t : registry)
+    fprintf(stderr,
+            "lcrt: memo %s: %llu hits, %llu misses, %llu evictions "
+            "(capacity %llu)\n",
+            t->name.c_str(), (unsigned long long)t->hits,
+            (unsigned long long)t->misses, (unsigned long long)t->evictions,
+            (unsigned long long)t->mask + 1);
+}
+
+// Hash the bit patterns of the key, never returning 0 (the empty tag). The
+// slot comes from the low bits, which for small integers start out constant,
+// so the result is put through murmur3's finalizer to spread every input bit
+// over all of them.
+uint64_t hash_key(const double *key, int nargs) {
+  uint64_t h = 0xcbf29ce484222325ull;
+  for (int i = 0; i < nargs; i++) {
+    uint64_t bits;
+    memcpy(&bits, &key[i], sizeof(bits));
+    h ^= bits;
+    h *= 0x9e3779b97f4a7c15ull;
+    h ^= h >> 32;
+  }
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ull;
+  h ^= h >> 33;
+  return h + (h == 0);
+}
+
+bool same_key(const double *a, const double *b, int nargs) {
+  return memcmp(a, b, nargs * sizeof(double)) == 0;
+}
+
+} // namespace
+
+void *lcrt_memo_init(void **slot, const char *name, int32_t nargs,
+                     int64_t capacity, int32_t stats) {
+  uint64_t cap = max_probe;
+  while (cap < (uint64_t)capacity)
+    cap <<= 1;
+
+  auto *t = new memo_table;
+  t->name = name;
+  t->nargs = nargs;
+  t->mask = cap - 1;
+  t->tags.assign(cap, 0);
+  t->stamps.assign(cap, 0);
+  t->vals.assign(cap * (nargs + 1), 0.0);
+  t->stats = stats;
+
+  void *expected = nullptr;
+  auto *s = reinterpret_cast<std::atomic<void *> *>(slot);
+  if (!s->compare_exchange_strong(expected, t)) {
+    delete t;
+    return expected;
+  }
+
+  if (stats) {
+    std::lock_guard<std::mutex> g(registry_lock);
+    if (registry.empty())
+      atexit(dump_stats);
+    registry.push_back(t);
+  }
+  return t;
+}
+
+int32_t lcrt_memo_get(void *tbl, const double *key, double *out) {
+  auto *t = static_cast<memo_table *>(tbl);
+  uint64_t h = hash_key(key, t->nargs);
+
+  t->lock();
+  for (uint64_t p = 0; p < max_probe; p++) {
+    uint64_t s = (h + p) & t->mask;
+    if (t->tags[s] == 0)
+      break;
+    if (t->tags[s] == h && same_key(t->slot(s) + 1, key, t->nargs)) {
+      t->stamps[s] = ++t->tick;
+      *out = t->slot(s)[0];
+      t->hits++;
+      t->unlock();
+      return 1;
+    }
+  }
+  t->misses++;
+  t->unlock();
+  return 0;
+}
+
+void lcrt_memo_put(void *tbl, const double *key, double v) {
+  auto *t = static_cast<memo_table *>(tbl);
+  uint64_t h = hash_key(key, t->nargs);
+
+  t->lock();
+  uint64_t victim = h & t->mask;
+  for (uint64_t p = 0; p < max_probe; p++) {
+    uint64_t s = (h + p) & t->mask;
+    if (t->tags[s] == 0 ||
+        (t->tags[s] == h && same_key(t->slot(s) + 1, key, t->nargs))) {
+      victim = s;
+      goto store;
+    }
+    if (t->stamps[s] < t->stamps[victim])
+      victim = s;
+  }
+  t->evictions++;
+
+store:
+  t->tags[victim] = h;
+  t->stamps[victim] = ++t->tick;
+  t->slot(victim)[0] = v;
+  memcpy(t->slot(victim) + 1, key, t->nargs * sizeof(double));
+  t->unlock();
+}
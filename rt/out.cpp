@@ -0,0 +1,195 @@
+#include "lcrt.h"
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <charconv>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <unistd.h>
+
+namespace {
+
+constexpr size_t out_size = 1 << 16;
+
+// Room for any single double conversion: %f of 1e308 is 309 digits before
+// the point, and precision is clamped below
+constexpr size_t max_conv = 512;
+
+const bool out_tty = isatty(STDOUT_FILENO);
+
+void write_all(const char *s, size_t n) {
+  while (n > 0) {
+    ssize_t w = write(STDOUT_FILENO, s, n);
+    if (w < 0) {
+      if (errno == EINTR)
+        continue;
+      return;
+    }
+    s += w;
+    n -= w;
+  }
+}
+
+struct outbuf {
+  char buf[out_size];
+  size_t n = 0;
+  // Held by the owning thread while it writes, and by the exit handler while
+  // it flushes threads that are still around
+  std::atomic_flag busy = ATOMIC_FLAG_INIT;
+  outbuf *next = nullptr;
+
+  outbuf();
+  ~outbuf();
+
+  void lock() {
+    while (busy.test_and_set(std::memory_order_acquire))
+      ;
+  }
+  void unlock() { busy.clear(std::memory_order_release); }
+  void flush() {
+    write_all(buf, n);
+    n = 0;
+  }
+  char *reserve(size_t k) {
+    if (n + k > out_size)
+      flush();
+    return buf + n;
+  }
+  void put(const char *s, size_t k) {
+    if (k > out_size / 2) {
+      flush();
+      write_all(s, k);
+      return;
+    }
+    memcpy(reserve(k), s, k);
+    n += k;
+  }
+  // Line buffering on a terminal, like stdio
+  void done(bool newline) {
+    if (out_tty and newline)
+      flush();
+  }
+};
+
+std::mutex all_lock;
+outbuf *all = nullptr;
+
+void flush_all() {
+  std::lock_guard<std::mutex> g(all_lock);
+  for (auto *b = all; b; b = b->next) {
+    b->lock();
+    b->flush();
+    b->unlock();
+  }
+}
+
+outbuf::outbuf() {
+  std::lock_guard<std::mutex> g(all_lock);
+  static bool registered = atexit(flush_all) == 0;
+  (void)registered;
+  next = all;
+  all = this;
+}
+
+outbuf::~outbuf() {
+  std::lock_guard<std::mutex> g(all_lock);
+  for (auto **p = &all; *p; p = &(*p)->next)
+    if (*p == this) {
+      *p = next;
+      break;
+    }
+  flush();
+}
+
+thread_local outbuf out;
+
+struct scoped {
+  scoped() { out.lock(); }
+  ~scoped() { out.unlock(); }
+};
+
+} // namespace
+
+void lcrt_write(const char *s, int64_t n) {
+  scoped g;
+  out.put(s, n);
+  out.done(memchr(s, '\n', n));
+}
+
+void lcrt_print_str(const char *s) { lcrt_write(s, strlen(s)); }
+
+void lcrt_print_num(double v) {
+  scoped g;
+  char *p = out.reserve(max_conv);
+  out.n = std::to_chars(p, p + max_conv, v).ptr - out.buf;
+}
+
+void lcrt_print_fmt(double v, int32_t conv, int32_t prec) {
+  scoped g;
+  if (prec < 0)
+    prec = 6;
+  prec = prec > 100 ? 100 : prec;
+  std::chars_format f = std::chars_format::general;
+  switch (tolower(conv)) {
+  case 'f':
+    f = std::chars_format::fixed;
+    break;
+  case 'e':
+    f = std::chars_format::scientific;
+    break;
+  }
+  char *p = out.reserve(max_conv);
+  char *end = std::to_chars(p, p + max_conv, v, f, prec).ptr;
+  if (isupper(conv))
+    for (char *c = p; c < end; c++)
+      *c = toupper(*c);
+  out.n = end - out.buf;
+}
+
+void lcrt_newline(void) {
+  scoped g;
+  *out.reserve(1) = '\n';
+  out.n++;
+  out.done(true);
+}
+
+int32_t lcrt_printf(const char *fmt, ...) {
+  scoped g;
+  va_list ap, ap2;
+  va_start(ap, fmt);
+  va_copy(ap2, ap);
+  char *p = out.reserve(max_conv);
+  int k = vsnprintf(p, out_size - out.n, fmt, ap);
+  if (k >= 0 and (size_t)k >= out_size - out.n) {
+    // Did not fit in what is left of the buffer
+    out.flush();
+    if ((size_t)k < out_size)
+      vsnprintf(out.buf, out_size, fmt, ap2);
+    else {
+      char *big = (char *)malloc(k + 1);
+      vsnprintf(big, k + 1, fmt, ap2);
+      write_all(big, k);
+      free(big);
+      va_end(ap2);
+      va_end(ap);
+      return k;
+    }
+  }
+  va_end(ap2);
+  va_end(ap);
+  if (k > 0) {
+    out.n += k;
+    out.done(memchr(out.buf + out.n - k, '\n', k));
+  }
+  return k;
+}
+
+void lcrt_flush(void) {
+  if (out.n == 0)
+    return;
+  scoped g;
+  out.flush();
+}
@@ -0,0 +1,330 @@
+#include "lcrt.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace {
+
+struct job {
+  lcrt_body fn;
+  void *env;
+  int64_t grain;
+  // Iterations not yet executed. The job is done when this reaches zero.
+  std::atomic<int64_t> remaining;
+};
+
+struct task {
+  job *j;
+  int64_t lo, hi;
+};
+
+// Each worker owns a deque. The owner pushes and pops at the back, thieves
+// take from the front, where the largest (oldest) ranges are.
+struct worker {
+  std::mutex m;
+  std::deque<task> q;
+
+  void push(task t) {
+    std::lock_guard<std::mutex> g(m);
+    q.push_back(t);
+  }
+  bool pop(task &t) {
+    std::lock_guard<std::mutex> g(m);
+    if (q.empty())
+      return false;
+    t = q.back();
+    q.pop_back();
+    return true;
+  }
+  bool steal(task &t) {
+    std::lock_guard<std::mutex> g(m);
+    if (q.empty())
+      return false;
+    t = q.front();
+    q.pop_front();
+    return true;
+  }
+};
+
+// Bounded lock-free multi-producer multi-consumer queue (Vyukov). Each cell
+// carries a sequence number telling producers and consumers whose turn it is,
+// so there is no ABA problem and no allocation after construction.
+template <typename T, size_t N> class mpmc_queue {
+  static_assert((N & (N - 1)) == 0, "capacity must be a power of two");
+  struct cell {
+    std::atomic<size_t> seq;
+    T v;
+  };
+  cell cells[N];
+  alignas(64) std::atomic<size_t> head{0};
+  alignas(64) std::atomic<size_t> tail{0};
+
+public:
+  mpmc_queue() {
+    for (size_t i = 0; i < N; i++)
+      cells[i].seq.store(i, std::memory_order_relaxed);
+  }
+  bool push(T v) {
+    size_t pos = tail.load(std::memory_order_relaxed);
+    for (;;) {
+      cell &c = cells[pos & (N - 1)];
+      size_t seq = c.seq.load(std::memory_order_acquire);
+      intptr_t d = (intptr_t)seq - (intptr_t)pos;
+      if (d == 0) {
+        if (tail.compare_exchange_weak(pos, pos + 1,
+                                       std::memory_order_relaxed)) {
+          c.v = v;
+          c.seq.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (d < 0) {
+        return false;
+      } else {
+        pos = tail.load(std::memory_order_relaxed);
+      }
+    }
+  }
+  bool pop(T &v) {
+    size_t pos = head.load(std::memory_order_relaxed);
+    for (;;) {
+      cell &c = cells[pos & (N - 1)];
+      size_t seq = c.seq.load(std::memory_order_acquire);
+      intptr_t d = (intptr_t)seq - (intptr_t)(pos + 1);
+      if (d == 0) {
+        if (head.compare_exchange_weak(pos, pos + 1,
+                                       std::memory_order_relaxed)) {
+          v = c.v;
+          c.seq.store(pos + N, std::memory_order_release);
+          return true;
+        }
+      } else if (d < 0) {
+        return false;
+      } else {
+        pos = head.load(std::memory_order_relaxed);
+      }
+    }
+  }
+};
+
+struct pool {
+  int nthreads;
+  int64_t grain;
+  std::vector<worker> workers;
+  // Spawned futures wait here until some thread picks them up.
+  mpmc_queue<task, 4096> injected;
+  std::mutex sleep_m;
+  std::condition_variable sleep_cv;
+  std::atomic<int> active_jobs{0};
+
+  pool();
+};
+
+pool *the_pool;
+std::once_flag pool_once;
+// Index of the deque owned by this thread. Threads outside the pool (the
+// program's main thread) share deque 0.
+thread_local int self = 0;
+
+long env_long(const char *name, long dflt) {
+  const char *v = getenv(name);
+  if (!v || !*v)
+    return dflt;
+  long n = strtol(v, nullptr, 10);
+  return n > 0 ? n : dflt;
+}
+
+// Split off the upper half of the range onto our own deque until what is left
+// is at most one grain, then run it.
+void run(task t) {
+  while (t.hi - t.lo > t.j->grain) {
+    int64_t mid = t.lo + (t.hi - t.lo) / 2;
+    the_pool->workers[self].push(task{t.j, mid, t.hi});
+    t.hi = mid;
+  }
+  lcrt_region_push();
+  t.j->fn(t.lo, t.hi, t.j->env);
+  lcrt_region_pop();
+  // Output of the task must be out before the job is seen as done
+  lcrt_flush();
+  t.j->remaining.fetch_sub(t.hi - t.lo, std::memory_order_acq_rel);
+}
+
+bool find_task(task &t) {
+  auto &ws = the_pool->workers;
+  if (ws[self].pop(t))
+    return true;
+  if (the_pool->injected.pop(t))
+    return true;
+  int n = ws.size();
+  for (int i = 1; i < n; i++)
+    if (ws[(self + i) % n].steal(t))
+      return true;
+  return false;
+}
+
+// Run other work until j has completed.
+void help_until_done(job &j) {
+  task t;
+  while (j.remaining.load(std::memory_order_acquire) > 0) {
+    if (find_task(t))
+      run(t);
+    else
+      std::this_thread::yield();
+  }
+}
+
+void worker_loop(int id) {
+  self = id;
+  task t;
+  for (;;) {
+    if (find_task(t)) {
+      run(t);
+      continue;
+    }
+    if (the_pool->active_jobs > 0) {
+      std::this_thread::yield();
+      continue;
+    }
+    std::unique_lock<std::mutex> g(the_pool->sleep_m);
+    the_pool->sleep_cv.wait(g, [] { return the_pool->active_jobs > 0; });
+  }
+}
+
+// Wake sleeping workers when the first job becomes active.
+void job_started() {
+  if (the_pool->active_jobs.fetch_add(1) == 0) {
+    std::lock_guard<std::mutex> g(the_pool->sleep_m);
+    the_pool->sleep_cv.notify_all();
+  }
+}
+
+void job_finished() { the_pool->active_jobs.fetch_sub(1); }
+
+pool::pool() : workers(0) {
+  nthreads = env_long("LCRT_NUM_THREADS", std::thread::hardware_concurrency());
+  if (nthreads < 1)
+    nthreads = 1;
+  grain = env_long("LCRT_GRAIN", 0);
+  std::vector<worker> ws(nthreads);
+  workers.swap(ws);
+}
+
+void start_pool() {
+  the_pool = new pool;
+  for (int i = 1; i < the_pool->nthreads; i++)
+    std::thread(worker_loop, i).detach();
+}
+
+pool *get_pool() {
+  std::call_once(pool_once, start_pool);
+  return the_pool;
+}
+
+} // namespace
+
+void lcrt_parallel_for(int64_t start, int64_t end, lcrt_body fn, void *env) {
+  if (end <= start)
+    return;
+  auto *p = get_pool();
+
+  int64_t n = end - start;
+  job j;
+  j.fn = fn;
+  j.env = env;
+  // Without an explicit grain, aim for a few chunks per thread so stealing
+  // can even out imbalanced iterations.
+  j.grain = p->grain ? p->grain : std::max<int64_t>(1, n / (8 * p->nthreads));
+  j.remaining = n;
+
+  if (p->nthreads == 1 || n <= j.grain) {
+    for (int64_t lo = start; lo < end; lo += j.grain) {
+      lcrt_region_push();
+      fn(lo, std::min(end, lo + j.grain), env);
+      lcrt_region_pop();
+    }
+    return;
+  }
+
+  // Keep what was printed before the loop ahead of what the loop prints
+  lcrt_flush();
+  p->workers[self].push(task{&j, start, end});
+  job_started();
+  // Tasks of other jobs picked up meanwhile are run too, which keeps nested
+  // loops deadlock free.
+  help_until_done(j);
+  job_finished();
+}
+
+/*----------------------------------------------------------------------------
+ * Futures
+ *--------------------------------------------------------------------------*/
+
+// Environments up to this size are copied into the future itself.
+constexpr size_t inline_env = 64;
+
+struct lcrt_future {
+  // A one-iteration job, so futures run on the same workers as loops.
+  job j;
+  lcrt_thunk fn;
+  double result;
+  // What fn allocated, which the result may point into
+  void *chunks;
+  void *env;
+  alignas(16) char storage[inline_env];
+};
+
+namespace {
+
+// Recycled futures, so spawning does not go through the allocator.
+mpmc_queue<lcrt_future *, 1024> free_futures;
+
+void run_future(int64_t, int64_t, void *p) {
+  auto *f = static_cast<lcrt_future *>(p);
+  lcrt_detach_begin();
+  f->result = f->fn(f->env);
+  f->chunks = lcrt_detach_end();
+  job_finished();
+}
+
+} // namespace
+
+lcrt_future *lcrt_spawn(lcrt_thunk fn, const void *env, int64_t size) {
+  auto *p = get_pool();
+
+  lcrt_future *f;
+  if (!free_futures.pop(f))
+    f = new lcrt_future;
+  f->fn = fn;
+  f->env = (size_t)size <= inline_env ? f->storage : malloc(size);
+  if (size)
+    memcpy(f->env, env, size);
+  f->j.fn = run_future;
+  f->j.env = f;
+  f->j.grain = 1;
+  f->j.remaining = 1;
+
+  lcrt_flush();
+  job_started();
+  if (!p->injected.push(task{&f->j, 0, 1}))
+    run(task{&f->j, 0, 1});
+  return f;
+}
+
+double lcrt_await(lcrt_future *f) {
+  get_pool();
+  help_until_done(f->j);
+
+  double r = f->result;
+  lcrt_adopt(f->chunks);
+  if (f->env != f->storage)
+    free(f->env);
+  if (!free_futures.push(f))
+    delete f;
+  return r;
+}
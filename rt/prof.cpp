@@ -0,0 +1,53 @@
+#include "lcrt.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+void lcrt_prof_report(const lcrt_prof_entry *table, int64_t n, int32_t mode) {
+  bool cycles = mode == LCRT_PROF_CYCLES;
+  std::vector<const lcrt_prof_entry *> es;
+  int64_t total = 0;
+  for (int64_t i = 0; i < n; i++) {
+    es.push_back(&table[i]);
+    total += cycles ? table[i].cycles : table[i].calls;
+  }
+  std::stable_sort(es.begin(), es.end(), [=](auto *a, auto *b) {
+    return cycles ? a->cycles > b->cycles : a->calls > b->calls;
+  });
+
+  FILE *out = stderr;
+  if (const char *path = getenv("LCRT_PROF_OUTPUT"))
+    if (!(out = fopen(path, "w")))
+      out = stderr;
+
+  const char *fmt = getenv("LCRT_PROF_FORMAT");
+  if (fmt && !strcmp(fmt, "json")) {
+    fprintf(out, "[");
+    for (size_t i = 0; i < es.size(); i++) {
+      fprintf(out, "%s\n  {\"function\": \"%s\", \"calls\": %lld", i ? "," : "",
+              es[i]->name, (long long)es[i]->calls);
+      if (cycles)
+        fprintf(out, ", \"cycles\": %lld", (long long)es[i]->cycles);
+      fprintf(out, "}");
+    }
+    fprintf(out, "\n]\n");
+  } else {
+    fprintf(out, "%-32s %14s", "function", "calls");
+    if (cycles)
+      fprintf(out, " %16s %14s", "cycles", "cycles/call");
+    fprintf(out, " %7s\n", "%");
+    for (auto *e : es) {
+      int64_t v = cycles ? e->cycles : e->calls;
+      fprintf(out, "%-32s %14lld", e->name, (long long)e->calls);
+      if (cycles)
+        fprintf(out, " %16lld %14.1f", (long long)e->cycles,
+                e->calls ? (double)e->cycles / e->calls : 0.0);
+      fprintf(out, " %6.2f%%\n", total ? 100.0 * v / total : 0.0);
+    }
+  }
+
+  if (out != stderr)
+    fclose(out);
+}
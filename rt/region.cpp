@@ -0,0 +1,159 @@
+#include "lcrt.h"
+#include <cstdlib>
+#include <vector>
+
+namespace {
+
+constexpr size_t chunk_size = 64 * 1024;
+
+struct chunk {
+  chunk *prev;
+  size_t size;
+  char *end() { return reinterpret_cast<char *>(this) + size; }
+  char *begin() { return reinterpret_cast<char *>(this + 1); }
+};
+
+struct mark {
+  chunk *c;
+  char *cur;
+  chunk *adopted;
+};
+
+// Free a chunk, keeping standard sized ones for reuse
+void drop(chunk *c, chunk *&free) {
+  if (c->size == chunk_size) {
+    c->prev = free;
+    free = c;
+  } else {
+    std::free(c);
+  }
+}
+
+// Every thread bumps through its own chain of chunks. Regions are marks into
+// that chain: leaving a region rewinds to where it started and hands the
+// chunks allocated since back to the free list. Chunks of awaited futures are
+// adopted into a second chain, released with the region that adopted them.
+struct arena {
+  chunk *c = nullptr;
+  char *cur = nullptr, *end = nullptr;
+  chunk *adopted = nullptr;
+  chunk *free = nullptr;
+  std::vector<mark> regions;
+
+  ~arena() {
+    release(nullptr);
+    disown(nullptr);
+    while (free) {
+      chunk *n = free->prev;
+      std::free(free);
+      free = n;
+    }
+  }
+
+  void *grow(size_t size, size_t align) {
+    size_t need = size + align + sizeof(chunk);
+    chunk *n;
+    if (need <= chunk_size && free) {
+      n = free;
+      free = free->prev;
+    } else {
+      n = static_cast<chunk *>(malloc(need > chunk_size ? need : chunk_size));
+      n->size = need > chunk_size ? need : chunk_size;
+    }
+    n->prev = c;
+    c = n;
+    cur = n->begin();
+    end = n->end();
+    return bump(size, align);
+  }
+
+  void *bump(size_t size, size_t align) {
+    auto p = (reinterpret_cast<uintptr_t>(cur) + align - 1) & ~(align - 1);
+    if (p + size > reinterpret_cast<uintptr_t>(end))
+      return grow(size, align);
+    cur = reinterpret_cast<char *>(p + size);
+    return reinterpret_cast<void *>(p);
+  }
+
+  // Pop chunks until 'to' is the current one again. Standard sized chunks are
+  // kept for reuse; oversized ones go straight back to malloc.
+  void release(chunk *to) {
+    while (c != to) {
+      chunk *p = c->prev;
+      drop(c, free);
+      c = p;
+    }
+  }
+
+  // Pop adopted chunks until 'to' is the first one again
+  void disown(chunk *to) {
+    while (adopted != to) {
+      chunk *p = adopted->prev;
+      drop(adopted, free);
+      adopted = p;
+    }
+  }
+};
+
+thread_local arena the_arena;
+
+} // namespace
+
+void *lcrt_alloc(int64_t size, int64_t align) {
+  return the_arena.bump(size, align);
+}
+
+void lcrt_region_push() {
+  auto &a = the_arena;
+  a.regions.push_back(mark{a.c, a.cur, a.adopted});
+}
+
+void lcrt_region_pop() {
+  auto &a = the_arena;
+  mark m = a.regions.back();
+  a.regions.pop_back();
+  a.release(m.c);
+  a.disown(m.adopted);
+  a.cur = m.cur;
+  a.end = m.c ? m.c->end() : nullptr;
+}
+
+void lcrt_detach_begin() {
+  auto &a = the_arena;
+  a.regions.push_back(mark{a.c, a.cur, a.adopted});
+  a.c = a.adopted = nullptr;
+  a.cur = a.end = nullptr;
+}
+
+void *lcrt_detach_end() {
+  auto &a = the_arena;
+  // One chain of everything allocated or adopted since lcrt_detach_begin
+  chunk *chain = a.c;
+  if (!chain) {
+    chain = a.adopted;
+  } else if (a.adopted) {
+    chunk *last = chain;
+    while (last->prev)
+      last = last->prev;
+    last->prev = a.adopted;
+  }
+  mark m = a.regions.back();
+  a.regions.pop_back();
+  a.c = m.c;
+  a.cur = m.cur;
+  a.end = m.c ? m.c->end() : nullptr;
+  a.adopted = m.adopted;
+  return chain;
+}
+
+void lcrt_adopt(void *chunks) {
+  auto &a = the_arena;
+  auto *first = static_cast<chunk *>(chunks);
+  if (!first)
+    return;
+  chunk *last = first;
+  while (last->prev)
+    last = last->prev;
+  last->prev = a.adopted;
+  a.adopted = first;
+}
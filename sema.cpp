@@ -1,86 +1,722 @@
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <map>
+#include <set>
 #include <vector>
 #include <string>
+#include <unordered_map>
 #include "parse.h"
 #include "config.h"
 #include "err.h"
 #include "ast_visitor.h"
-static int parens     = 0;
-static int bad_offset = -1;
-
-static void tok_visitor(TOKEN* t)
+#include "iface.h"
+#include "astcache.h"
+#include "sema.h"
+void lex_sema()
 {
-  parens += t->t == TOK_LPAREN;
-  parens -= t->t == TOK_RPAREN;
-  if(t->t == TOK_RPAREN && parens < 0)
+  // Only kinds and offsets are needed, so scan those arrays directly
+  auto&                 ts = tokens();
+  std::vector<uint32_t> open;
+  for(size_t i = 0; i < ts.size(); i++)
   {
-    bad_offset = t->offset;
+    if(ts.kind[i] == TOK_LPAREN)
+      open.push_back(ts.offset[i]);
+    else if(ts.kind[i] != TOK_RPAREN)
+      continue;
+    else if(open.empty())
+      reg_msg(LC_MSG{"sema", "unbalanced parens: unexpected ')'", MSG_ERROR, (int)ts.offset[i]});
+    else
+      open.pop_back();
   }
+  for(int off : open)
+    reg_msg(LC_MSG{"sema", "unbalanced parens: '(' is never closed", MSG_ERROR, off});
 }
 
-void lex_sema()
+struct ARITH_INFO
+{
+  std::string n, alias;
+  ARITHOP     op;
+  int         minargs;
+};
+static std::vector<ARITH_INFO> ariths{
+#define ARITH_PROC(X, NAME, ALIAS, MINARGS) {NAME, ALIAS, X, MINARGS},
+#include "arith.def"
+#undef ARITH_PROC
+};
+struct LISTOP_INFO
+{
+  std::string n;
+  LISTOP      op;
+  int         nargs; // -1 if variadic
+};
+static std::vector<LISTOP_INFO> listops{
+#define LISTOP_PROC(X, NAME, NARGS) {NAME, X, NARGS},
+#include "listop.def"
+#undef LISTOP_PROC
+};
+
+struct CMPOP_INFO
+{
+  std::string n;
+  CMPOP       op;
+};
+static std::vector<CMPOP_INFO> cmpops{
+#define CMPOP_PROC(X, NAME, PRED) {NAME, X},
+#include "cmpop.def"
+#undef CMPOP_PROC
+};
+
+static bool is_lambda(std::shared_ptr<EXPR> e)
 {
-  tok_iter(tok_visitor);
-  if(parens < 0)
-    reg_msg(LC_MSG{"sema", "unbalanced parens", MSG_FATAL, bad_offset});
+  auto se = std::dynamic_pointer_cast<SEXPR>(e);
+  if(!se or se->exprs.empty())
+    return false;
+  auto id = std::dynamic_pointer_cast<ID>(se->exprs[0]);
+  return (id and id->n == "lambda") or std::dynamic_pointer_cast<BILAMBDA>(se->exprs[0]);
 }
 
-static std::vector<std::tuple<std::string, std::string>> repls{
-  {"+", "sum"},
-  {"-", "sub"},
-  {"*", "mul"},
-  {"/", "div"},
+static bool is_declare(std::shared_ptr<SEXPR> se)
+{
+  if(se->exprs.empty())
+    return false;
+  auto id = std::dynamic_pointer_cast<ID>(se->exprs[0]);
+  return id && id->n == "declare";
+}
+
+static std::vector<std::string> isa_names{
+#define ISA_PROC(X, NAME, FEATURE, BIT) NAME,
+#include "isa.def"
+#undef ISA_PROC
 };
+
+/**
+ * Handle a '(declare ...)' form found in a defun body, of the form:
+ *
+ *  '(' 'declare' { 'inline' | 'noinline' } [ 'multiversion' <isa>... ] ')'
+ *
+ * where each <isa> is 'default' or one of the instruction sets in isa.def.
+ * Returns false if the form is malformed.
+ */
+static bool parse_declare(std::shared_ptr<SEXPR> se, INLINEKIND& inl,
+                          std::vector<std::string>& versions)
+{
+  bool multiversion = false;
+  for(int i = 1; i < se->exprs.size(); i++)
+  {
+    auto d = std::dynamic_pointer_cast<ID>(se->exprs[i]);
+    if(!d)
+      return false;
+    if(multiversion)
+    {
+      if(std::find(isa_names.begin(), isa_names.end(), d->n) != isa_names.end())
+      {
+        if(std::find(versions.begin(), versions.end(), d->n) == versions.end())
+          versions.push_back(d->n);
+      }
+      else if(d->n != "default")
+        reg_msg(LC_MSG{"sema", "unknown instruction set '" + d->n + "' ignored",
+                       MSG_WARN, d->offset});
+    }
+    else if(d->n == "multiversion")
+      multiversion = true;
+    else if(d->n == "inline")
+      inl = INLINE_ALWAYS;
+    else if(d->n == "noinline")
+      inl = INLINE_NEVER;
+    else
+      reg_msg(LC_MSG{"sema", "unknown declaration '" + d->n + "' ignored", MSG_WARN,
+                     d->offset});
+  }
+  return true;
+}
+
+/**
+ * Macros, defined at top level by:
+ *
+ *  '(' 'defmacro' '(' <name> <param>... [ '&rest' <param> ] ')' <template> ')'
+ *
+ * A call expands to a copy of the template with each parameter replaced by
+ * the unevaluated argument; the rest parameter is spliced into the list it
+ * appears in. Expansions are not hygienic.
+ */
+struct MACRO
+{
+  std::vector<std::string> params;
+  std::string              rest;
+  std::shared_ptr<EXPR>    tmpl;
+};
+static std::map<std::string, MACRO> macros;
+
+/**
+ * Fully sema'd expansions by macro and argument structure, so a call that
+ * repeats an earlier one costs a copy. Source offsets are not part of the
+ * key: a copy is moved to its own call by shifting the nodes that came from
+ * the first call, the call itself at 'call' and its arguments within [lo, hi],
+ * while those from the template keep theirs.
+ */
+struct EXPANSION
+{
+  std::shared_ptr<EXPR> e;
+  int                   call, lo, hi;
+};
+static std::unordered_map<std::string, EXPANSION> expansions;
+
+// Range of source offsets the nodes of an expression were parsed from
+struct offset_span : public VISITOR
+{
+  int  lo = INT_MAX, hi = -1;
+  bool visitEXPR(std::shared_ptr<EXPR> e) override
+  {
+    if(e->offset >= 0)
+    {
+      lo = std::min(lo, e->offset);
+      hi = std::max(hi, e->offset);
+    }
+    return false;
+  }
+};
+
+struct offset_shift : public VISITOR
+{
+  const EXPANSION& from;
+  int              call, delta;
+  offset_shift(const EXPANSION& from, int call, int lo)
+      : from(from)
+      , call(call)
+      , delta(lo - from.lo)
+  {
+  }
+  bool visitEXPR(std::shared_ptr<EXPR> e) override
+  {
+    if(e->offset == from.call)
+      e->offset = call;
+    else if(e->offset >= from.lo and e->offset <= from.hi)
+      e->offset += delta;
+    return false;
+  }
+};
+
+static std::shared_ptr<offset_span> span_of(const std::vector<std::shared_ptr<EXPR>>& args)
+{
+  auto sp = std::make_shared<offset_span>();
+  for(auto a : args)
+    expr_visit(a, sp);
+  return sp;
+}
+
+// Expansions being rewritten inside one another
+static int expand_depth = 0;
+static constexpr int max_expand_depth = 64;
+// Set when the innermost expansion hits the limit, until the outermost one
+// reports it
+static bool too_deep = false;
+
+static bool is_defmacro(std::shared_ptr<SEXPR> se)
+{
+  if(se->exprs.empty())
+    return false;
+  auto id = std::dynamic_pointer_cast<ID>(se->exprs[0]);
+  return id && id->n == "defmacro";
+}
+
+static bool define_macro(std::shared_ptr<SEXPR> se)
+{
+  auto fail = [&](std::string msg) {
+    reg_msg(LC_MSG{"sema", msg, MSG_ERROR, se->offset});
+    return false;
+  };
+  if(se->exprs.size() != 3)
+    return fail("defmacro requires a prototype and one template");
+  auto ps = std::dynamic_pointer_cast<SEXPR>(se->exprs[1]);
+  if(!ps or ps->exprs.empty())
+    return fail("defmacro prototype must be a sexpr naming the macro");
+  std::vector<std::string> names;
+  for(auto e : ps->exprs)
+  {
+    auto id = std::dynamic_pointer_cast<ID>(e);
+    if(!id)
+      return fail("prototype sexpr must have all ID element types");
+    names.push_back(id->n);
+  }
+
+  MACRO m;
+  for(int i = 1; i < names.size(); i++)
+  {
+    if(names[i] != "&rest")
+      m.params.push_back(names[i]);
+    else if(i + 2 != names.size())
+      return fail("&rest must be followed by exactly one parameter");
+    else
+      m.rest = names[++i];
+  }
+  m.tmpl            = se->exprs[2];
+  macros[names[0]] = m;
+  // Cached expansions may have been made without this definition
+  expansions.clear();
+  return true;
+}
+
+// Copy of t with the parameters replaced by args
+static std::shared_ptr<EXPR> substitute(std::shared_ptr<EXPR>                      t,
+                                        const std::map<std::string, std::shared_ptr<EXPR>>& args,
+                                        const MACRO& m, const std::vector<std::shared_ptr<EXPR>>& rest)
+{
+  if(auto se = std::dynamic_pointer_cast<SEXPR>(t))
+  {
+    auto copy = std::make_shared<SEXPR>(se->offset);
+    for(auto e : se->exprs)
+    {
+      auto id = std::dynamic_pointer_cast<ID>(e);
+      if(id and !m.rest.empty() and id->n == m.rest)
+        for(auto r : rest)
+          copy->exprs.push_back(ast_clone(r));
+      else
+        copy->exprs.push_back(substitute(e, args, m, rest));
+    }
+    return copy;
+  }
+  if(auto id = std::dynamic_pointer_cast<ID>(t))
+    if(auto a = args.find(id->n); a != args.end())
+      return ast_clone(a->second);
+  return ast_clone(t);
+}
+
+// Report an error at se and give up on the top-level form being rewritten
+#define SEMA_CHECK(cond, msg) \
+  if(!(cond))                 \
+  {                           \
+    fail(se, msg);            \
+    return false;             \
+  }
+
 struct replace_builtins : public VISITOR
 {
+  bool failed = false;
+  void fail(std::shared_ptr<SEXPR> se, std::string msg)
+  {
+    reg_msg(LC_MSG{"sema", msg, MSG_ERROR, se->offset});
+    failed = true;
+  }
+  bool expand(std::shared_ptr<SEXPR> se, const std::string& name, const MACRO& m)
+  {
+    std::vector<std::shared_ptr<EXPR>> args(se->exprs.begin() + 1, se->exprs.end());
+    SEMA_CHECK(args.size() == m.params.size() or (!m.rest.empty() and args.size() > m.params.size()),
+               "macro " + name + " expects " + (m.rest.empty() ? "" : "at least ") +
+                   std::to_string(m.params.size()) + " arguments");
+    // Reported once the outermost expansion gives up, at the call
+    if(expand_depth >= max_expand_depth)
+    {
+      too_deep = failed = true;
+      return false;
+    }
+
+    std::string key = name + '\0';
+    bool        cacheable = true;
+    for(auto a : args)
+      cacheable = cacheable and ast_key(a, key);
+
+    auto                  sp = span_of(args);
+    std::shared_ptr<EXPR> e;
+    if(auto hit = expansions.find(key); cacheable and hit != expansions.end())
+    {
+      if(dump("macro"))
+        printf("reusing expansion of %s\n", name.c_str());
+      auto& x = hit->second;
+      e       = ast_clone(x.e);
+      expr_visit(e, std::make_shared<offset_shift>(x, se->offset, sp->lo));
+    }
+    else
+    {
+      if(dump("macro"))
+        printf("expanding %s\n", name.c_str());
+      std::map<std::string, std::shared_ptr<EXPR>> bound;
+      for(int i = 0; i < m.params.size(); i++)
+        bound[m.params[i]] = args[i];
+      std::vector<std::shared_ptr<EXPR>> rest(args.begin() + m.params.size(), args.end());
+      e = substitute(m.tmpl, bound, m, rest);
+
+      if(auto es = std::dynamic_pointer_cast<SEXPR>(e))
+      {
+        expand_depth++;
+        bool ok = sema_sexpr(es);
+        expand_depth--;
+        // Point at the call once, not at every level of a nested expansion
+        if(!ok and expand_depth > 0)
+          failed = true;
+        if(failed)
+          return false;
+        if(too_deep)
+        {
+          too_deep = false;
+          fail(se, "expansion of macro " + name + " nests too deeply");
+          return false;
+        }
+        SEMA_CHECK(ok, "in expansion of macro " + name);
+      }
+      if(cacheable)
+        if(auto c = ast_clone(e))
+          expansions[key] = EXPANSION{c, se->offset, sp->lo, sp->hi};
+    }
+
+    if(auto es = std::dynamic_pointer_cast<SEXPR>(e))
+      se->exprs = es->exprs;
+    else if(std::dynamic_pointer_cast<ID>(e))
+      // (x) would be a call; a let without bindings just yields x
+      se->exprs = {std::make_shared<BILET>(std::vector<std::string>{},
+                                           std::vector<std::shared_ptr<EXPR>>{},
+                                           std::vector{e}, se->offset)};
+    else
+      se->exprs = {e};
+    return true;
+  }
   bool visitSEXPR(std::shared_ptr<SEXPR> se) override
   {
-    if(se->exprs.empty())
+    if(failed or se->exprs.empty())
       return false;
     else if(auto id = std::dynamic_pointer_cast<ID>(se->exprs[0]))
     {
-      if(id->n == "sum" or id->n == "+")
+      if(auto ar = std::find_if(ariths.begin(), ariths.end(),
+                                [&](auto& a) { return a.n == id->n or a.alias == id->n; });
+         ar != ariths.end())
       {
-        se->exprs[0] = std::make_shared<BISUM>(se->exprs[1], se->exprs[2]);
+        std::vector<std::shared_ptr<EXPR>> args(se->exprs.begin() + 1, se->exprs.end());
+        SEMA_CHECK(args.size() >= ar->minargs, id->n + " requires at least one operand");
+        se->exprs[0] = std::make_shared<BIARITH>(ar->op, args, se->offset);
         se->exprs.resize(1);
         return true;
       }
-      else if(id->n == "mul" or id->n == "*")
+      else if(id->n == "defvar")
       {
-        se->exprs[0] = std::make_shared<BIMUL>(se->exprs[1], se->exprs[2]);
+        SEMA_CHECK(se->exprs.size() >= 3, "defvar called with fewer than 2 arguments");
+        auto id2 = std::dynamic_pointer_cast<ID>(se->exprs[1]);
+        SEMA_CHECK(id2, "defvar called with non-id as first parameter");
+        se->exprs[0] = std::make_shared<BIDEFVAR>(id2->n, se->exprs[2], se->offset);
         se->exprs.resize(1);
         return true;
       }
-      else if(id->n == "defvar")
+      else if(id->n == "parallel-for")
       {
-        if(se->exprs.size() < 3)
-          reg_msg(LC_MSG{"sema", "defvar called with fewer than 2 arguments", MSG_FATAL});
-        auto id2 = std::dynamic_pointer_cast<ID>(se->exprs[1]);
-        if(!id2)
-          reg_msg(LC_MSG{"sema", "defvar called with non-id as first parameter", MSG_FATAL});
-        se->exprs[0] = std::make_shared<BIDEFVAR>(id2->n, se->exprs[2]);
+        SEMA_CHECK(se->exprs.size() >= 5, "parallel-for requires a variable, a range and a body");
+        auto var = std::dynamic_pointer_cast<ID>(se->exprs[1]);
+        SEMA_CHECK(var, "parallel-for variable must be an id");
+        std::vector<std::shared_ptr<EXPR>> body(se->exprs.begin() + 4, se->exprs.end());
+        se->exprs[0] = std::make_shared<BIPARFOR>(var->n, se->exprs[2], se->exprs[3], body,
+                                                  se->offset);
         se->exprs.resize(1);
         return true;
       }
-      else if(id->n == "defun")
+      else if(id->n == "spawn")
       {
-        LCASSERT_P("sema", "defun requires a prototype and a body", se->exprs.size() >= 3);
+        SEMA_CHECK(se->exprs.size() == 2, "spawn takes exactly one expression");
+        se->exprs[0] = std::make_shared<BISPAWN>(se->exprs[1], se->offset);
+        se->exprs.resize(1);
+        return true;
+      }
+      else if(id->n == "await")
+      {
+        SEMA_CHECK(se->exprs.size() == 2, "await takes exactly one future");
+        se->exprs[0] = std::make_shared<BIAWAIT>(se->exprs[1], se->offset);
+        se->exprs.resize(1);
+        return true;
+      }
+      else if(id->n == "with-region")
+      {
+        SEMA_CHECK(se->exprs.size() >= 2, "with-region requires a body");
+        std::vector<std::shared_ptr<EXPR>> body(se->exprs.begin() + 1, se->exprs.end());
+        se->exprs[0] = std::make_shared<BIREGION>(body, se->offset);
+        se->exprs.resize(1);
+        return true;
+      }
+      else if(id->n == "let")
+      {
+        SEMA_CHECK(se->exprs.size() >= 3, "let requires bindings and a body");
+        auto bs = std::dynamic_pointer_cast<SEXPR>(se->exprs[1]);
+        SEMA_CHECK(bs, "let bindings must be a sexpr");
+        std::vector<std::string>           names;
+        std::vector<std::shared_ptr<EXPR>> inits;
+        for(auto b : bs->exprs)
+        {
+          auto pair = std::dynamic_pointer_cast<SEXPR>(b);
+          SEMA_CHECK(pair and pair->exprs.size() == 2, "let binding must be (<id> <expr>)");
+          auto n = std::dynamic_pointer_cast<ID>(pair->exprs[0]);
+          SEMA_CHECK(n, "let binding must start with an id");
+          SEMA_CHECK(std::find(names.begin(), names.end(), n->n) == names.end(),
+                     "'" + n->n + "' is bound twice by the same let");
+          names.push_back(n->n);
+          inits.push_back(pair->exprs[1]);
+        }
+        std::vector<std::shared_ptr<EXPR>> body(se->exprs.begin() + 2, se->exprs.end());
+        se->exprs[0] = std::make_shared<BILET>(names, inits, body, se->offset);
+        se->exprs.resize(1);
+        return true;
+      }
+      else if(id->n == "lambda")
+      {
+        SEMA_CHECK(se->exprs.size() >= 3, "lambda requires parameters and a body");
+        auto ps = std::dynamic_pointer_cast<SEXPR>(se->exprs[1]);
+        SEMA_CHECK(ps, "lambda parameters must be a sexpr");
+        std::vector<std::string> params;
+        for(auto e : ps->exprs)
+        {
+          auto p = std::dynamic_pointer_cast<ID>(e);
+          SEMA_CHECK(p, "lambda parameters must be ids");
+          params.push_back(p->n);
+        }
+        std::vector<std::shared_ptr<EXPR>> body(se->exprs.begin() + 2, se->exprs.end());
+        se->exprs[0] = std::make_shared<BILAMBDA>(params, body, se->offset);
+        se->exprs.resize(1);
+        return true;
+      }
+      else if(id->n == "funcall")
+      {
+        SEMA_CHECK(se->exprs.size() >= 2, "funcall requires a function");
+        std::vector<std::shared_ptr<EXPR>> args(se->exprs.begin() + 2, se->exprs.end());
+        se->exprs[0] = std::make_shared<BIFUNCALL>(se->exprs[1], args, se->offset);
+        se->exprs.resize(1);
+        return true;
+      }
+      else if(id->n == "function")
+      {
+        auto n = se->exprs.size() == 2 ? std::dynamic_pointer_cast<ID>(se->exprs[1]) : nullptr;
+        SEMA_CHECK(n, "function takes the name of a defun");
+        se->exprs[0] = std::make_shared<BIFUNCTION>(n->n, se->offset);
+        se->exprs.resize(1);
+        return true;
+      }
+      else if(id->n == "mapcar" or id->n == "fold")
+      {
+        bool   mapcar = id->n == "mapcar";
+        size_t nargs  = mapcar ? 3 : 4;
+        SEMA_CHECK(se->exprs.size() == nargs,
+                   mapcar ? "mapcar takes a function and a list"
+                          : "fold takes a function, an initial value and a list");
+        std::vector<std::shared_ptr<EXPR>> args(se->exprs.begin() + 2, se->exprs.end());
+        se->exprs[0] = std::make_shared<BIHOF>(mapcar ? HOF_MAPCAR : HOF_FOLD, se->exprs[1],
+                                               args, se->offset);
+        se->exprs.resize(1);
+        return true;
+      }
+      else if(id->n == "setq")
+      {
+        SEMA_CHECK(se->exprs.size() == 3, "setq takes an id and a value");
+        auto n = std::dynamic_pointer_cast<ID>(se->exprs[1]);
+        SEMA_CHECK(n, "setq called with non-id as first parameter");
+        se->exprs[0] = std::make_shared<BISETQ>(n->n, se->exprs[2], se->offset);
+        se->exprs.resize(1);
+        return true;
+      }
+      else if(id->n == "loop")
+      {
+        SEMA_CHECK(se->exprs.size() >= 4, "loop requires a variable, a count and a body");
+        auto var = std::dynamic_pointer_cast<ID>(se->exprs[1]);
+        SEMA_CHECK(var, "loop variable must be an id");
+        std::vector<std::shared_ptr<EXPR>> body(se->exprs.begin() + 3, se->exprs.end());
+        se->exprs[0] = std::make_shared<BILOOP>(var->n, se->exprs[2], body, se->offset);
+        se->exprs.resize(1);
+        return true;
+      }
+      else if(auto co = std::find_if(cmpops.begin(), cmpops.end(),
+                                     [&](auto& c) { return c.n == id->n; });
+              co != cmpops.end())
+      {
+        SEMA_CHECK(se->exprs.size() == 3, co->n + " requires two operands");
+        se->exprs[0] = std::make_shared<BICMP>(co->op, se->exprs[1], se->exprs[2], se->offset);
+        se->exprs.resize(1);
+        return true;
+      }
+      else if(id->n == "if")
+      {
+        SEMA_CHECK(se->exprs.size() == 3 or se->exprs.size() == 4,
+                   "if requires a test, a then expression and optionally an else expression");
+        std::vector<std::shared_ptr<EXPR>> els;
+        if(se->exprs.size() == 4)
+          els.push_back(se->exprs[3]);
+        se->exprs[0] = std::make_shared<BIIF>(se->exprs[1], std::vector{se->exprs[2]}, els,
+                                              se->offset);
+        se->exprs.resize(1);
+        return true;
+      }
+      else if(id->n == "when")
+      {
+        SEMA_CHECK(se->exprs.size() >= 3, "when requires a test and a body");
+        std::vector<std::shared_ptr<EXPR>> body(se->exprs.begin() + 2, se->exprs.end());
+        se->exprs[0] = std::make_shared<BIIF>(se->exprs[1], body,
+                                              std::vector<std::shared_ptr<EXPR>>{}, se->offset);
+        se->exprs.resize(1);
+        return true;
+      }
+      else if(id->n == "cond")
+      {
+        SEMA_CHECK(se->exprs.size() >= 2, "cond requires at least one clause");
+        // Build the chain of ifs from the last clause up
+        std::vector<std::shared_ptr<EXPR>> rest;
+        for(int i = se->exprs.size() - 1; i >= 1; i--)
+        {
+          auto clause = std::dynamic_pointer_cast<SEXPR>(se->exprs[i]);
+          SEMA_CHECK(clause and clause->exprs.size() >= 2, "cond clause must be (<test> <body>...)");
+          std::vector<std::shared_ptr<EXPR>> body(clause->exprs.begin() + 1, clause->exprs.end());
+          auto test = std::dynamic_pointer_cast<ID>(clause->exprs[0]);
+          if(test and test->n == "else")
+          {
+            SEMA_CHECK(i == se->exprs.size() - 1, "else must be the last cond clause");
+            SEMA_CHECK(i > 1, "cond requires a clause with a test");
+            rest = body;
+            continue;
+          }
+          rest = {std::make_shared<BIIF>(clause->exprs[0], body, rest, clause->offset)};
+        }
+        se->exprs[0] = rest[0];
+        se->exprs.resize(1);
+        return true;
+      }
+      else if(id->n == "case")
+      {
+        SEMA_CHECK(se->exprs.size() >= 3, "case requires a key and at least one clause");
+        std::vector<std::vector<int64_t>>               keys;
+        std::vector<std::vector<std::shared_ptr<EXPR>>> bodies;
+        std::vector<std::shared_ptr<EXPR>>              otherwise;
+        std::set<int64_t>                               seen;
+        for(int i = 2; i < se->exprs.size(); i++)
+        {
+          auto clause = std::dynamic_pointer_cast<SEXPR>(se->exprs[i]);
+          SEMA_CHECK(clause and clause->exprs.size() >= 2, "case clause must be (<keys> <body>...)");
+          std::vector<std::shared_ptr<EXPR>> body(clause->exprs.begin() + 1, clause->exprs.end());
+          auto head = std::dynamic_pointer_cast<ID>(clause->exprs[0]);
+          if(head and head->n == "otherwise")
+          {
+            SEMA_CHECK(i == se->exprs.size() - 1, "otherwise must be the last case clause");
+            otherwise = body;
+            continue;
+          }
+          std::vector<std::shared_ptr<EXPR>> ks{clause->exprs[0]};
+          if(auto l = std::dynamic_pointer_cast<SEXPR>(clause->exprs[0]))
+            ks = l->exprs;
+          SEMA_CHECK(!ks.empty(), "case clause needs at least one key");
+          keys.emplace_back();
+          for(auto k : ks)
+          {
+            // Only integers that are exact as doubles can ever match
+            auto n = std::dynamic_pointer_cast<NUM>(k);
+            SEMA_CHECK(n and std::abs(n->v) <= 0x1p53 and n->v == (int64_t)n->v,
+                       "case keys must be integer literals");
+            SEMA_CHECK(seen.insert((int64_t)n->v).second,
+                       "duplicate case key " + std::to_string((int64_t)n->v));
+            keys.back().push_back((int64_t)n->v);
+          }
+          bodies.push_back(body);
+        }
+        se->exprs[0] = std::make_shared<BICASE>(se->exprs[1], keys, bodies, otherwise, se->offset);
+        se->exprs.resize(1);
+        return true;
+      }
+      else if(id->n == "comptime")
+      {
+        SEMA_CHECK(se->exprs.size() == 2, "comptime takes exactly one expression");
+        se->exprs[0] = std::make_shared<BICOMPTIME>(se->exprs[1], se->offset);
+        se->exprs.resize(1);
+        return true;
+      }
+      else if(id->n == "likely" or id->n == "unlikely")
+      {
+        SEMA_CHECK(se->exprs.size() == 2, id->n + " takes exactly one expression");
+        se->exprs[0] = std::make_shared<BILIKELY>(id->n == "likely", se->exprs[1], se->offset);
+        se->exprs.resize(1);
+        return true;
+      }
+      else if(auto lo = std::find_if(listops.begin(), listops.end(),
+                                     [&](auto& l) { return l.n == id->n; });
+              lo != listops.end())
+      {
+        std::vector<std::shared_ptr<EXPR>> args(se->exprs.begin() + 1, se->exprs.end());
+        SEMA_CHECK(lo->nargs < 0 || args.size() == lo->nargs,
+                   lo->n + " expects " + std::to_string(lo->nargs) + " arguments");
+        se->exprs[0] = std::make_shared<BILISTOP>(lo->op, args, se->offset);
+        se->exprs.resize(1);
+        return true;
+      }
+      else if(id->n == "import")
+      {
+        SEMA_CHECK(se->exprs.size() >= 2, "import requires a module or a prototype");
+        std::vector<std::string>                modules;
+        std::vector<std::shared_ptr<PROTOTYPE>> protos, iface;
+        for(int i = 1; i < se->exprs.size(); i++)
+        {
+          if(auto mod = std::dynamic_pointer_cast<ID>(se->exprs[i]))
+          {
+            SEMA_CHECK(read_interface(mod->n, iface),
+                       "could not read interface file " + mod->n + ".lci");
+            modules.push_back(mod->n);
+            continue;
+          }
+          auto ps = std::dynamic_pointer_cast<SEXPR>(se->exprs[i]);
+          SEMA_CHECK(ps and !ps->exprs.empty(), "import expects a module id or a prototype sexpr");
+          for(auto e : ps->exprs)
+            SEMA_CHECK(std::dynamic_pointer_cast<ID>(e),
+                       "prototype sexpr must have all ID element types");
+          protos.push_back(std::make_shared<PROTOTYPE>(ps));
+        }
+        se->exprs[0] = std::make_shared<BIIMPORT>(modules, protos, se->offset);
+        se->exprs.resize(1);
+        return true;
+      }
+      else if(id->n == "export")
+      {
+        std::vector<std::string> names;
+        for(int i = 1; i < se->exprs.size(); i++)
+        {
+          auto n = std::dynamic_pointer_cast<ID>(se->exprs[i]);
+          SEMA_CHECK(n, "export expects function names");
+          names.push_back(n->n);
+        }
+        se->exprs[0] = std::make_shared<BIEXPORT>(names, se->offset);
+        se->exprs.resize(1);
+        return true;
+      }
+      else if(id->n == "defun" or id->n == "defun-memo")
+      {
+        SEMA_CHECK(se->exprs.size() >= 3, "defun requires a prototype and a body");
 
         auto ps = std::dynamic_pointer_cast<SEXPR>(se->exprs[1]);
-        LCASSERT_P("sema", "defun prototype must be a sexpr", ps);
+        SEMA_CHECK(ps, "defun prototype must be a sexpr");
+        SEMA_CHECK(!ps->exprs.empty(), "defun prototype must name the function");
+        for(auto e : ps->exprs)
+          SEMA_CHECK(std::dynamic_pointer_cast<ID>(e),
+                     "prototype sexpr must have all ID element types");
         auto proto = std::make_shared<PROTOTYPE>(ps);
 
         std::vector<std::shared_ptr<SEXPR>> body;
+        INLINEKIND                          inl = INLINE_DEFAULT;
+        std::vector<std::string>            versions;
         for(int i = 2; i < se->exprs.size(); i++)
         {
           body.push_back(std::dynamic_pointer_cast<SEXPR>(se->exprs[i]));
-          LCASSERT_P("sema", "defun body must be a sexpr", body.back());
+          SEMA_CHECK(body.back(), "defun body must be a sexpr");
+          if(is_declare(body.back()))
+          {
+            SEMA_CHECK(parse_declare(body.back(), inl, versions),
+                       "declare expects identifiers");
+            body.pop_back();
+          }
         }
+        SEMA_CHECK(!body.empty(), "defun requires a body");
 
-        auto f       = std::make_shared<USERFUNC>(proto, body);
+        auto f       = std::make_shared<USERFUNC>(proto, body, se->offset);
+        f->inl       = inl;
+        f->memo      = id->n == "defun-memo";
+        f->versions  = versions;
         se->exprs[0] = f;
         se->exprs.resize(1);
         return true;
       }
+      else if(id->n == "defmacro")
+      {
+        SEMA_CHECK(false, "defmacro is only allowed at top level");
+      }
+      else if(auto m = macros.find(id->n); m != macros.end())
+      {
+        return expand(se, id->n, m->second);
+      }
       else
       {
         auto                               calleeid = std::dynamic_pointer_cast<ID>(se->exprs[0]);
@@ -88,11 +724,18 @@ struct replace_builtins : public VISITOR
         std::vector<std::shared_ptr<EXPR>> args;
         for(int i = 1; i < se->exprs.size(); i++)
           args.push_back(se->exprs[i]);
-        se->exprs[0] = std::make_shared<CALLEXPR>(callee, args);
+        se->exprs[0] = std::make_shared<CALLEXPR>(callee, args, se->offset);
         se->exprs.resize(1);
         return true;
       }
     }
+    else if(is_lambda(se->exprs[0]))
+    {
+      // ((lambda (x...) body...) args...)
+      std::vector<std::shared_ptr<EXPR>> args(se->exprs.begin() + 1, se->exprs.end());
+      se->exprs = {std::make_shared<BIFUNCALL>(se->exprs[0], args, se->offset)};
+      return true;
+    }
     return false;
   }
   bool visitID(std::shared_ptr<ID> id) override
@@ -101,15 +744,30 @@ struct replace_builtins : public VISITOR
   }
 };
 
+bool sema_sexpr(std::shared_ptr<SEXPR> se)
+{
+  // Keep rewriting until nothing has changed
+  auto v = std::make_shared<replace_builtins>();
+  while(expr_visit(se, v))
+    ;
+  return !v->failed;
+}
+
 void sema_builtins(std::shared_ptr<MODULE> m)
 {
-again:
-  bool anychanged = false;
-  for(int i = 0; i < m->sexprs.size(); i++)
+  // Forms sema fails on are dropped once their errors are reported, so that
+  // the rest of the module is still checked
+  for(int i = 0; i < m->sexprs.size();)
   {
-    anychanged = anychanged or expr_visit(m->sexprs[i], std::make_shared<replace_builtins>());
+    // Macros only exist during sema, so their definitions are dropped too
+    if(is_defmacro(m->sexprs[i]))
+    {
+      define_macro(m->sexprs[i]);
+      m->sexprs.erase(m->sexprs.begin() + i);
+    }
+    else if(sema_sexpr(m->sexprs[i]))
+      i++;
+    else
+      m->sexprs.erase(m->sexprs.begin() + i);
   }
-  // Continue visiting until nothing has changed
-  if(anychanged)
-    goto again;
 }
@@ -2,3 +2,4 @@
 #include "parse.h"
 void lex_sema();
 void sema_builtins(std::shared_ptr<MODULE> m);
+bool sema_sexpr(std::shared_ptr<SEXPR> se);
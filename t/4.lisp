@@ -8,7 +8,7 @@
           ))
 
 ; Check that binops like these are replaced with the bulitins
-(let 
-  (a (- 1 2 3))
-  (b (* 4 5 6))
-  (c (/ 1 2)))
+(let ((a (- 1 2 3))
+      (b (* 4 5 6))
+      (c (/ 1 2)))
+  (+ a b))
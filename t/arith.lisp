@@ -0,0 +1,22 @@
+; Arithmetic takes any number of operands. Long operand lists are added up as
+; balanced trees: the sum below is ((a + b) + (c + d)) + ((e + f) + (g + h)),
+; a chain of three additions rather than seven. Division stays a chain from
+; left to right, so (/ 1e300 1e200 1e200) never forms 1e400.
+(defun (sum8 a b c d e f g h)
+  (+ a b c d e f g h))
+
+(defun (spread a b c)
+  (- (max a b c) (min a b c)))
+
+(printf "sum8 %f, spread %f" (sum8 1 2 3 4 5 6 7 8) (spread 4 -2 7))
+(newline)
+(printf "(+) %f, (*) %f, (- 5) %f, (/ 4) %f"
+        (+) (*) (- 5) (/ 4))
+(newline)
+(printf "(- 10 1 2 3) %f, (/ 120 2 3 4) %f, (sum 1 2 3) %f, (mul 2 3 4) %f"
+        (- 10 1 2 3) (/ 120 2 3 4) (sum 1 2 3) (mul 2 3 4))
+(newline)
+(printf "(/ 1e300 1e200 1e200) %g, (/ 1e-300 1e-200 1e-200) %g"
+        (/ 1e300 1e200 1e200) (/ 1e-300 1e-200 1e-200))
+(newline)
+(0)
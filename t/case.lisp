@@ -0,0 +1,32 @@
+; Dense keys, dispatched through a jump table
+(defun (opcode-cost op)
+  (case op
+    (0 1)
+    (1 1)
+    ((2 3) 4)
+    (4 10)
+    (5 2)
+    (6 3)
+    (otherwise 0)))
+
+; Sparse keys, dispatched by binary search
+(defun (http-class code)
+  (case code
+    (200 2)
+    (301 3)
+    ((404 410) 4)
+    (-1 -1)
+    (otherwise 5)))
+
+(defun (total-cost n)
+  (let ((sum 0))
+    (loop i n
+          (setq sum (+ sum (opcode-cost i))))
+    sum))
+
+(printf "total cost %f, 2.5 costs %f" (total-cost 9) (opcode-cost 2.5))
+(puts "")
+(printf "classes %f %f %f %f" (http-class 200) (http-class 410) (http-class -1) (http-class 500))
+(puts "")
+(puts (case 3 ((1 2) "low") (3 "three") (otherwise "other")))
+(0)
@@ -0,0 +1,22 @@
+(defun (fib n)
+  (if (< n 2)
+      n
+      (+ (fib (+ n -1)) (fib (+ n -2)))))
+
+; Pure initializers, calls to defuns included, are computed by the compiler
+(defvar fib25 (fib 25))
+(defvar scaled (* fib25 (+ 1 fib25)))
+
+; Printing is a side effect, so this one still runs in main
+(defvar noisy (let ((x (fib 10)))
+                (printf "computing noisy at run time")
+                (puts "")
+                x))
+
+(defun (table-size)
+  (comptime (* (fib 12) 4)))
+
+(printf "fib 25 is %f, scaled %f, noisy %f, table %f"
+        fib25 scaled noisy (table-size))
+(puts "")
+(0)
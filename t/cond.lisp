@@ -0,0 +1,41 @@
+(defun (sign x)
+  (cond ((< x 0) -1)
+        ((= x 0) 0)
+        (else 1)))
+
+(defun (clamp x lo hi)
+  (if (unlikely (< x lo))
+      lo
+      (if (> x hi) hi x)))
+
+(defun (parity n)
+  (let ((p 0))
+    (loop i n
+          (setq p (if p 0 1)))
+    p))
+
+(defun (half n)
+  (let ((h 0))
+    (loop i n
+          (when (<= (* 2 i) n)
+            (setq h i)))
+    h))
+
+; Collatz steps, with the common case marked
+(defun (collatz n)
+  (let ((steps 0))
+    (loop i 1000
+          (when (likely (/= n 1))
+            (setq steps (+ steps 1))
+            (if (= (parity n) 0)
+                (setq n (half n))
+                (setq n (+ (* 3 n) 1)))))
+    steps))
+
+(printf "signs %f %f %f" (sign -5) (sign 0) (sign 7))
+(puts "")
+(printf "clamp %f %f %f" (clamp -1 0 10) (clamp 5 0 10) (clamp 11 0 10))
+(puts "")
+(printf "collatz 27 takes %f steps, 3 >= 3 is %f" (collatz 27) (>= 3 3))
+(puts "")
+(0)
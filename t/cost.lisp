@@ -0,0 +1,25 @@
+; Run with -freport-function-cost to see where compile time goes, or
+; -freport-function-cost=cost.csv for a spreadsheet. Clones of a defun, like
+; the specialization of poly for x = 2 or the body of the memoized fib, are
+; charged to the defun itself.
+(defun (poly x)
+  (let ((acc 0))
+    (loop i 8
+      (setq acc (+ (* acc x) i)))
+    acc))
+
+(defun-memo (fib n)
+  (if (< n 2)
+    n
+    (+ (fib (+ n -1)) (fib (+ n -2)))))
+
+(defun (grade s)
+  (cond ((>= s 90) 4)
+        ((>= s 80) 3)
+        ((>= s 70) 2)
+        ((>= s 60) 1)
+        (else 0)))
+
+(printf "poly %f fib %f grade %f" (poly 2) (fib 30) (grade 85))
+(newline)
+(0)
@@ -0,0 +1,19 @@
+; Every diagnostic in this file is reported in one run, each with its
+; line:col and a caret under the offending form.
+
+(defun (square x) (* x x))
+
+(defvar a (square 3))
+(defvar b (square 1 2))
+(defvar c (cube a))
+(defvar d (+ a undefined-name))
+(defvar e (let ((n 3)) (n 1)))
+(defvar f (let ((add (lambda (x y) (+ x y)))) (add 1)))
+; The second call reuses the first one's expansion, and is still reported at
+; its own line
+(defmacro (inc x) (+ x 1))
+(defvar g (inc nope))
+(defvar h (inc nope))
+(parallel-for i 0)
+(+ a b))
+(0)
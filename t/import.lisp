@@ -0,0 +1,7 @@
+; Uses functions from t/mathlib.lisp through its interface file, and an
+; external function declared by its prototype
+(import mathlib (sin a))
+
+(printf "poly of 3 4 is %f, sin of 0 is %f" (poly 3 4) (sin 0))
+(puts "")
+(0)
@@ -0,0 +1,20 @@
+; Small helpers are inlined by lc's own inliner
+(defun (plus5 a)
+  (+ a 5))
+
+; Forced inline, regardless of -finline-threshold
+(defun (square a)
+  (declare inline)
+  (* a a))
+
+; Never inlined, even though it is tiny
+(defun (times a b)
+  (declare noinline)
+  (* a b))
+
+(defun (poly a)
+  (+ (square a) (plus5 (times a 2))))
+
+(printf "poly of 3 is %f" (poly 3))
+(puts "")
+(0)
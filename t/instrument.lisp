@@ -0,0 +1,16 @@
+; Run with -finstrument-functions=counts or -finstrument-functions=cycles to
+; get a per-defun report when the program finishes.
+(defun (square a)
+  (declare noinline)
+  (* a a))
+
+(defun-memo (cube a)
+  (* a (square a)))
+
+(parallel-for i 0 1000
+  (cube (square i)))
+
+(printf "cube of 3 is %f" (cube 3))
+(puts "")
+
+(0)
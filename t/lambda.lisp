@@ -0,0 +1,40 @@
+; A closure only ever called inside the let that binds it cannot outlive it,
+; and is made on the stack
+(defun (scale-sum a b k)
+  (let ((scale (lambda (x) (* x k))))
+    (+ (funcall scale a) (scale b))))
+
+; A returned closure escapes and is made in the current region
+(defun (adder n)
+  (lambda (x) (+ x n)))
+
+(defun (sq x)
+  (* x x))
+
+(defvar xs (list 1 2 3 4 5))
+
+(printf "scale-sum %f" (scale-sum 1 2 10))
+(newline)
+(let ((add5 (adder 5)))
+  (printf "add5 %f" (funcall add5 37)))
+(newline)
+; A lambda written in place becomes the body of the loop
+(printf "sum of squares %f"
+        (fold (lambda (acc x) (+ acc (* x x))) 0 xs))
+(newline)
+(defvar squares (mapcar (function sq) xs))
+(printf "squares %f %f %f, length %f"
+        (car squares) (nth 2 squares) (nth 4 squares) (length squares))
+(newline)
+(printf "immediate %f, mapcar of nil has length %f"
+        ((lambda (x y) (- x y)) 10 3) (length (mapcar sq nil)))
+(newline)
+; A closure captured by another lambda or by a spawn may outlive the let, so
+; it is not made on the stack
+(defun (nested k)
+  (let ((g (lambda (a) (* a k))))
+    (+ (fold (lambda (acc x) (+ acc (funcall g x))) 0 (mapcar g (list 1 2 3)))
+       (await (spawn (funcall g 10))))))
+(printf "nested %f, inline %f" (nested 2)
+        (let ((g (lambda (a) a))) (funcall (lambda (x) x) 1)))
+(newline)
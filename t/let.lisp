@@ -0,0 +1,23 @@
+; Sum of the first n squares with an accumulator instead of recursion
+(defun (sum-squares n)
+  (let ((acc 0))
+    (loop i n
+          (setq acc (+ acc (* i i))))
+    acc))
+
+; Arguments can be assigned too
+(defun (bump x)
+  (setq x (+ x 1))
+  (let ((x (* x 10)))
+    (setq x (+ x 1)))
+  (+ x 0))
+
+(let ((a 2)
+      (b 3))
+  (let ((a b)
+        (b a))
+    (printf "swapped %f %f" a b)
+    (puts ""))
+  (printf "sum of squares below 10 is %f, bump 4 is %f" (sum-squares 10) (bump 4))
+  (puts ""))
+(0)
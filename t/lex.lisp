@@ -0,0 +1,8 @@
+; Parens can be glued to atoms, and numbers may be negative or fractional
+(defvar half 0.5)(defvar neg -3)
+(defvar big 1e3)
+(printf "half=%f neg=%f big=%f" half neg big)
+(puts "")
+(printf "parens (stay) inside strings; and so do semicolons")
+(puts "")
+(0)
@@ -0,0 +1,21 @@
+; Lists are stored in cdr-coded chunks of unboxed numbers
+(defvar l
+  (list 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19 20
+        21 22 23 24 25 26 27 28 29 30 31 32 33 34 35 36 37 38 39 40))
+
+; cons onto the front reuses the free slot in front of the list
+(defvar l2 (cons 0 l))
+
+(printf "length %f" (length l2))
+(puts "")
+(printf "car %f, second %f" (car l2) (car (cdr l2)))
+(puts "")
+(printf "nth 35 is %f" (nth 35 l2))
+(puts "")
+(printf "nil has length %f" (length nil))
+(puts "")
+(printf "car of nil is %f, car of (cdr (list 1)) is %f"
+        (car nil) (car (cdr (list 1))))
+(puts "")
+
+(0)
@@ -0,0 +1,27 @@
+(defmacro (square x)
+  (* x x))
+
+(defmacro (unless test &rest body)
+  (if test 0 (let () body)))
+
+(defmacro (incf var)
+  (setq var (+ var 1)))
+
+(defmacro (clamp01 x)
+  (cond ((< x 0) 0)
+        ((> x 1) 1)
+        (else x)))
+
+(defun (count-small n)
+  (let ((small 0))
+    (loop i n
+          (unless (> (square i) 50)
+            (incf small)))
+    small))
+
+; The second (square 3) reuses the first expansion
+(printf "%f %f %f" (square 3) (square 3) (count-small 20))
+(puts "")
+(printf "%f %f %f" (clamp01 -2) (clamp01 0.25) (clamp01 7))
+(puts "")
+(0)
@@ -0,0 +1,13 @@
+; A library module: compile with -target object to get mathlib.o and the
+; interface mathlib.lci that other modules import
+(export square poly)
+
+(defun (square a)
+  (* a a))
+
+; Not exported, so it is internal to this module
+(defun (twice a)
+  (+ a a))
+
+(defun (poly a b)
+  (+ (square a) (twice b)))
@@ -0,0 +1,32 @@
+; defun-memo caches results keyed on the arguments. make check runs this with
+; -fmemo-stats and fails on any eviction: every table below holds far fewer
+; keys than its capacity, so all of them must stay cached.
+(defun-memo (norm2 a b)
+  (+ (* a a) (* b b)))
+
+(defun (twice a b)
+  (+ (norm2 a b) (norm2 a b)))
+
+(printf "twice norm2 of 3 4 is %f" (twice 3 4))
+(puts "")
+(printf "norm2 of 3 4 is %f" (norm2 3 4))
+(puts "")
+
+; Exponential without the cache, 81 distinct keys with it
+(defun-memo (fib n)
+  (if (< n 2)
+      n
+      (+ (fib (- n 1)) (fib (- n 2)))))
+
+; Monotone paths through a 16x16 grid, 289 distinct keys
+(defun-memo (paths r c)
+  (if (< r 1)
+      1
+      (if (< c 1)
+          1
+          (+ (paths (- r 1) c) (paths r (- c 1))))))
+
+(printf "fib 80 is %f, paths through 16x16 is %f" (fib 80) (paths 16 16))
+(puts "")
+
+(0)
@@ -0,0 +1,20 @@
+; (declare multiversion ...) builds a defun for each instruction set listed
+; and for the baseline. Native programs pick the best version their CPU
+; supports when they are loaded:
+;   lc -target native -O3 t/multiversion.lisp && ./a.out
+; The interpreter compiles for the host and uses that version directly. Add
+; -fdump-multiversion to see the versions chosen.
+(defun (dot-self n)
+  (declare multiversion avx512 avx2 default)
+  (let ((acc 0))
+    (loop i n
+      (setq acc (+ acc (* i i))))
+    acc))
+
+(defun-memo (tri n)
+  (declare multiversion avx2)
+  (if (< n 1)
+    0
+    (+ n (tri (+ n -1)))))
+
+(printf "dot-self 100 is %f, tri 50 is %f" (dot-self 100) (tri 50))
@@ -0,0 +1,13 @@
+; The body runs on the runtime's thread pool, so the iterations may print in
+; any order. LCRT_NUM_THREADS and LCRT_GRAIN control the thread count and the
+; number of iterations handed out as one unit of work.
+(defun (work i scale)
+  (* i scale))
+
+(defvar scale (+ 1 1))
+
+(parallel-for i 0 16
+  (printf "%f " (work i scale)))
+(puts "")
+
+(0)
@@ -0,0 +1,15 @@
+; Profile-guided optimization:
+;   lc -target native -fprofile-generate t/pgo.lisp && ./a.out
+;   llvm-profdata merge -o pgo.profdata default_*.profraw
+;   lc -fprofile-use=pgo.profdata t/pgo.lisp
+(defun (hot a)
+  (declare noinline)
+  (* a a))
+
+(parallel-for i 0 100
+  (hot i))
+
+(printf "hot of 12 is %f" (hot 12))
+(puts "")
+
+(0)
@@ -0,0 +1,11 @@
+(defvar third (+ 0.1 0.2))
+
+(print-str "shortest: ")
+(print-num third)
+(newline)
+(print-num 1e21)
+(newline)
+(printf "fixed %.3f, general %g, sci %E, %s%%" third 1e21 third "literal")
+(puts "")
+(puts "done")
+(0)
@@ -0,0 +1,47 @@
+; Allocations made inside with-region are released when it exits.
+(defun (area w h)
+  (with-region
+    (* w h)))
+
+(printf "area %f" (with-region (area 3 4)))
+(puts "")
+
+; Builds n lists in a region and returns where the last one was put. The list
+; itself is gone once the region exits, only its address is compared. Each
+; list takes a list chunk of its own, so 1000 of them span several arena
+; chunks, which are handed back on exit and reused in the same order.
+(defun (last-list n)
+  (with-region
+    (let ((l 0))
+      (loop i n
+            (setq l (list i i i)))
+      l)))
+
+(defvar first (last-list 1000))
+(defvar same
+  (let ((k 0))
+    (loop i 100
+          (if (= (last-list 1000) first)
+              (setq k (+ k 1))
+              0))
+    k))
+(printf "region memory reused %f of 100 times" same)
+(puts "")
+
+; A future's allocations go to the region that awaits it, so the list it
+; returns is still there after await. Lists built by parallel-for bodies are
+; released as each subrange finishes.
+(defun (build n)
+  (list n (+ n 1) (+ n 2)))
+
+(printf "from a future %f"
+        (with-region
+          (let ((f (spawn (build 7))))
+            (nth 2 (await f)))))
+(puts "")
+(parallel-for i 0 64
+  (last-list 100))
+(printf "lists built in parallel")
+(puts "")
+
+(0)
@@ -0,0 +1,13 @@
+; spawn queues an expression on the runtime's thread pool and evaluates to a
+; future; await waits for it and returns its value.
+(defun (work a b)
+  (* (+ a b) (+ a b)))
+
+(defvar base 1)
+(defvar x (spawn (work base 2)))
+(defvar y (spawn (work 3 4)))
+
+(printf "sum of futures %f" (+ (await x) (await y)))
+(puts "")
+
+(0)
@@ -0,0 +1,33 @@
+; A general helper that callers mostly use with a fixed mode
+(defun (combine mode a b)
+  (case mode
+    (0 (+ a b))
+    (1 (* a b))
+    (2 (if (< a b) a b))
+    (3 (if (> a b) a b))
+    (otherwise 0)))
+
+(defun (power x n)
+  (let ((r 1))
+    (loop i n
+          (setq r (* r x)))
+    r))
+
+(defun (sum-to n mode)
+  (let ((acc 0))
+    (loop i n
+          (setq acc (combine mode acc i)))
+    acc))
+
+(defun (triangle n)
+  (sum-to n 0))
+
+; triangle only forwards to sum-to, and sum-to loops over combine, but the
+; constants still reach the bottom of the chain: triangle for 10 calls sum-to
+; for 10 and mode 0, which calls combine for mode 0, a single add. combine
+; with all constants folds to a single value.
+(printf "sum %f, sum %f, max %f" (triangle 10) (triangle 10) (combine 3 4 9))
+(puts "")
+(printf "2^10 is %f, x^2 is %f" (power 2 10) (power 1.5 2))
+(puts "")
+(0)
@@ -0,0 +1,188 @@
+#include "target.h"
+#include "config.h"
+#include "err.h"
+#include "lower.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/Triple.h"
+#include "llvm/MC/MCSubtargetInfo.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+
+struct ISA {
+  std::string name, feature;
+  unsigned bit;
+};
+static std::vector<ISA> isas{
+#define ISA_PROC(X, NAME, FEATURE, BIT) {NAME, FEATURE, BIT},
+#include "isa.def"
+#undef ISA_PROC
+};
+
+static std::vector<std::pair<Function *, std::vector<std::string>>> versioned;
+
+std::string target_cpu() {
+  auto cpu = march();
+  if (cpu == "native")
+    return sys::getHostCPUName().str();
+  return cpu;
+}
+
+void add_multiversion(Function *f, std::vector<std::string> isas) {
+  versioned.emplace_back(f, isas);
+}
+
+static void add_features(Function &f, std::string features) {
+  if (f.hasFnAttribute("target-features"))
+    features = f.getFnAttribute("target-features").getValueAsString().str() +
+               "," + features;
+  f.addFnAttr("target-features", features);
+}
+
+// Host features as a target-features string, for -march=native
+static std::string host_features() {
+  StringMap<bool> host;
+  std::string features;
+  if (!sys::getHostCPUFeatures(host))
+    return features;
+  for (auto &f : host) {
+    if (!features.empty())
+      features += ",";
+    features += (f.second ? "+" : "-") + f.first().str();
+  }
+  return features;
+}
+
+static void apply_cpu() {
+  auto cpu = target_cpu();
+  if (cpu.empty())
+    return;
+
+  auto triple = sys::getDefaultTargetTriple();
+  InitializeNativeTarget();
+  std::string err;
+  if (auto *t = TargetRegistry::lookupTarget(triple, err)) {
+    std::unique_ptr<MCSubtargetInfo> sti(
+        t->createMCSubtargetInfo(triple, "generic", ""));
+    if (!sti->isCPUStringValid(cpu)) {
+      reg_msg(LC_MSG{"target", "unknown cpu '" + cpu + "' for -march",
+                     MSG_ERROR});
+      return;
+    }
+  }
+
+  auto features = march() == "native" ? host_features() : "";
+  for (auto &f : get_module()) {
+    if (f.isDeclaration())
+      continue;
+    f.addFnAttr("target-cpu", cpu);
+    if (!features.empty())
+      add_features(f, features);
+  }
+}
+
+// The JIT compiles for the machine it runs on, and so does lc when it hands
+// the module to it: the best version can be chosen right away
+static void choose_version(Function *f, std::vector<const ISA *> &vs) {
+  StringMap<bool> host;
+  sys::getHostCPUFeatures(host);
+  for (auto *isa : vs)
+    if (host.lookup(isa->feature)) {
+      if (dump("multiversion"))
+        printf("using %s version of %s\n", isa->name.c_str(),
+               f->getName().str().c_str());
+      add_features(*f, "+" + isa->feature);
+      return;
+    }
+  if (dump("multiversion"))
+    printf("using default version of %s\n", f->getName().str().c_str());
+}
+
+/**
+ * f becomes f.default, a clone f.<isa> is made for every instruction set, and
+ * f itself is replaced by an ifunc whose resolver tests the features libgcc's
+ * __cpu_indicator_init fills into __cpu_model.
+ */
+static void dispatch(Function *f, std::vector<const ISA *> &vs) {
+  auto &m = get_module();
+  auto n = f->getName().str();
+  auto linkage = f->getLinkage();
+
+  std::vector<Function *> clones;
+  for (auto *isa : vs) {
+    ValueToValueMapTy vmap;
+    auto *c = CloneFunction(f, vmap);
+    c->setName(n + "." + isa->name);
+    c->setLinkage(GlobalValue::InternalLinkage);
+    add_features(*c, "+" + isa->feature);
+    // Recursion stays within the version
+    f->replaceUsesWithIf(c, [c](Use &u) {
+      auto *i = dyn_cast<Instruction>(u.getUser());
+      return i && i->getFunction() == c;
+    });
+    clones.push_back(c);
+  }
+  f->setName(n + ".default");
+  f->setLinkage(GlobalValue::InternalLinkage);
+
+  auto *fpt = f->getFunctionType()->getPointerTo();
+  auto *resolver =
+      Function::Create(FunctionType::get(fpt, false),
+                       GlobalValue::InternalLinkage, n + ".resolver", m);
+  auto *ifunc = GlobalIFunc::create(f->getFunctionType(), 0, linkage, n,
+                                    resolver, &m);
+  f->replaceUsesWithIf(ifunc, [f](Use &u) {
+    auto *i = dyn_cast<Instruction>(u.getUser());
+    return !i || i->getFunction() != f;
+  });
+
+  IRBuilder<> b(BasicBlock::Create(context(), "entry", resolver));
+  auto *i32 = b.getInt32Ty();
+  auto *model_ty =
+      StructType::get(context(), {i32, i32, i32, ArrayType::get(i32, 1)});
+  auto *model = m.getOrInsertGlobal("__cpu_model", model_ty);
+  b.CreateCall(m.getOrInsertFunction("__cpu_indicator_init", b.getVoidTy()));
+  auto *word = b.CreateLoad(
+      i32, b.CreateConstInBoundsGEP2_32(
+               ArrayType::get(i32, 1),
+               b.CreateStructGEP(model_ty, model, 3), 0, 0),
+      "features");
+  Value *chosen = f;
+  for (size_t i = vs.size(); i-- > 0;) {
+    auto *has = b.CreateICmpNE(b.CreateAnd(word, 1u << vs[i]->bit),
+                               b.getInt32(0), "has." + vs[i]->name);
+    chosen = b.CreateSelect(has, clones[i], chosen);
+  }
+  b.CreateRet(chosen);
+
+  if (dump("multiversion"))
+    for (auto *c : clones)
+      printf("dispatching %s to %s\n", n.c_str(), c->getName().str().c_str());
+}
+
+void lower_targets() {
+  apply_cpu();
+
+  bool x86 = Triple(sys::getDefaultTargetTriple()).isX86();
+  for (auto &[f, names] : versioned) {
+    if (!x86) {
+      reg_msg(LC_MSG{"target",
+                     "multiversion needs an x86 target, only the default "
+                     "version of '" + f->getName().str() + "' is built",
+                     MSG_WARN});
+      continue;
+    }
+    std::vector<const ISA *> vs;
+    for (auto &isa : isas)
+      if (std::find(names.begin(), names.end(), isa.name) != names.end())
+        vs.push_back(&isa);
+    if (vs.empty())
+      continue;
+    if (target() == TARGET::INTERPRET)
+      choose_version(f, vs);
+    else
+      dispatch(f, vs);
+  }
+  versioned.clear();
+}
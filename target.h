@@ -0,0 +1,23 @@
+#pragma once
+#include "ll.h"
+
+/**
+ * Code generation for particular CPUs.
+ *
+ * -march=<cpu> (or -mcpu=<cpu>) sets the CPU every function is compiled for.
+ * A defun with '(declare multiversion <isa>...)' is compiled once for each
+ * instruction set in isa.def plus once for the baseline, and an ifunc picks
+ * the best one the running CPU supports when the program is loaded. isa.def
+ * lists the instruction sets most capable first, which is the order they are
+ * tried in; the last field is their bit in libgcc's __cpu_model.
+ */
+
+// The CPU from -march, with 'native' resolved to the host, or empty
+std::string target_cpu();
+
+// f is to be versioned for each instruction set named in isas
+void add_multiversion(Function *f, std::vector<std::string> isas);
+
+// Apply -march and emit the versions and dispatchers of everything passed to
+// add_multiversion. Called once the module is complete.
+void lower_targets();